@@ -6,6 +6,9 @@
 
 #include "log.h"
 #include "endian.h"
+#include "dns.h"
+#include "hook.h"
+#include "iomanager.h"
 
 namespace CppServer {
 
@@ -87,6 +90,22 @@ bool Address::Lookup(std::vector<Address::ptr>& result, const std::string& host,
     if (node.empty()) {
         node = host;
     }
+    // IOManager的协程里getaddrinfo会卡住整个线程, 非数字地址走协程版的解析
+    if (IOManager::GetThis() && is_hook_enable()
+            && (family == AF_INET || family == AF_INET6 || family == AF_UNSPEC)
+            && (!service || (*service && strspn(service, "0123456789") == strlen(service)))) {
+        in6_addr tmp;
+        if (inet_pton(AF_INET, node.c_str(), &tmp) <= 0
+                && inet_pton(AF_INET6, node.c_str(), &tmp) <= 0) {
+            uint16_t port = service ? atoi(service) : 0;
+            if (!DnsMgr::GetInstance()->resolve(result, node, family, port)) {
+                CPPSERVER_LOG_ERROR(g_logger) << "Address::Lookup resolve(" << host << ", "
+                    << family << ", " << type << ") fail";
+                return false;
+            }
+            return true;
+        }
+    }
     int error = getaddrinfo(node.c_str(), service, &hints, &results);
     if (error) {
         CPPSERVER_LOG_ERROR(g_logger) << "Address::Lookup getaddress(" << host << ", "
@@ -0,0 +1,236 @@
+#include "buffer_pool.h"
+#include "config.h"
+#include "log.h"
+
+#include <algorithm>
+
+namespace CppServer {
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_buffer_pool_thread_cache =
+    CppServer::Config::Lookup("buffer_pool.thread_cache_bytes", (uint64_t) (256 * 1024),
+                              "buffer pool per-thread cache bytes per size class");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_buffer_pool_max_idle =
+    CppServer::Config::Lookup("buffer_pool.max_idle_bytes", (uint64_t) (64 * 1024 * 1024),
+                              "buffer pool max idle bytes kept in the global free lists");
+
+static uint64_t s_thread_cache_bytes = 256 * 1024;
+static uint64_t s_max_idle_bytes = 64 * 1024 * 1024;
+
+struct _BufferPoolIniter {
+    _BufferPoolIniter() {
+        s_thread_cache_bytes = g_buffer_pool_thread_cache->getValue();
+        g_buffer_pool_thread_cache->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            CPPSERVER_LOG_INFO(g_logger) << "buffer pool thread cache bytes change from "
+                                         << old_value << " to " << new_value;
+            s_thread_cache_bytes = new_value;
+        });
+        s_max_idle_bytes = g_buffer_pool_max_idle->getValue();
+        g_buffer_pool_max_idle->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            CPPSERVER_LOG_INFO(g_logger) << "buffer pool max idle bytes change from "
+                                         << old_value << " to " << new_value;
+            s_max_idle_bytes = new_value;
+        });
+    }
+};
+
+static _BufferPoolIniter s_buffer_pool_initer;
+
+static const size_t s_class_size[BufferPool::kClassCount] = {
+    256, 1024, 4096, 16 * 1024, 64 * 1024
+};
+
+static int SizeClass(size_t size) {
+    for (int i = 0; i < BufferPool::kClassCount; ++i) {
+        if (size <= s_class_size[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+Buffer::Buffer(size_t size, int size_class)
+    : m_data(new char[size])
+    , m_size(size)
+    , m_class(size_class) {
+}
+
+Buffer::~Buffer() {
+    delete[] m_data;
+}
+
+BufferSlice::BufferSlice()
+    : m_offset(0)
+    , m_length(0) {
+}
+
+BufferSlice::BufferSlice(Buffer::ptr buffer, size_t offset, size_t length)
+    : m_buffer(buffer)
+    , m_offset(offset)
+    , m_length(length) {
+}
+
+BufferSlice::BufferSlice(size_t length)
+    : m_buffer(BufferPoolMgr::GetInstance()->allocate(length))
+    , m_offset(0)
+    , m_length(length) {
+}
+
+BufferSlice BufferSlice::slice(size_t offset, size_t length) const {
+    if (offset >= m_length) {
+        return BufferSlice();
+    }
+    return BufferSlice(m_buffer, m_offset + offset, std::min(length, m_length - offset));
+}
+
+void BufferSlice::reset() {
+    m_buffer.reset();
+    m_offset = m_length = 0;
+}
+
+std::ostream& BufferPool::Stats::dump(std::ostream& os) const {
+    os << "allocs=" << allocs
+       << " thread_hits=" << threadHits
+       << " pool_hits=" << poolHits
+       << " in_use=" << inUse
+       << " in_use_peak=" << inUsePeak
+       << " idle=" << idle;
+    return os;
+}
+
+// 线程退出时把缓存的块还给全局链表
+struct BufferPool::ThreadCache {
+    std::vector<Buffer*> free[kClassCount];
+    size_t bytes[kClassCount] = {0};
+
+    ~ThreadCache();
+};
+
+static thread_local bool t_cache_destroyed = false;
+
+BufferPool::ThreadCache::~ThreadCache() {
+    t_cache_destroyed = true;
+    BufferPool* pool = BufferPoolMgr::GetInstance();
+    for (int i = 0; i < kClassCount; ++i) {
+        for (auto& b : free[i]) {
+            pool->releaseToPool(b);
+        }
+    }
+}
+
+BufferPool::ThreadCache* BufferPool::GetThreadCache() {
+    if (t_cache_destroyed) {
+        return nullptr;
+    }
+    static thread_local ThreadCache t_cache;
+    return &t_cache;
+}
+
+BufferPool::BufferPool()
+    : m_idle(0)
+    , m_inUse(0)
+    , m_inUsePeak(0)
+    , m_allocs(0)
+    , m_threadHits(0)
+    , m_poolHits(0) {
+}
+
+BufferPool::~BufferPool() {
+    trim();
+}
+
+size_t BufferPool::ClassSize(int size_class) {
+    return size_class >= 0 && size_class < kClassCount ? s_class_size[size_class] : 0;
+}
+
+Buffer::ptr BufferPool::allocate(size_t size) {
+    ++m_allocs;
+    int cls = SizeClass(size);
+    Buffer* buffer = nullptr;
+    if (cls < 0) {
+        buffer = new Buffer(size, -1);
+    } else {
+        ThreadCache* tc = GetThreadCache();
+        if (tc && !tc->free[cls].empty()) {
+            buffer = tc->free[cls].back();
+            tc->free[cls].pop_back();
+            tc->bytes[cls] -= buffer->size();
+            ++m_threadHits;
+        } else {
+            MutexType::Lock lock(m_mutex);
+            if (!m_free[cls].empty()) {
+                buffer = m_free[cls].back();
+                m_free[cls].pop_back();
+                m_idle -= buffer->size();
+                ++m_poolHits;
+            }
+        }
+        if (!buffer) {
+            buffer = new Buffer(s_class_size[cls], cls);
+        }
+    }
+
+    uint64_t in_use = m_inUse += buffer->size();
+    uint64_t peak = m_inUsePeak;
+    while (in_use > peak && !m_inUsePeak.compare_exchange_weak(peak, in_use)) {
+    }
+    return Buffer::ptr(buffer, std::bind(&BufferPool::release, this, std::placeholders::_1));
+}
+
+void BufferPool::release(Buffer* buffer) {
+    m_inUse -= buffer->size();
+    if (buffer->m_class < 0) {
+        delete buffer;
+        return;
+    }
+    ThreadCache* tc = GetThreadCache();
+    int cls = buffer->m_class;
+    if (tc && tc->bytes[cls] + buffer->size() <= s_thread_cache_bytes) {
+        tc->free[cls].push_back(buffer);
+        tc->bytes[cls] += buffer->size();
+        return;
+    }
+    releaseToPool(buffer);
+}
+
+void BufferPool::releaseToPool(Buffer* buffer) {
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_idle + buffer->size() <= s_max_idle_bytes) {
+            m_free[buffer->m_class].push_back(buffer);
+            m_idle += buffer->size();
+            return;
+        }
+    }
+    delete buffer;
+}
+
+void BufferPool::trim() {
+    std::vector<Buffer*> frees;
+    {
+        MutexType::Lock lock(m_mutex);
+        for (int i = 0; i < kClassCount; ++i) {
+            frees.insert(frees.end(), m_free[i].begin(), m_free[i].end());
+            m_free[i].clear();
+        }
+        m_idle = 0;
+    }
+    for (auto& b : frees) {
+        delete b;
+    }
+}
+
+BufferPool::Stats BufferPool::getStats() {
+    Stats stats;
+    stats.allocs = m_allocs;
+    stats.threadHits = m_threadHits;
+    stats.poolHits = m_poolHits;
+    stats.inUse = m_inUse;
+    stats.inUsePeak = m_inUsePeak;
+    stats.idle = m_idle;
+    return stats;
+}
+
+}  // CppServer
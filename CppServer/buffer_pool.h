@@ -0,0 +1,105 @@
+#ifndef __CPPSERVER_BUFFER_POOL_H__
+#define __CPPSERVER_BUFFER_POOL_H__
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <ostream>
+#include "thread.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace CppServer {
+
+class BufferPool;
+
+// 池化的内存块, 最后一个引用释放时回到池里
+class Buffer : Noncopyable {
+friend class BufferPool;
+public:
+    typedef std::shared_ptr<Buffer> ptr;
+
+    ~Buffer();
+
+    char* data() const { return m_data; }
+    // 实际大小, 按大小档向上取整, 可能比申请的大
+    size_t size() const { return m_size; }
+private:
+    Buffer(size_t size, int size_class);
+private:
+    char* m_data;
+    size_t m_size;
+    int m_class;    // -1为超过最大档, 不进池
+};
+
+// 引用计数的切片, 多个切片共享同一个Buffer
+class BufferSlice {
+public:
+    BufferSlice();
+    BufferSlice(Buffer::ptr buffer, size_t offset, size_t length);
+    // 从池里分配length字节
+    explicit BufferSlice(size_t length);
+
+    char* data() const { return m_buffer ? m_buffer->data() + m_offset : nullptr; }
+    size_t size() const { return m_length; }
+    bool empty() const { return m_length == 0; }
+
+    // 相对本切片的子切片, 越界部分截掉
+    BufferSlice slice(size_t offset, size_t length = (size_t) -1) const;
+    const Buffer::ptr& getBuffer() const { return m_buffer; }
+    void reset();
+private:
+    Buffer::ptr m_buffer;
+    size_t m_offset;
+    size_t m_length;
+};
+
+// 按大小档(256B/1K/4K/16K/64K)复用内存块
+// 每个线程先用自己的缓存, 不够再到全局空闲链表取; 全局空闲的总字节数超过上限就直接释放
+class BufferPool : Noncopyable {
+public:
+    typedef Spinlock MutexType;
+    static const int kClassCount = 5;
+
+    struct Stats {
+        uint64_t allocs = 0;        // 分配次数
+        uint64_t threadHits = 0;    // 命中线程缓存
+        uint64_t poolHits = 0;      // 命中全局空闲链表
+        uint64_t inUse = 0;         // 使用中的字节数
+        uint64_t inUsePeak = 0;     // 使用中字节数的最高水位
+        uint64_t idle = 0;          // 全局空闲链表里的字节数
+
+        std::ostream& dump(std::ostream& os) const;
+    };
+
+    BufferPool();
+    ~BufferPool();
+
+    Buffer::ptr allocate(size_t size);
+    // 释放全局空闲链表里的所有块
+    void trim();
+    Stats getStats();
+
+    static size_t ClassSize(int size_class);
+private:
+    struct ThreadCache;
+
+    void release(Buffer* buffer);
+    void releaseToPool(Buffer* buffer);
+    static ThreadCache* GetThreadCache();
+private:
+    MutexType m_mutex;
+    std::vector<Buffer*> m_free[kClassCount];
+    std::atomic<uint64_t> m_idle;
+    std::atomic<uint64_t> m_inUse;
+    std::atomic<uint64_t> m_inUsePeak;
+    std::atomic<uint64_t> m_allocs;
+    std::atomic<uint64_t> m_threadHits;
+    std::atomic<uint64_t> m_poolHits;
+};
+
+typedef Singleton<BufferPool> BufferPoolMgr;
+
+}  // CppServer
+
+#endif  // __CPPSERVER_BUFFER_POOL_H__
@@ -0,0 +1,129 @@
+#ifndef __CPPSERVER_BYTEARRAY_H__
+#define __CPPSERVER_BYTEARRAY_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "buffer_pool.h"
+
+namespace CppServer {
+
+// 二进制序列化缓冲区, 由固定大小的内存块串成链表
+// 扩容只追加新块, 不搬移已有数据; 可以把可读/可写区域直接导出为iovec交给readv/writev
+class ByteArray {
+public:
+    typedef std::shared_ptr<ByteArray> ptr;
+
+    struct Node {
+        Node(size_t s);
+        Node();
+        ~Node();
+
+        Buffer::ptr buffer;     // 块内存从BufferPool取
+        char* ptr;
+        Node* next;
+        size_t size;
+    };
+
+    ByteArray(size_t base_size = 4096);
+    ~ByteArray();
+
+    // 定长整数
+    void writeFint8(int8_t value);
+    void writeFuint8(uint8_t value);
+    void writeFint16(int16_t value);
+    void writeFuint16(uint16_t value);
+    void writeFint32(int32_t value);
+    void writeFuint32(uint32_t value);
+    void writeFint64(int64_t value);
+    void writeFuint64(uint64_t value);
+
+    // 变长整数(varint), 有符号的先做zigzag
+    void writeInt32(int32_t value);
+    void writeUint32(uint32_t value);
+    void writeInt64(int64_t value);
+    void writeUint64(uint64_t value);
+
+    void writeFloat(float value);
+    void writeDouble(double value);
+
+    // 长度前缀分别为uint16/uint32/uint64/varint
+    void writeStringF16(const std::string& value);
+    void writeStringF32(const std::string& value);
+    void writeStringF64(const std::string& value);
+    void writeStringVint(const std::string& value);
+    void writeStringWithoutLength(const std::string& value);
+
+    // 读越界抛std::out_of_range
+    int8_t readFint8();
+    uint8_t readFuint8();
+    int16_t readFint16();
+    uint16_t readFuint16();
+    int32_t readFint32();
+    uint32_t readFuint32();
+    int64_t readFint64();
+    uint64_t readFuint64();
+
+    int32_t readInt32();
+    uint32_t readUint32();
+    int64_t readInt64();
+    uint64_t readUint64();
+
+    float readFloat();
+    double readDouble();
+
+    std::string readStringF16();
+    std::string readStringF32();
+    std::string readStringF64();
+    std::string readStringVint();
+
+    // 只保留一个块, 位置和大小清零
+    void clear();
+
+    void write(const void* buf, size_t size);
+    void read(void* buf, size_t size);
+    // 从指定位置读, 不移动当前位置
+    void read(void* buf, size_t size, size_t position) const;
+
+    size_t getPosition() const { return m_position; }
+    // 移动当前位置, 超过数据大小时数据大小跟着变(recv进getWriteBuffers之后用)
+    void setPosition(size_t v);
+
+    bool writeToFile(const std::string& name) const;
+    bool readFromFile(const std::string& name);
+
+    size_t getBaseSize() const { return m_baseSize; }
+    size_t getReadSize() const { return m_size - m_position; }
+    size_t getSize() const { return m_size; }
+
+    // 默认网络字节序(大端)
+    bool isLittleEndian() const;
+    void setIsLittleEndian(bool val);
+
+    // 当前位置之后的数据
+    std::string toString() const;
+    std::string toHexString() const;
+
+    // 从当前位置开始最多len字节的可读区域, 不移动位置; 返回实际长度
+    uint64_t getReadBuffers(std::vector<iovec>& buffers, uint64_t len = ~0ull) const;
+    uint64_t getReadBuffers(std::vector<iovec>& buffers, uint64_t len, uint64_t position) const;
+    // 从当前位置开始len字节的可写区域, 不够就扩容; 写入后用setPosition推进
+    uint64_t getWriteBuffers(std::vector<iovec>& buffers, uint64_t len);
+private:
+    void addCapacity(size_t size);
+    size_t getCapacity() const { return m_capacity - m_position; }
+private:
+    size_t m_baseSize;
+    size_t m_position;
+    size_t m_capacity;
+    size_t m_size;
+    int8_t m_endian;
+    Node* m_root;
+    Node* m_cur;
+};
+
+}  // CppServer
+
+#endif  // __CPPSERVER_BYTEARRAY_H__
@@ -0,0 +1,420 @@
+#include "dns.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include "scheduler.h"
+#include "hook.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace CppServer {
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+static CppServer::ConfigVar<std::vector<std::string> >::ptr g_dns_servers =
+    CppServer::Config::Lookup("dns.servers", std::vector<std::string>(), "dns servers(ip or ip:port), empty for /etc/resolv.conf");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_dns_timeout =
+    CppServer::Config::Lookup("dns.timeout", (uint64_t) 2000, "dns query timeout per server(ms)");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_dns_attempts =
+    CppServer::Config::Lookup("dns.attempts", (uint32_t) 2, "dns query rounds over all servers");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_dns_negative_ttl =
+    CppServer::Config::Lookup("dns.negative_ttl", (uint32_t) 30, "dns negative answer cache time(s)");
+
+static CppServer::ConfigVar<std::string>::ptr g_dns_hosts =
+    CppServer::Config::Lookup("dns.hosts", std::string("/etc/hosts"), "hosts file, empty for none");
+
+static const char* s_resolv_conf = "/etc/resolv.conf";
+
+static std::string normalize(const std::string& name) {
+    std::string rt = name;
+    std::transform(rt.begin(), rt.end(), rt.begin(), ::tolower);
+    if (!rt.empty() && rt[rt.size() - 1] == '.') {
+        rt.resize(rt.size() - 1);
+    }
+    return rt;
+}
+
+// "ip", "ip:port" 或 "[ipv6]:port"
+static IPAddress::ptr parse_server(const std::string& str) {
+    std::string host = str;
+    uint16_t port = 53;
+    if (!str.empty() && str[0] == '[') {
+        size_t end = str.find(']');
+        if (end == std::string::npos) {
+            return nullptr;
+        }
+        host = str.substr(1, end - 1);
+        if (end + 1 < str.size() && str[end + 1] == ':') {
+            port = atoi(str.c_str() + end + 2);
+        }
+    } else if (std::count(str.begin(), str.end(), ':') == 1) {
+        size_t pos = str.find(':');
+        host = str.substr(0, pos);
+        port = atoi(str.c_str() + pos + 1);
+    }
+    return IPAddress::Create(host.c_str(), port);
+}
+
+static uint16_t read16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t read32(const uint8_t* p) {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// 跳过报文中的一个名字(可能是压缩指针)
+static bool skip_name(const uint8_t* buf, size_t len, size_t& pos) {
+    while (pos < len) {
+        uint8_t c = buf[pos];
+        if ((c & 0xC0) == 0xC0) {
+            pos += 2;
+            return pos <= len;
+        }
+        if (c == 0) {
+            ++pos;
+            return true;
+        }
+        pos += c + 1;
+    }
+    return false;
+}
+
+// 标准查询报文: 头部 + 一个问题, 期望递归
+static bool build_query(std::string& out, uint16_t id, const std::string& name,
+                        DnsResolver::Type type) {
+    out.clear();
+    uint8_t header[12] = {0};
+    header[0] = id >> 8;
+    header[1] = id & 0xFF;
+    header[2] = 0x01;   // RD
+    header[5] = 1;      // QDCOUNT
+    out.append((const char*) header, sizeof(header));
+
+    size_t begin = 0;
+    while (begin < name.size()) {
+        size_t end = name.find('.', begin);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+        size_t label = end - begin;
+        if (label == 0 || label > 63) {
+            return false;
+        }
+        out.push_back((char) label);
+        out.append(name, begin, label);
+        begin = end + 1;
+    }
+    out.push_back(0);
+    uint8_t tail[4] = {0, (uint8_t) type, 0, 1};   // QTYPE, QCLASS=IN
+    out.append((const char*) tail, sizeof(tail));
+    return out.size() <= 512;
+}
+
+DnsResolver::DnsResolver()
+    : m_hostsMtime(-1)
+    , m_hostsChecked(0)
+    , m_queryCount(0)
+    , m_cacheHits(0) {
+    std::ifstream ifs(s_resolv_conf);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream iss(line);
+        std::string key, value;
+        if (!(iss >> key >> value) || key != "nameserver") {
+            continue;
+        }
+        // 去掉ipv6的scope
+        size_t pos = value.find('%');
+        if (pos != std::string::npos) {
+            value.resize(pos);
+        }
+        IPAddress::ptr addr = IPAddress::Create(value.c_str(), 53);
+        if (addr) {
+            m_resolvConfServers.push_back(addr);
+        }
+    }
+    if (m_resolvConfServers.empty()) {
+        m_resolvConfServers.push_back(IPAddress::Create("127.0.0.1", 53));
+    }
+}
+
+bool DnsResolver::resolve(std::vector<Address::ptr>& result, const std::string& name,
+                          int family, uint16_t port) {
+    std::string key = normalize(name);
+    std::vector<IPAddress::ptr> addrs;
+    if (!lookupHosts(addrs, key, family)) {
+        if (family == AF_INET || family == AF_UNSPEC) {
+            resolveType(addrs, key, A);
+        }
+        if (family == AF_INET6 || family == AF_UNSPEC) {
+            resolveType(addrs, key, AAAA);
+        }
+    }
+    // 缓存里的地址是共享的, 拷贝一份再设端口
+    for (auto& i : addrs) {
+        IPAddress::ptr addr = std::dynamic_pointer_cast<IPAddress>(
+                Address::Create(i->getAddr(), i->getAddrLen()));
+        if (addr) {
+            addr->setPort(port);
+            result.push_back(addr);
+        }
+    }
+    return !addrs.empty();
+}
+
+void DnsResolver::clearCache() {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_cache.clear();
+}
+
+size_t DnsResolver::getCacheSize() {
+    RWMutexType::ReadLock lock(m_mutex);
+    return m_cache.size();
+}
+
+bool DnsResolver::resolveType(std::vector<IPAddress::ptr>& result, const std::string& name,
+                              Type type) {
+    std::string key = std::to_string(type) + "/" + name;
+    uint64_t now = CppServer::GetCurrentMS();
+    {
+        RWMutexType::ReadLock lock(m_mutex);
+        auto it = m_cache.find(key);
+        if (it != m_cache.end() && it->second.expire > now) {
+            ++m_cacheHits;
+            result.insert(result.end(), it->second.addrs.begin(), it->second.addrs.end());
+            return !it->second.addrs.empty();
+        }
+    }
+
+    Query::ptr q;
+    {
+        Mutex::Lock lock(m_queryMutex);
+        auto it = m_queries.find(key);
+        if (it != m_queries.end()) {
+            // 已经有协程在查, 等它的结果
+            q = it->second;
+            q->waiters.push_back(std::make_pair(Scheduler::GetThis(), Fiber::GetThis()));
+            lock.unlock();
+            Fiber::YieldToHold();
+            result.insert(result.end(), q->addrs.begin(), q->addrs.end());
+            return q->ok;
+        }
+        q.reset(new Query);
+        m_queries[key] = q;
+    }
+
+    ++m_queryCount;
+    uint32_t ttl = 0;
+    q->ok = query(q->addrs, ttl, name, type);
+    if (q->ok || ttl) {
+        RWMutexType::WriteLock lock(m_mutex);
+        Entry& entry = m_cache[key];
+        entry.addrs = q->addrs;
+        entry.expire = CppServer::GetCurrentMS() + ttl * 1000ull;
+    }
+
+    std::vector<std::pair<Scheduler*, Fiber::ptr> > waiters;
+    {
+        Mutex::Lock lock(m_queryMutex);
+        m_queries.erase(key);
+        waiters.swap(q->waiters);
+    }
+    for (auto& i : waiters) {
+        i.first->schedule(i.second);
+    }
+    result.insert(result.end(), q->addrs.begin(), q->addrs.end());
+    return q->ok;
+}
+
+// 依次问每个服务器; ttl返回可以缓存的秒数, 否定应答返回false但ttl非0
+bool DnsResolver::query(std::vector<IPAddress::ptr>& result, uint32_t& ttl,
+                        const std::string& name, Type type) {
+    static std::atomic<uint16_t> s_id((uint16_t) CppServer::GetCurrentUS());
+    std::vector<IPAddress::ptr> servers = getServers();
+    uint64_t timeout = g_dns_timeout->getValue();
+    uint32_t attempts = std::max(g_dns_attempts->getValue(), (uint32_t) 1);
+    uint8_t buf[1500];
+    std::string req;
+
+    for (uint32_t i = 0; i < attempts * servers.size(); ++i) {
+        IPAddress::ptr server = servers[i % servers.size()];
+        uint16_t id = s_id++;
+        if (!build_query(req, id, name, type)) {
+            CPPSERVER_LOG_ERROR(g_logger) << "dns invalid name=" << name;
+            return false;
+        }
+        int fd = socket(server->getFamily(), SOCK_DGRAM, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct timeval tv{(time_t) (timeout / 1000), (suseconds_t) (timeout % 1000 * 1000)};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(fd, server->getAddr(), server->getAddrLen())
+                || send(fd, req.c_str(), req.size(), 0) != (ssize_t) req.size()) {
+            CPPSERVER_LOG_WARN(g_logger) << "dns send to " << *server << " errno="
+                << errno << " strerror=" << strerror(errno);
+            close(fd);
+            continue;
+        }
+
+        int rcode = -1;
+        while (true) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0) {
+                CPPSERVER_LOG_WARN(g_logger) << "dns query " << name << " from "
+                    << *server << " errno=" << errno << " strerror=" << strerror(errno);
+                break;
+            }
+            // 不是这次查询的应答就丢掉继续等
+            if (n < 12 || read16(buf) != id || !(buf[2] & 0x80)) {
+                continue;
+            }
+            rcode = buf[3] & 0x0F;
+            if (rcode != 0) {
+                break;
+            }
+            size_t len = n;
+            size_t pos = 12;
+            uint16_t qdcount = read16(buf + 4);
+            uint16_t ancount = read16(buf + 6);
+            bool bad = false;
+            for (uint16_t j = 0; j < qdcount && !bad; ++j) {
+                bad = !skip_name(buf, len, pos) || (pos += 4) > len;
+            }
+            uint32_t min_ttl = ~0u;
+            for (uint16_t j = 0; j < ancount && !bad; ++j) {
+                if (!skip_name(buf, len, pos) || pos + 10 > len) {
+                    bad = true;
+                    break;
+                }
+                uint16_t rtype = read16(buf + pos);
+                uint32_t rttl = read32(buf + pos + 4);
+                uint16_t rdlen = read16(buf + pos + 8);
+                pos += 10;
+                if (pos + rdlen > len) {
+                    bad = true;
+                    break;
+                }
+                // CNAME链上的A/AAAA都在应答区里, 按类型收集即可
+                if (rtype == A && rdlen == 4) {
+                    sockaddr_in addr;
+                    memset(&addr, 0, sizeof(addr));
+                    addr.sin_family = AF_INET;
+                    memcpy(&addr.sin_addr, buf + pos, 4);
+                    result.push_back(IPAddress::ptr(new IPv4Address(addr)));
+                    min_ttl = std::min(min_ttl, rttl);
+                } else if (rtype == AAAA && rdlen == 16) {
+                    sockaddr_in6 addr;
+                    memset(&addr, 0, sizeof(addr));
+                    addr.sin6_family = AF_INET6;
+                    memcpy(&addr.sin6_addr, buf + pos, 16);
+                    result.push_back(IPAddress::ptr(new IPv6Address(addr)));
+                    min_ttl = std::min(min_ttl, rttl);
+                }
+                pos += rdlen;
+            }
+            if (bad) {
+                CPPSERVER_LOG_WARN(g_logger) << "dns bad response for " << name
+                    << " from " << *server;
+                result.clear();
+                rcode = -1;
+            } else {
+                ttl = result.empty() ? g_dns_negative_ttl->getValue() : min_ttl;
+            }
+            break;
+        }
+        close(fd);
+
+        if (rcode == 0) {
+            return !result.empty();
+        } else if (rcode == 3) {
+            // NXDOMAIN, 问别的服务器也一样
+            ttl = g_dns_negative_ttl->getValue();
+            return false;
+        }
+    }
+    CPPSERVER_LOG_ERROR(g_logger) << "dns resolve " << name << " type=" << type << " failed";
+    return false;
+}
+
+bool DnsResolver::lookupHosts(std::vector<IPAddress::ptr>& result, const std::string& name,
+                              int family) {
+    checkHosts();
+    RWMutexType::ReadLock lock(m_mutex);
+    auto range = m_hosts.equal_range(name);
+    size_t old = result.size();
+    for (auto it = range.first; it != range.second; ++it) {
+        if (family == AF_UNSPEC || it->second->getFamily() == family) {
+            result.push_back(it->second);
+        }
+    }
+    return result.size() != old;
+}
+
+// 每秒最多stat一次hosts文件, 修改过就重新加载
+void DnsResolver::checkHosts() {
+    uint64_t now = CppServer::GetCurrentMS();
+    if (now < m_hostsChecked + 1000) {
+        return;
+    }
+    std::string path = g_dns_hosts->getValue();
+    struct stat st;
+    int64_t mtime = (path.empty() || stat(path.c_str(), &st)) ? 0 : (int64_t) st.st_mtime;
+
+    RWMutexType::WriteLock lock(m_mutex);
+    m_hostsChecked = now;
+    if (mtime == m_hostsMtime) {
+        return;
+    }
+    m_hostsMtime = mtime;
+    m_hosts.clear();
+    if (path.empty()) {
+        return;
+    }
+    std::ifstream ifs(path);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        size_t pos = line.find('#');
+        if (pos != std::string::npos) {
+            line.resize(pos);
+        }
+        std::istringstream iss(line);
+        std::string ip, host;
+        if (!(iss >> ip)) {
+            continue;
+        }
+        IPAddress::ptr addr = IPAddress::Create(ip.c_str(), 0);
+        if (!addr) {
+            continue;
+        }
+        while (iss >> host) {
+            m_hosts.insert(std::make_pair(normalize(host), addr));
+        }
+    }
+}
+
+std::vector<IPAddress::ptr> DnsResolver::getServers() {
+    std::vector<IPAddress::ptr> servers;
+    for (auto& i : g_dns_servers->getValue()) {
+        IPAddress::ptr addr = parse_server(i);
+        if (addr) {
+            servers.push_back(addr);
+        } else {
+            CPPSERVER_LOG_ERROR(g_logger) << "invalid dns server " << i;
+        }
+    }
+    if (servers.empty()) {
+        servers = m_resolvConfServers;
+    }
+    return servers;
+}
+
+}  // CppServer
@@ -0,0 +1,81 @@
+#ifndef __CPPSERVER_DNS_H__
+#define __CPPSERVER_DNS_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include "address.h"
+#include "thread.h"
+#include "fiber.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace CppServer {
+
+class Scheduler;
+
+// 协程版DNS解析: /etc/hosts -> 缓存 -> UDP查询
+// 查询走hook的socket, 等待应答时只让出协程; 同一个名字同时只有一个查询, 其它协程等它的结果
+class DnsResolver : Noncopyable {
+public:
+    typedef std::shared_ptr<DnsResolver> ptr;
+    typedef RWMutex RWMutexType;
+
+    enum Type {
+        A = 1,
+        AAAA = 28
+    };
+
+    DnsResolver();
+
+    // family为AF_INET/AF_INET6/AF_UNSPEC, 结果地址的端口设为port
+    // 必须在开启了hook的IOManager协程里调用
+    bool resolve(std::vector<Address::ptr>& result, const std::string& name,
+                 int family = AF_INET, uint16_t port = 0);
+
+    void clearCache();
+    size_t getCacheSize();
+    uint64_t getQueryCount() const { return m_queryCount; }
+    uint64_t getCacheHits() const { return m_cacheHits; }
+private:
+    struct Entry {
+        std::vector<IPAddress::ptr> addrs;  // 空为否定应答
+        uint64_t expire;                    // 绝对时间(ms)
+    };
+
+    // 正在进行的查询, 后来的协程挂在waiters上
+    struct Query {
+        typedef std::shared_ptr<Query> ptr;
+        bool ok = false;
+        std::vector<IPAddress::ptr> addrs;
+        std::vector<std::pair<Scheduler*, Fiber::ptr> > waiters;
+    };
+
+    bool resolveType(std::vector<IPAddress::ptr>& result, const std::string& name, Type type);
+    bool query(std::vector<IPAddress::ptr>& result, uint32_t& ttl,
+               const std::string& name, Type type);
+    bool lookupHosts(std::vector<IPAddress::ptr>& result, const std::string& name, int family);
+    void checkHosts();
+    std::vector<IPAddress::ptr> getServers();
+private:
+    RWMutexType m_mutex;
+    std::map<std::string, Entry> m_cache;                   // key: type + "/" + name
+    std::multimap<std::string, IPAddress::ptr> m_hosts;
+    int64_t m_hostsMtime;
+    std::atomic<uint64_t> m_hostsChecked;
+    std::vector<IPAddress::ptr> m_resolvConfServers;
+
+    Mutex m_queryMutex;
+    std::map<std::string, Query::ptr> m_queries;
+
+    std::atomic<uint64_t> m_queryCount;
+    std::atomic<uint64_t> m_cacheHits;
+};
+
+typedef Singleton<DnsResolver> DnsMgr;
+
+}  // CppServer
+
+#endif  // __CPPSERVER_DNS_H__
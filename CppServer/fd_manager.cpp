@@ -1,5 +1,10 @@
 #include "fd_manager.h"
 #include "hook.h"
+#include "log.h"
+#include "macro.h"
+#include "scheduler.h"
+#include <sched.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -9,17 +14,118 @@ namespace CppServer {
 FdCtx::FdCtx(int fd)
     : m_isInit(false)
     , m_isSocket(false)
+    , m_isPollable(false)
     , m_sysNonblock(false)
     , m_userNonblock(false)
     , m_isClosed(false)
     , m_fd(fd)
+    , m_state(FREE)
+    , m_generation(0)
     , m_recvTimeout(-1)
-    , m_sendTimeout(-1) {
-    init();
+    , m_sendTimeout(-1)
+    , m_iom(nullptr)
+    , m_events(0)
+    , m_sockError(0)
+    , m_deadlineIom(nullptr)
+    , m_deadlineIndex(0) {
 }
 
 FdCtx::~FdCtx() {}
 
+void* FdCtx::operator new(size_t size) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, alignof(FdCtx), size)) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void FdCtx::operator delete(void* ptr) {
+    free(ptr);
+}
+
+FdCtx::EventContext& FdCtx::getContext(int event) {
+    switch (event) {
+        case READ:
+            return m_read;
+        case WRITE:
+            return m_write;
+        case ERROR:
+            return m_error;
+        default:
+            CPPSERVER_ASSERT2(false, "getContext");
+    }
+}
+
+void FdCtx::resetContext(EventContext& ctx) {
+    ctx.scheduler = nullptr;
+    ctx.fiber.reset();
+    ctx.cb = nullptr;
+    ctx.deadline = 0;
+    notifyWatchers(ctx);
+}
+
+void FdCtx::notifyWatchers(EventContext& ctx) {
+    if (ctx.watchers.empty()) {
+        return;
+    }
+    std::vector<std::pair<const void*, std::function<void()> > > watchers;
+    watchers.swap(ctx.watchers);
+    for (auto& i : watchers) {
+        i.second();
+    }
+}
+
+bool FdCtx::takeTimedOut(int event) {
+    MutexType::Lock lock(m_mutex);
+    EventContext& ctx = getContext(event);
+    bool rt = ctx.timedout;
+    ctx.timedout = false;
+    return rt;
+}
+
+bool FdCtx::hasEvent(int event) {
+    MutexType::Lock lock(m_mutex);
+    return m_events & event;
+}
+
+int FdCtx::takeSockError() {
+    MutexType::Lock lock(m_mutex);
+    int err = m_sockError;
+    m_sockError = 0;
+    return err;
+}
+
+int FdCtx::getSockError() {
+    MutexType::Lock lock(m_mutex);
+    return m_sockError;
+}
+
+bool FdCtx::hasDeadline() const {
+    return ((m_events & READ) && m_read.deadline)
+        || ((m_events & WRITE) && m_write.deadline)
+        || ((m_events & ERROR) && m_error.deadline);
+}
+
+// 为什么不重置eventContext? schedule之后cb/fiber不一定运行，所以当然不能重置context
+void FdCtx::triggerEvent(int event) {
+    CPPSERVER_ASSERT(m_events & event);  // 事件存在
+    m_events = m_events & ~event;
+    if (!m_events) {
+        m_iom = nullptr;
+    }
+    EventContext& ctx = getContext(event);
+    ctx.deadline = 0;
+    if (ctx.cb) {
+        ctx.scheduler->schedule(&ctx.cb);
+    } else {
+        ctx.scheduler->schedule(&ctx.fiber);
+    }
+    ctx.scheduler = nullptr;
+    notifyWatchers(ctx);
+    return;
+}
+
 bool FdCtx::init() {
     if (m_isInit) {
         return true;
@@ -30,12 +136,14 @@ bool FdCtx::init() {
     if (-1 == fstat(m_fd, &fd_stat)) {
         m_isInit = false;
         m_isSocket = false;
+        m_isPollable = false;
     } else {
         m_isInit = true;
         m_isSocket = S_ISSOCK(fd_stat.st_mode);
+        m_isPollable = m_isSocket || S_ISFIFO(fd_stat.st_mode);
     }
 
-    if (m_isSocket) {
+    if (m_isPollable) {
         int flags = fcntl_f(m_fd, F_GETFL, 0);
         if (!(flags & O_NONBLOCK)) {
             fcntl_f(m_fd, F_SETFL, flags | O_NONBLOCK);
@@ -46,10 +154,23 @@ bool FdCtx::init() {
     }
 
     m_userNonblock = false;
-    m_isClosed = false;
+    m_sockError = 0;
+    m_isClosed.store(false, std::memory_order_release);
     return m_isInit;
 }
 
+void FdCtx::initSocket() {
+    m_recvTimeout = -1;
+    m_sendTimeout = -1;
+    m_isInit = true;
+    m_isSocket = true;
+    m_isPollable = true;
+    m_sysNonblock = true;
+    m_userNonblock = false;
+    m_sockError = 0;
+    m_isClosed.store(false, std::memory_order_release);
+}
+
 void FdCtx::setTimeout(int type, uint64_t v) {
     if (type == SO_RCVTIMEO) {
         m_recvTimeout = v;
@@ -66,36 +187,126 @@ uint64_t FdCtx::getTimeout(int type) {
     }
 }
 
+FdManager::Segment::Segment() {
+    for (size_t i = 0; i < SEGMENT_SIZE; ++i) {
+        ctxs[i] = nullptr;
+    }
+}
+
 FdManager::FdManager() {
-    m_datas.resize(64);
+    for (size_t i = 0; i < MAX_SEGMENTS; ++i) {
+        m_segments[i] = nullptr;
+    }
 }
 
-FdCtx::ptr FdManager::get(int fd, bool auto_create) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int) m_datas.size() <= fd) {
-        if (!auto_create) {
-            return nullptr;
+FdManager::~FdManager() {
+    for (size_t i = 0; i < MAX_SEGMENTS; ++i) {
+        Segment* seg = m_segments[i];
+        if (!seg) {
+            continue;
         }
-    } else {
-        if (m_datas[fd] || !auto_create) {
-            // auto_create=false的话，m_datas[fd]为空也返回
-            return m_datas[fd];
+        for (size_t j = 0; j < SEGMENT_SIZE; ++j) {
+            delete seg->ctxs[j].load();
         }
+        delete seg;
     }
-    lock.unlock();
+}
 
-    RWMutexType::WriteLock lock2(m_mutex);
-    FdCtx::ptr ctx(new FdCtx(fd));
-    m_datas[fd] = ctx;
+FdManager::Segment* FdManager::getSegment(int fd, bool auto_create) {
+    if (CPPSERVER_UNLIKELY(fd < 0 || (size_t) fd >= SEGMENT_SIZE * MAX_SEGMENTS)) {
+        return nullptr;
+    }
+    std::atomic<Segment*>& slot = m_segments[fd >> SEGMENT_BITS];
+    Segment* seg = slot.load(std::memory_order_acquire);
+    if (seg || !auto_create) {
+        return seg;
+    }
+    Segment* fresh = new Segment;
+    if (slot.compare_exchange_strong(seg, fresh, std::memory_order_acq_rel)) {
+        return fresh;
+    }
+    // 别的线程先分配了
+    delete fresh;
+    return seg;
+}
+
+FdCtx* FdManager::getRecord(int fd, bool auto_create) {
+    Segment* seg = getSegment(fd, auto_create);
+    if (!seg) {
+        return nullptr;
+    }
+    std::atomic<FdCtx*>& slot = seg->ctxs[fd & (SEGMENT_SIZE - 1)];
+    FdCtx* ctx = slot.load(std::memory_order_acquire);
+    if (ctx || !auto_create) {
+        return ctx;
+    }
+    FdCtx* fresh = new FdCtx(fd);
+    if (slot.compare_exchange_strong(ctx, fresh, std::memory_order_acq_rel)) {
+        return fresh;
+    }
+    delete fresh;
+    return ctx;
+}
+
+FdCtx* FdManager::get(int fd, bool auto_create) {
+    FdCtx* ctx = getRecord(fd, auto_create);
+    if (!ctx) {
+        return nullptr;
+    }
+    if (CPPSERVER_LIKELY(ctx->m_state.load(std::memory_order_acquire) == FdCtx::USED)) {
+        return ctx;
+    }
+    if (!auto_create) {
+        return nullptr;
+    }
+    return initRecord(ctx, false);
+}
+
+FdCtx* FdManager::addSocket(int fd) {
+    del(fd);
+    FdCtx* ctx = getRecord(fd, true);
+    if (!ctx) {
+        return nullptr;
+    }
+    return initRecord(ctx, true);
+}
+
+FdCtx* FdManager::initRecord(FdCtx* ctx, bool known_socket) {
+    int state = FdCtx::FREE;
+    if (ctx->m_state.compare_exchange_strong(state, FdCtx::INITING, std::memory_order_acquire)) {
+        ctx->m_isInit = false;
+        if (known_socket) {
+            ctx->initSocket();
+        } else {
+            ctx->init();
+        }
+        ctx->m_state.store(FdCtx::USED, std::memory_order_release);
+    } else {
+        // 其它线程正在初始化同一个fd, init里有系统调用, 等久了让出CPU
+        for (int i = 1; ctx->m_state.load(std::memory_order_acquire) != FdCtx::USED; ++i) {
+            if (i % 64) {
+                CPPSERVER_CPU_RELAX();
+            } else {
+                sched_yield();
+            }
+        }
+    }
     return ctx;
 }
 
 void FdManager::del(int fd) {
-    RWMutexType::WriteLock lock(m_mutex);
-    if ((int) m_datas.size() <= fd) {
+    Segment* seg = getSegment(fd, false);
+    if (!seg) {
+        return;
+    }
+    FdCtx* ctx = seg->ctxs[fd & (SEGMENT_SIZE - 1)].load(std::memory_order_acquire);
+    if (!ctx) {
         return;
     }
-    m_datas[fd].reset();
+    // 对象留着复用, 还拿着旧指针的调用方会看到已关闭
+    ctx->m_isClosed.store(true, std::memory_order_release);
+    ctx->m_generation.fetch_add(1, std::memory_order_release);
+    ctx->m_state.store(FdCtx::FREE, std::memory_order_release);
 }
 
 
@@ -2,22 +2,54 @@
 #define __CPPSERVER_FD_MANAGER_H__
 
 #include <memory>
+#include <atomic>
+#include <functional>
 #include <vector>
 #include "thread.h"
+#include "fiber.h"
 #include "singleton.h"
 
 namespace CppServer{
 
-class FdCtx : public std::enable_shared_from_this<FdCtx> {
+class FdManager;
+class IOManager;
+class Scheduler;
+
+// 每个fd一条记录, 同时保存socket状态/超时和IOManager的读写事件上下文
+// FdCtx由FdManager持有且不释放, fd关闭后留给同号的fd复用: 裸指针不会悬空, 但只在fd关闭前代表这个fd
+// 不要跨close保存FdCtx*, 否则会静默看到下一个同号fd的状态; 需要跨越时保存fd号并用getGeneration核对
+class alignas(64) FdCtx : Noncopyable {
+friend class FdManager;
+friend class IOManager;
 public:
-    typedef std::shared_ptr<FdCtx> ptr;
+    // 可以等待的IO事件, 取值与epoll的EPOLLIN/EPOLLOUT/EPOLLERR相同; IOManager::Event沿用这些值
+    enum Event {
+        NONE    = 0x0,
+        READ    = 0x1,
+        WRITE   = 0x4,
+        ERROR   = 0x8
+    };
+
     FdCtx(int fd);
     ~FdCtx();
 
+    // C++11的new不保证超过16字节的对齐
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
+    int getFd() const { return m_fd; }
+
     bool init();
+    // 调用方已经知道是内核层非阻塞的socket(socket/accept4带SOCK_NONBLOCK), 省掉fstat和fcntl
+    void initSocket();
     bool isInit() const { return m_isInit; }
     bool isSocket() const { return m_isSocket; }
-    bool isClose() const { return m_isClosed; }
+    // socket/pipe/eventfd等可以交给epoll等待的fd, hook的IO会在这些fd上让出协程
+    bool isPollable() const { return m_isPollable; }
+    void setPollable(bool v) { m_isPollable = v; }
+    bool isClose() const { return m_isClosed.load(std::memory_order_acquire); }
+    // 记录每被del一次加一, 拿着旧指针的调用方可以比较前后的值判断fd是否已经换了人
+    uint32_t getGeneration() const { return m_generation.load(std::memory_order_acquire); }
     bool close();
 
     void setUserNonblock(bool v) { m_userNonblock = v; }
@@ -29,29 +61,95 @@ public:
     void setTimeout(int type, uint64_t v);
     uint64_t getTimeout(int type);
 
+    // 等待event的协程被唤醒后调用, 返回是否因超过deadline被唤醒
+    bool takeTimedOut(int event);
+    // 是否已经有协程/回调在等待event
+    bool hasEvent(int event);
+    // EPOLLERR且SO_ERROR非0时IOManager读出的错误(读SO_ERROR会清掉内核里的值)
+    // 被唤醒的读写等待者取走后当作这次IO的errno; get不清除, 给错误队列的使用者判断socket是否出错
+    int takeSockError();
+    int getSockError();
+
 private:
+    enum State {
+        FREE,       // fd未被使用, 对象等待复用
+        INITING,    // 正在初始化
+        USED
+    };
+
+    typedef Mutex MutexType;
+    struct EventContext {
+        Scheduler* scheduler = nullptr;       //事件待执行的scheduler
+        Fiber::ptr fiber;           //事件协程
+        std::function<void()> cb;   //事件回调
+        uint64_t deadline = 0;      //单调时钟(GetCoarseMS)的绝对时间, 0为不超时
+        uint32_t wait = 0;          //第几次等待, 短超时的定时器用它确认还是同一次等待
+        bool timedout = false;      //是否被deadline扫描唤醒
+        // poll类调用的等待者: 事件上已经有别人在等时挂在这里, 不占用事件, 事件触发或删除时一起唤醒
+        std::vector<std::pair<const void*, std::function<void()> > > watchers;
+    };
+
+    EventContext& getContext(int event);
+    void resetContext(EventContext& ctx);
+    void triggerEvent(int event);
+    // 调用并清空ctx上的watchers, 需持有m_mutex
+    void notifyWatchers(EventContext& ctx);
+    // 是否还有设置了deadline的事件, 需持有m_mutex
+    bool hasDeadline() const;
+
     bool m_isInit: 1;
     bool m_isSocket: 1;
+    bool m_isPollable: 1;
     bool m_sysNonblock: 1;
     bool m_userNonblock: 1;
-    bool m_isClosed: 1;
+    std::atomic<bool> m_isClosed;   // del时由关闭fd的线程写, 别的线程无锁读, 不能和上面共用一个字节
     int m_fd;
+    std::atomic<int> m_state;
+    std::atomic<uint32_t> m_generation;
 
     uint64_t m_recvTimeout;
     uint64_t m_sendTimeout;
+
+    // IOManager使用, 由m_mutex保护, 与fd是否在用无关
+    // 同一时间只能注册在一个IOManager的epoll上, m_events为0时可以换一个IOManager
+    MutexType m_mutex;
+    IOManager* m_iom;        // 已注册事件所在的IOManager, 没有注册事件时为nullptr
+    int m_events;            // 已经注册的事件
+    int m_sockError;         // 见takeSockError
+    EventContext m_read;     // 读事件
+    EventContext m_write;    // 写事件
+    EventContext m_error;    // 错误队列事件
+    IOManager* m_deadlineIom; // 已登记到哪个IOManager的deadline扫描列表, 同一时间只在一个列表里
+    size_t m_deadlineIndex;   // 在该列表中的下标, 由那个IOManager的m_deadlineMutex保护
 };
 
+// 分段数组: 段按需分配且不搬迁, 每个槽位原子发布, 查找无锁且不碰引用计数
 class FdManager {
 public:
-    typedef RWMutex RWMutexType;
     FdManager();
+    ~FdManager();
 
-    FdCtx::ptr get(int fd, bool auto_create = false);
+    FdCtx* get(int fd, bool auto_create = false);
+    // 登记一个刚创建的非阻塞socket fd, 替换同号的旧记录
+    FdCtx* addSocket(int fd);
     void del(int fd);
+    // 不管fd是否在用都返回该fd号的记录, 供IOManager挂事件
+    FdCtx* getRecord(int fd, bool auto_create = true);
+
+private:
+    static const size_t SEGMENT_BITS = 10;
+    static const size_t SEGMENT_SIZE = 1 << SEGMENT_BITS;   // 每段1024个fd
+    static const size_t MAX_SEGMENTS = 1024;                // 最多1M个fd
+
+    struct Segment {
+        std::atomic<FdCtx*> ctxs[SEGMENT_SIZE];
+        Segment();
+    };
 
+    Segment* getSegment(int fd, bool auto_create);
+    FdCtx* initRecord(FdCtx* ctx, bool known_socket);
 private:
-    RWMutexType m_mutex;
-    std::vector<FdCtx::ptr> m_datas;
+    std::atomic<Segment*> m_segments[MAX_SEGMENTS];
 };
 
 typedef Singleton<FdManager> FdMgr;
@@ -101,6 +101,7 @@ void Fiber::reset(std::function<void()> cb) {
                      m_state == INIT ||
                      m_state == EXCEPT);
     m_cb = cb;
+    m_affinity = -1;
     if (getcontext(&m_ctx)) {
         CPPSERVER_ASSERT2(false, "getcontext");
     }
@@ -171,7 +172,9 @@ void Fiber::YieldToReady() {
 
 void Fiber::YieldToHold() {
     Fiber::ptr cur = GetThis();
-    cur->m_state = HOLD;
+    // 不在这里置HOLD: 切走之前事件可能已在其它线程触发, 看到HOLD的线程会在栈还没切走时恢复本协程
+    // 由调度器在swapIn返回后置HOLD, 在此之前其它线程会跳过EXEC状态的协程
+    CPPSERVER_ASSERT(cur->m_state == EXEC);
     cur->swapOut();
 }
 
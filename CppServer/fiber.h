@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <functional>
+#include <atomic>
 #include <ucontext.h>
 #include "thread.h"
 
@@ -44,7 +45,9 @@ class Fiber : public std::enable_shared_from_this<Fiber> {
 
     uint64_t getId() const { return m_id; }
     State getState() const { return m_state; }
-    
+    // 线程亲和: 没有指定线程的调度都放到这个线程(线程id)上, -1为任意线程
+    int getAffinity() const { return m_affinity.load(std::memory_order_relaxed); }
+    void setAffinity(int thread) { m_affinity.store(thread, std::memory_order_relaxed); }
 
  public:
     // 设置当前线程运行的协程
@@ -63,6 +66,7 @@ class Fiber : public std::enable_shared_from_this<Fiber> {
     uint64_t m_id = 0;
     uint32_t m_stacksize = 0;
     State m_state = INIT;
+    std::atomic<int> m_affinity = {-1};
 
     ucontext_t m_ctx;
     void* m_stack = nullptr;
@@ -6,6 +6,10 @@
 #include "fiber.h"
 #include "iomanager.h"
 #include "fd_manager.h"
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
 
 // #include <iostream>
 
@@ -16,6 +20,9 @@ namespace CppServer {
 static CppServer::ConfigVar<int>::ptr g_tcp_connect_timeout =
     CppServer::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
 
+static CppServer::ConfigVar<bool>::ptr g_offload_file_io =
+    CppServer::Config::Lookup("offload.file_io", false, "run hooked regular file io in the offload pool");
+
 // 线程local，方便各个线程hook或者不hook
 static thread_local bool t_hook_enable = false;
 
@@ -26,16 +33,39 @@ static thread_local bool t_hook_enable = false;
     XX(socket) \
     XX(connect) \
     XX(accept) \
+    XX(accept4) \
+    XX(socketpair) \
+    XX(pipe) \
+    XX(pipe2) \
+    XX(eventfd) \
+    XX(dup) \
+    XX(dup2) \
+    XX(dup3) \
     XX(read) \
     XX(readv) \
     XX(recv) \
     XX(recvfrom) \
     XX(recvmsg) \
+    XX(recvmmsg) \
     XX(write) \
     XX(writev) \
     XX(send) \
     XX(sendto) \
     XX(sendmsg) \
+    XX(sendmmsg) \
+    XX(sendfile) \
+    XX(splice) \
+    XX(tee) \
+    XX(copy_file_range) \
+    XX(poll) \
+    XX(ppoll) \
+    XX(select) \
+    XX(epoll_wait) \
+    XX(open) \
+    XX(pread) \
+    XX(pwrite) \
+    XX(fsync) \
+    XX(fdatasync) \
     XX(close) \
     XX(fcntl) \
     XX(ioctl) \
@@ -55,6 +85,7 @@ void hook_init() {
 }
 
 static uint64_t s_connect_timeout = -1;
+static bool s_offload_file_io = false;
 
 struct _HookIniter {
     _HookIniter() {
@@ -65,6 +96,12 @@ struct _HookIniter {
                                          << old_value << " to " << new_value;
             s_connect_timeout = new_value;
         });
+        s_offload_file_io = g_offload_file_io->getValue();
+        g_offload_file_io->addListener([](const bool& old_value, const bool& new_value) {
+            CPPSERVER_LOG_INFO(g_logger) << "offload file io change from "
+                                         << old_value << " to " << new_value;
+            s_offload_file_io = new_value;
+        });
     }
 };
 
@@ -84,6 +121,32 @@ struct timer_info {
     int cancelled = 0;
 };
 
+// 打开offload.file_io时, 协程里对普通文件的IO交给offload线程池, 不卡住worker线程
+template<typename OriginFun, typename ... Args>
+static auto do_offload(OriginFun fun, Args&&... args) -> decltype(fun(args...)) {
+    CppServer::IOManager* iom = CppServer::IOManager::GetThis();
+    if (!CppServer::s_offload_file_io || !CppServer::t_hook_enable || !iom) {
+        return fun(std::forward<Args>(args)...);
+    }
+    decltype(fun(args...)) rt;
+    int err = 0;
+    iom->offload([&]() {
+        rt = fun(std::forward<Args>(args)...);
+        err = errno;
+    });
+    errno = err;
+    return rt;
+}
+
+// hook的open打开的fd中, 不能交给epoll的那些(普通文件)
+static bool is_offload_fd(int fd) {
+    if (!CppServer::s_offload_file_io || !CppServer::t_hook_enable) {
+        return false;
+    }
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
+    return ctx && !ctx->isClose() && !ctx->isPollable();
+}
+
 template<typename OriginFun, typename ... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
     uint32_t event, int timeout_so, Args&&... args) {
@@ -92,7 +155,7 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
     }
     CPPSERVER_LOG_INFO(g_logger) << "do_io<" << hook_fun_name << ">";
 
-    CppServer::FdCtx::ptr ctx = CppServer::FdMgr::GetInstance()->get(fd);
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
     if (!ctx) {
         return fun(fd, std::forward<Args>(args)...);
     }
@@ -100,11 +163,15 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         errno = EBADF;
         return -1;
     }
-    if (!ctx->isSocket() || ctx->getUserNonblock()) {
+    if (!ctx->isPollable()) {
+        return do_offload(fun, fd, std::forward<Args>(args)...);
+    }
+    if (ctx->getUserNonblock()) {
         return fun(fd, std::forward<Args>(args)...);
     }
     uint64_t to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    // 让出期间fd可能被关闭, 记录复用后指向新的同号fd, 醒来后要核对
+    uint32_t generation = ctx->getGeneration();
 
 retry:
     ssize_t n = fun(fd, std::forward<Args>(args)...);
@@ -113,35 +180,26 @@ retry:
     }
     if (n == -1 && errno == EAGAIN) {  // no data on the socket
         CppServer::IOManager* iom = CppServer::IOManager::GetThis();
-        CppServer::Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo);
-        if (to != (uint64_t) -1) {  // 有时间限制
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {
-                auto t = winfo.lock();
-                if (!t || t->cancelled) {
-                    return;
-                }
-                // 规定时间内未完成任务
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, (CppServer::IOManager::Event) event);
-            }, winfo);
-        }
-
-        int rt = iom->addEvent(fd, (CppServer::IOManager::Event) event);
+        // 超时由IOManager按fd上的deadline统一扫描, 不再每次等待创建定时器
+        int rt = iom->addEvent(ctx, (CppServer::IOManager::Event) event, nullptr, to);
         if (rt) {
             CPPSERVER_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
                 << fd << ", " << event << ")";
-            if (timer) {
-                timer->cancel();
-            }
             return -1;
         } else {
             CppServer::Fiber::YieldToHold();
-            if (timer) {
-                timer->cancel();
+            if (ctx->getGeneration() != generation) {
+                errno = EBADF;
+                return -1;
             }
-            if(tinfo->cancelled) {
-                errno = tinfo->cancelled;
+            // 唤醒时IOManager已经读走了SO_ERROR, 再做一次IO只会看到EOF/EPIPE
+            int err = ctx->takeSockError();
+            if (err) {
+                errno = err;
+                return -1;
+            }
+            if (ctx->takeTimedOut(event)) {
+                errno = ETIMEDOUT;
                 return -1;
             }
             goto retry;
@@ -150,6 +208,141 @@ retry:
     return n;
 }
 
+// poll类调用的等待者, 任意一个fd就绪或者超时都只唤醒一次
+struct poll_waiter {
+    CppServer::Scheduler* scheduler = nullptr;
+    CppServer::Fiber::ptr fiber;
+    std::atomic<bool> woken{false};
+
+    void wake() {
+        if (!woken.exchange(true)) {
+            scheduler->schedule(fiber);
+        }
+    }
+};
+
+// do_poll挂上的一个事件, generation用来发现等待期间fd被关闭
+// registered为注册了事件(wait是那次等待的编号), 否则是挂在已有等待者后面的watcher
+struct poll_wait_fd {
+    CppServer::FdCtx* ctx;
+    CppServer::IOManager::Event event;
+    uint32_t generation;
+    nfds_t index;
+    bool registered;
+    uint32_t wait;
+};
+
+// 撤销挂上的事件, 等待期间被关闭的fd事件已经随close取消, 记录可能已经属于新的同号fd, 不能再碰
+// 返回被关闭的fd在fds中的下标
+static std::vector<nfds_t> poll_unwatch(CppServer::IOManager* iom,
+        const std::vector<poll_wait_fd>& added, const void* key) {
+    std::vector<nfds_t> closed;
+    for (auto& i : added) {
+        if (i.ctx->getGeneration() != i.generation) {
+            closed.push_back(i.index);
+            continue;
+        }
+        iom->unwatchEvent(i.ctx, i.event, key, i.registered, i.wait);
+    }
+    return closed;
+}
+
+// 把fds挂到当前IOManager上, 让出协程直到有fd就绪或超时, 语义同poll
+// fd上已经有别的协程在等时挂在它后面一起被唤醒; 不能交给epoll的fd(普通文件等)poll总是立即返回, 直接用poll的结果
+static int do_poll(struct pollfd *fds, nfds_t nfds, int timeout_ms) {
+    CppServer::IOManager* iom = CppServer::IOManager::GetThis();
+    if (!CppServer::t_hook_enable || !iom) {
+        return poll_f(fds, nfds, timeout_ms);
+    }
+    int n = poll_f(fds, nfds, 0);
+    if (n != 0 || timeout_ms == 0) {
+        return n;
+    }
+    uint64_t deadline = timeout_ms < 0 ? ~0ull
+                      : CppServer::GetCurrentMS() + timeout_ms;
+    while (true) {
+        std::shared_ptr<poll_waiter> waiter(new poll_waiter);
+        waiter->scheduler = iom;
+        waiter->fiber = CppServer::Fiber::GetThis();
+
+        std::vector<poll_wait_fd> added;
+        bool unpollable = false;
+        for (nfds_t i = 0; i < nfds && !unpollable; ++i) {
+            if (fds[i].fd < 0) {
+                continue;
+            }
+            uint32_t events = 0;
+            if (fds[i].events & (POLLIN | POLLPRI | POLLRDHUP)) {
+                events |= CppServer::IOManager::READ;
+            }
+            if (fds[i].events & POLLOUT) {
+                events |= CppServer::IOManager::WRITE;
+            }
+            static const CppServer::IOManager::Event s_events[] = {
+                CppServer::IOManager::READ, CppServer::IOManager::WRITE};
+            for (auto& event : s_events) {
+                if (!(events & event)) {
+                    continue;
+                }
+                CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->getRecord(fds[i].fd);
+                if (!ctx) {
+                    unpollable = true;
+                    break;
+                }
+                poll_wait_fd wait_fd{ctx, event, ctx->getGeneration(), i, false, 0};
+                int rt = iom->watchEvent(ctx, event, [waiter]() { waiter->wake(); },
+                                         waiter.get(), wait_fd.wait);
+                if (rt < 0) {
+                    unpollable = true;
+                    break;
+                }
+                wait_fd.registered = rt == 0;
+                added.push_back(wait_fd);
+            }
+        }
+        if (unpollable) {
+            poll_unwatch(iom, added, waiter.get());
+            return poll_f(fds, nfds, 0);
+        }
+
+        uint64_t now = CppServer::GetCurrentMS();
+        uint64_t wait_ms = deadline == ~0ull ? ~0ull : (deadline > now ? deadline - now : 0);
+        if (added.empty() && wait_ms == ~0ull) {
+            // 没有可以等待的fd, 和poll一样永远阻塞
+            return poll_f(fds, nfds, timeout_ms);
+        }
+        CppServer::Timer::ptr timer;
+        if (wait_ms != ~0ull) {
+            timer = iom->addTimer(wait_ms, [waiter]() { waiter->wake(); });
+        }
+
+        CppServer::Fiber::YieldToHold();
+
+        if (timer) {
+            timer->cancel();
+        }
+        std::vector<nfds_t> closed = poll_unwatch(iom, added, waiter.get());
+        if (!closed.empty()) {
+            // 和poll对关闭的fd一样报POLLNVAL, 不去看同号的新fd
+            for (nfds_t i = 0; i < nfds; ++i) {
+                fds[i].revents = 0;
+            }
+            for (auto& i : closed) {
+                fds[i].revents = POLLNVAL;
+            }
+            std::sort(closed.begin(), closed.end());
+            return std::unique(closed.begin(), closed.end()) - closed.begin();
+        }
+        n = poll_f(fds, nfds, 0);
+        if (n != 0) {
+            return n;
+        }
+        if (deadline != ~0ull && CppServer::GetCurrentMS() >= deadline) {
+            return 0;
+        }
+    }
+}
+
 extern "C" {
 #define XX(name) name ## _fun name ## _f = nullptr;
     // 函数指针置零
@@ -200,23 +393,188 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
     return 0;
 }
 
+// 新fd号上可能还留着旧记录(比如关闭时没开hook), 先作废再初始化
+// user_nonblock为用户创建时自己要求的非阻塞
+static CppServer::FdCtx* track_fd(int fd, bool user_nonblock) {
+    CppServer::FdMgr::GetInstance()->del(fd);
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd, true);
+    if (ctx) {
+        ctx->setUserNonblock(user_nonblock);
+    }
+    return ctx;
+}
+
+// 内核层已经非阻塞的新socket, 直接登记, 不用fstat/fcntl
+static CppServer::FdCtx* track_socket(int fd, bool user_nonblock) {
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->addSocket(fd);
+    if (ctx) {
+        ctx->setUserNonblock(user_nonblock);
+    }
+    return ctx;
+}
+
+// fd记录里用户可见的设置, dup时复制给新fd, dup失败时用来恢复
+struct FdSettings {
+    bool userNonblock;
+    bool sysNonblock;
+    bool pollable;
+    uint64_t recvTimeout;
+    uint64_t sendTimeout;
+
+    FdSettings() {}
+    explicit FdSettings(CppServer::FdCtx* ctx)
+        : userNonblock(ctx->getUserNonblock())
+        , sysNonblock(ctx->getSysNonblock())
+        , pollable(ctx->isPollable())
+        , recvTimeout(ctx->getTimeout(SO_RCVTIMEO))
+        , sendTimeout(ctx->getTimeout(SO_SNDTIMEO)) {
+    }
+
+    // 以这些设置重新登记fd
+    void track(int fd) const {
+        CppServer::FdCtx* ctx = track_fd(fd, userNonblock);
+        if (!ctx) {
+            return;
+        }
+        ctx->setPollable(pollable);
+        ctx->setSysNonblock(sysNonblock);
+        ctx->setTimeout(SO_RCVTIMEO, recvTimeout);
+        ctx->setTimeout(SO_SNDTIMEO, sendTimeout);
+    }
+};
+
+// dup2/dup3会隐式关闭newfd原来的文件, 必须在调用之前和close一样唤醒在上面等待的协程:
+// 调用之后旧文件已经被内核关掉, 在新文件上EPOLL_CTL_DEL会失败, 等待者永远醒不过来
+// 返回是否作废了记录, settings保存作废前的设置
+static bool untrack_fd(int fd, FdSettings& settings) {
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
+    if (!ctx || ctx->isClose()) {
+        return false;
+    }
+    settings = FdSettings(ctx);
+    auto iom = CppServer::IOManager::GetThis();
+    if (iom) {
+        iom->cancelAll(ctx);
+    }
+    CppServer::FdMgr::GetInstance()->del(fd);
+    return true;
+}
+
+// dup出来的fd和原fd共享文件状态, 同时继承超时和用户的非阻塞设置
+static void dup_fd(int oldfd, int newfd) {
+    CppServer::FdCtx* old_ctx = CppServer::FdMgr::GetInstance()->get(oldfd);
+    if (!old_ctx || old_ctx->isClose()) {
+        return;
+    }
+    FdSettings(old_ctx).track(newfd);
+}
+
+// dup2/dup3的公共部分, dup_cb失败时newfd还是原来的文件, 恢复它的记录
+static int dup_over(int oldfd, int newfd, const std::function<int()>& dup_cb) {
+    FdSettings settings;
+    bool untracked = untrack_fd(newfd, settings);
+    int fd = dup_cb();
+    if (fd >= 0) {
+        dup_fd(oldfd, newfd);
+    } else if (untracked) {
+        int err = errno;
+        settings.track(newfd);
+        errno = err;
+    }
+    return fd;
+}
+
 int socket(int domain, int type, int protocol) {
     if (!CppServer::t_hook_enable) {
         return socket_f(domain, type, protocol);
     }
-    int fd = socket_f(domain, type, protocol);
+    int fd = socket_f(domain, type | SOCK_NONBLOCK, protocol);
     if (fd == -1) {
         return fd;
     }
-    CppServer::FdMgr::GetInstance()->get(fd, true);
+    track_socket(fd, type & SOCK_NONBLOCK);
     return fd;
 }
 
+int socketpair(int domain, int type, int protocol, int sv[2]) {
+    if (!CppServer::t_hook_enable) {
+        return socketpair_f(domain, type, protocol, sv);
+    }
+    int rt = socketpair_f(domain, type | SOCK_NONBLOCK, protocol, sv);
+    if (rt == 0) {
+        track_fd(sv[0], type & SOCK_NONBLOCK);
+        track_fd(sv[1], type & SOCK_NONBLOCK);
+    }
+    return rt;
+}
+
+int pipe(int pipefd[2]) {
+    if (!CppServer::t_hook_enable) {
+        return pipe_f(pipefd);
+    }
+    return pipe2(pipefd, 0);
+}
+
+int pipe2(int pipefd[2], int flags) {
+    if (!CppServer::t_hook_enable) {
+        return pipe2_f(pipefd, flags);
+    }
+    int rt = pipe2_f(pipefd, flags | O_NONBLOCK);
+    if (rt == 0) {
+        track_fd(pipefd[0], flags & O_NONBLOCK);
+        track_fd(pipefd[1], flags & O_NONBLOCK);
+    }
+    return rt;
+}
+
+int eventfd(unsigned int initval, int flags) {
+    if (!CppServer::t_hook_enable) {
+        return eventfd_f(initval, flags);
+    }
+    int fd = eventfd_f(initval, flags | EFD_NONBLOCK);
+    if (fd == -1) {
+        return fd;
+    }
+    // eventfd是匿名inode, fstat认不出来, 手动标记
+    CppServer::FdCtx* ctx = track_fd(fd, flags & EFD_NONBLOCK);
+    if (ctx) {
+        ctx->setPollable(true);
+        ctx->setSysNonblock(true);
+    }
+    return fd;
+}
+
+int dup(int oldfd) {
+    int fd = dup_f(oldfd);
+    if (fd >= 0 && CppServer::t_hook_enable) {
+        dup_fd(oldfd, fd);
+    }
+    return fd;
+}
+
+int dup2(int oldfd, int newfd) {
+    if (!CppServer::t_hook_enable || oldfd == newfd) {
+        return dup2_f(oldfd, newfd);
+    }
+    return dup_over(oldfd, newfd, [oldfd, newfd]() {
+        return dup2_f(oldfd, newfd);
+    });
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+    if (!CppServer::t_hook_enable) {
+        return dup3_f(oldfd, newfd, flags);
+    }
+    return dup_over(oldfd, newfd, [oldfd, newfd, flags]() {
+        return dup3_f(oldfd, newfd, flags);
+    });
+}
+
 int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen, uint64_t timeout_ms) {
     if (!CppServer::t_hook_enable) {
         return connect_f(fd, addr, addrlen);
     }
-    CppServer::FdCtx::ptr ctx = CppServer::FdMgr::GetInstance()->get(fd);
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
     if (!ctx || ctx->isClose()) {
         errno = EBADF;
         return -1;
@@ -240,16 +598,16 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
     std::shared_ptr<timer_info> tinfo(new timer_info);
     std::weak_ptr<timer_info> winfo(tinfo);
     if (timeout_ms != (uint64_t) -1) {
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
+        timer = iom->addConditionTimer(timeout_ms, [winfo, ctx, iom]() {
             auto t = winfo.lock();
             if (!t || t->cancelled) {
                 return;
             }
             t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, CppServer::IOManager::WRITE);
+            iom->cancelEvent(ctx, CppServer::IOManager::WRITE);
         }, winfo);
     }
-    int rt = iom->addEvent(fd, CppServer::IOManager::WRITE);
+    int rt = iom->addEvent(ctx, CppServer::IOManager::WRITE);
     if (rt == 0) {
         CppServer::Fiber::YieldToHold();
         if (timer) {
@@ -284,9 +642,21 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(sockfd, accept_f, "accept", CppServer::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    if (!CppServer::t_hook_enable) {
+        return accept_f(sockfd, addr, addrlen);
+    }
+    return accept4(sockfd, addr, addrlen, 0);
+}
+
+// 新fd在内核层直接设成非阻塞, 省掉登记时的fstat和两次fcntl
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    if (!CppServer::t_hook_enable) {
+        return accept4_f(sockfd, addr, addrlen, flags);
+    }
+    int fd = do_io(sockfd, accept4_f, "accept4", CppServer::IOManager::READ, SO_RCVTIMEO,
+                   addr, addrlen, flags | SOCK_NONBLOCK);
     if (fd >= 0) {
-        CppServer::FdMgr::GetInstance()->get(fd, true);
+        track_socket(fd, flags & SOCK_NONBLOCK);
     }
     return fd;
 }
@@ -311,6 +681,11 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
     return do_io(sockfd, recvmsg_f, "recvmsg", CppServer::IOManager::READ, SO_RCVTIMEO, msg, flags);
 }
 
+// 非阻塞的recvmmsg只取已经到达的数据报, 一个都没有才让出协程
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+    return do_io(sockfd, recvmmsg_f, "recvmmsg", CppServer::IOManager::READ, SO_RCVTIMEO, msgvec, vlen, flags, timeout);
+}
+
 ssize_t write(int fd, const void *buf, size_t count) {
     return do_io(fd, write_f, "write", CppServer::IOManager::WRITE, SO_SNDTIMEO, buf, count);
 }
@@ -331,15 +706,257 @@ ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
     return do_io(s, sendmsg_f, "sendmsg", CppServer::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
 }
 
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    return do_io(sockfd, sendmmsg_f, "sendmmsg", CppServer::IOManager::WRITE, SO_SNDTIMEO, msgvec, vlen, flags);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    return do_io(out_fd, sendfile_f, "sendfile", CppServer::IOManager::WRITE, SO_SNDTIMEO, in_fd, offset, count);
+}
+
+// splice/copy_file_range两端都可能是socket, 先在受hook管理的那一端等待
+static bool is_hook_socket(int fd) {
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd, false);
+    return ctx && !ctx->isClose() && ctx->isSocket();
+}
+
+static bool is_fd_ready(int fd, short events) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    return poll_f(&pfd, 1, 0) > 0;
+}
+
+// EAGAIN可能来自任意一端(比如pipe满了或者空了), 在已经就绪的一端等待会在EPOLLET下一直被唤醒
+// 所以EAGAIN时看等待的一端是否就绪, 就绪就换到另一端等; 另一端不受hook管理时do_io直接返回EAGAIN
+// 两端都就绪还是EAGAIN时也直接返回EAGAIN
+static ssize_t do_transfer(int fd_in, int fd_out, const std::function<ssize_t()>& fun,
+                           const char* hook_fun_name) {
+    bool wait_out = is_hook_socket(fd_out) || !is_hook_socket(fd_in);
+    bool switched = false;
+    while (true) {
+        int fd = wait_out ? fd_out : fd_in;
+        int other = wait_out ? fd_in : fd_out;
+        bool blocked_other = false;
+        bool both_ready = false;
+        auto attempt = [&](int) -> ssize_t {
+            ssize_t n = fun();
+            if (n == -1 && errno == EAGAIN && is_fd_ready(fd, wait_out ? POLLOUT : POLLIN)) {
+                if (switched && is_fd_ready(other, wait_out ? POLLIN : POLLOUT)) {
+                    both_ready = true;
+                } else {
+                    blocked_other = true;
+                }
+                // 不让do_io在这一端等待
+                errno = EBUSY;
+            }
+            return n;
+        };
+        ssize_t n = wait_out
+            ? do_io(fd, attempt, hook_fun_name, CppServer::IOManager::WRITE, SO_SNDTIMEO)
+            : do_io(fd, attempt, hook_fun_name, CppServer::IOManager::READ, SO_RCVTIMEO);
+        if (both_ready) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (!blocked_other) {
+            return n;
+        }
+        wait_out = !wait_out;
+        switched = true;
+    }
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+    return do_transfer(fd_in, fd_out, [=]() {
+        return splice_f(fd_in, off_in, fd_out, off_out, len, flags);
+    }, "splice");
+}
+
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+    return do_transfer(fd_in, fd_out, [=]() {
+        return tee_f(fd_in, fd_out, len, flags);
+    }, "tee");
+}
+
+ssize_t copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+    return do_transfer(fd_in, fd_out, [=]() {
+        return copy_file_range_f(fd_in, off_in, fd_out, off_out, len, flags);
+    }, "copy_file_range");
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    return do_poll(fds, nfds, timeout);
+}
+
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask) {
+    // 协程里不支持临时替换信号掩码, 带sigmask的调用保持原样
+    if (!CppServer::t_hook_enable || sigmask) {
+        return ppoll_f(fds, nfds, tmo_p, sigmask);
+    }
+    int timeout_ms = -1;
+    if (tmo_p) {
+        timeout_ms = tmo_p->tv_sec * 1000 + (tmo_p->tv_nsec + 999999) / 1000000;
+    }
+    return do_poll(fds, nfds, timeout_ms);
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    if (!CppServer::t_hook_enable) {
+        return select_f(nfds, readfds, writefds, exceptfds, timeout);
+    }
+    int timeout_ms = -1;
+    if (timeout) {
+        timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    }
+    // 转成pollfd, 结果再写回fd_set
+    std::vector<struct pollfd> pfds;
+    for (int fd = 0; fd < nfds; ++fd) {
+        short events = 0;
+        if (readfds && FD_ISSET(fd, readfds)) {
+            events |= POLLIN;
+        }
+        if (writefds && FD_ISSET(fd, writefds)) {
+            events |= POLLOUT;
+        }
+        if (exceptfds && FD_ISSET(fd, exceptfds)) {
+            events |= POLLPRI;
+        }
+        if (events) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = events;
+            pfd.revents = 0;
+            pfds.push_back(pfd);
+        }
+    }
+    int rt = do_poll(pfds.data(), pfds.size(), timeout_ms);
+    if (rt < 0) {
+        return rt;
+    }
+    for (auto& pfd : pfds) {
+        if (pfd.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+    if (readfds) {
+        FD_ZERO(readfds);
+    }
+    if (writefds) {
+        FD_ZERO(writefds);
+    }
+    if (exceptfds) {
+        FD_ZERO(exceptfds);
+    }
+    rt = 0;
+    for (auto& pfd : pfds) {
+        if (readfds && (pfd.events & POLLIN)
+                && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(pfd.fd, readfds);
+            ++rt;
+        }
+        if (writefds && (pfd.events & POLLOUT)
+                && (pfd.revents & (POLLOUT | POLLERR))) {
+            FD_SET(pfd.fd, writefds);
+            ++rt;
+        }
+        if (exceptfds && (pfd.events & POLLPRI) && (pfd.revents & POLLPRI)) {
+            FD_SET(pfd.fd, exceptfds);
+            ++rt;
+        }
+    }
+    return rt;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+    if (!CppServer::t_hook_enable) {
+        return epoll_wait_f(epfd, events, maxevents, timeout);
+    }
+    // epfd本身有事件就绪时可读, 等它可读再取事件
+    uint64_t deadline = timeout < 0 ? ~0ull : CppServer::GetCurrentMS() + timeout;
+    while (true) {
+        int n = epoll_wait_f(epfd, events, maxevents, 0);
+        if (n != 0 || timeout == 0) {
+            return n;
+        }
+        int wait_ms = -1;
+        if (deadline != ~0ull) {
+            uint64_t now = CppServer::GetCurrentMS();
+            if (now >= deadline) {
+                return 0;
+            }
+            wait_ms = deadline - now;
+        }
+        struct pollfd pfd;
+        pfd.fd = epfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int rt = do_poll(&pfd, 1, wait_ms);
+        if (rt <= 0) {
+            return rt;
+        }
+    }
+}
+
+int open(const char *pathname, int flags, ...) {
+    mode_t mode = 0;
+    // 同glibc: O_TMPFILE包含O_DIRECTORY位, 只带O_DIRECTORY时没有mode参数
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_list va;
+        va_start(va, flags);
+        mode = va_arg(va, mode_t);
+        va_end(va);
+    }
+    if (!CppServer::t_hook_enable || !CppServer::s_offload_file_io) {
+        return open_f(pathname, flags, mode);
+    }
+    // 路径解析和打开也可能碰盘
+    int fd = do_offload(open_f, pathname, flags, mode);
+    if (fd >= 0) {
+        track_fd(fd, flags & O_NONBLOCK);
+    }
+    return fd;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+    if (is_offload_fd(fd)) {
+        return do_offload(pread_f, fd, buf, count, offset);
+    }
+    return pread_f(fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    if (is_offload_fd(fd)) {
+        return do_offload(pwrite_f, fd, buf, count, offset);
+    }
+    return pwrite_f(fd, buf, count, offset);
+}
+
+int fsync(int fd) {
+    if (is_offload_fd(fd)) {
+        return do_offload(fsync_f, fd);
+    }
+    return fsync_f(fd);
+}
+
+int fdatasync(int fd) {
+    if (is_offload_fd(fd)) {
+        return do_offload(fdatasync_f, fd);
+    }
+    return fdatasync_f(fd);
+}
+
 int close(int fd) {
     if (!CppServer::t_hook_enable) {
         return close_f(fd);
     }
-    CppServer::FdCtx::ptr ctx = CppServer::FdMgr::GetInstance()->get(fd);
+    CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
     if (ctx) {
         auto iom = CppServer::IOManager::GetThis();
         if (iom) {
-            iom->cancelAll(fd);
+            iom->cancelAll(ctx);
         }
         CppServer::FdMgr::GetInstance()->del(fd);
     }
@@ -354,8 +971,8 @@ int fcntl(int fd, int cmd, ... /* arg */ ) {
             {
                 int arg = va_arg(va, int);
                 va_end(va);
-                CppServer::FdCtx::ptr ctx = CppServer::FdMgr::GetInstance()->get(fd);
-                if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+                CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
+                if (!ctx || ctx->isClose() || !ctx->isPollable()) {
                     return fcntl_f(fd, cmd, arg);
                 }
                 // 根据用户传入的block选项设置userNonblock 
@@ -373,8 +990,8 @@ int fcntl(int fd, int cmd, ... /* arg */ ) {
             {
                 va_end(va);
                 int rt = fcntl_f(fd, cmd);
-                CppServer::FdCtx::ptr ctx = CppServer::FdMgr::GetInstance()->get(fd);
-                if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+                CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
+                if (!ctx || ctx->isClose() || !ctx->isPollable()) {
                     return rt;
                 }
                 // 返回的选项, 按照用户的视角添加block选项
@@ -443,8 +1060,8 @@ int ioctl(int fd, unsigned long request, ...) {
 
     if (FIONBIO == request) {
         bool user_nonblock = !!*(int*) arg;
-        CppServer::FdCtx::ptr ctx = CppServer::FdMgr::GetInstance()->get(fd);
-        if (!ctx || ctx->isClose() || !ctx->isSocket()) {
+        CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(fd);
+        if (!ctx || ctx->isClose() || !ctx->isPollable()) {
             return ioctl_f(fd, request, arg);
         }
         ctx->setUserNonblock(user_nonblock);
@@ -453,6 +1070,17 @@ int ioctl(int fd, unsigned long request, ...) {
 }
 
 int getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    // IOManager在EPOLLERR时读走的SO_ERROR还没被IO取走的话, 还给调用方(比如connect之后检查结果)
+    if (CppServer::t_hook_enable && level == SOL_SOCKET && optname == SO_ERROR
+            && optval && optlen && *optlen >= sizeof(int)) {
+        CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(sockfd);
+        int err = ctx ? ctx->takeSockError() : 0;
+        if (err) {
+            *(int*) optval = err;
+            *optlen = sizeof(int);
+            return 0;
+        }
+    }
     return getsockopt_f(sockfd, level, optname, optval, optlen);
 }
 
@@ -462,7 +1090,7 @@ int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t
     }
     if (level == SOL_SOCKET) {
         if (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
-            CppServer::FdCtx::ptr ctx = CppServer::FdMgr::GetInstance()->get(sockfd);
+            CppServer::FdCtx* ctx = CppServer::FdMgr::GetInstance()->get(sockfd);
             if (ctx) {
                 const timeval* v = (const timeval*) optval;
                 ctx->setTimeout(optname, v->tv_sec * 1000 + v->tv_usec / 1000);
@@ -0,0 +1,257 @@
+#include "hot_restart.h"
+#include "tcp_server.h"
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+namespace CppServer {
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+// 一条消息最多带的fd数(内核SCM_MAX_FD)
+static const size_t s_max_fds = 253;
+
+bool HotRestart::takeover(const std::string& path, uint64_t timeout_ms) {
+    // 第一次启动, 没有旧进程
+    if (access(path.c_str(), F_OK)) {
+        return false;
+    }
+    Socket::ptr conn = Socket::CreateUnixTCPSocket();
+    Address::ptr addr(new UnixAddress(path));
+    if (!conn->connect(addr, timeout_ms)) {
+        return false;
+    }
+    conn->setRecvTimeout(timeout_ms);
+
+    // 消息: uint32 fd个数, fd在cmsg里
+    uint32_t count = 0;
+    iovec iov{&count, sizeof(count)};
+    char control[CMSG_SPACE(sizeof(int) * s_max_fds)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int rt = recvmsg(conn->getSocket(), &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    if (rt != (int) sizeof(count)) {
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart recvmsg(" << path << ") rt=" << rt
+            << " errno=" << errno << " errstr=" << strerror(errno);
+        return false;
+    }
+
+    std::vector<int> fds;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* p = (const int*) CMSG_DATA(cmsg);
+            fds.insert(fds.end(), p, p + n);
+        }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) || fds.size() != count) {
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart expect " << count
+            << " fds, got " << fds.size();
+        for (auto& fd : fds) {
+            ::close(fd);
+        }
+        return false;
+    }
+
+    std::vector<Socket::ptr> socks;
+    for (auto& fd : fds) {
+        Socket::ptr sock = Socket::FromFd(fd);
+        if (sock) {
+            socks.push_back(sock);
+        } else {
+            ::close(fd);
+        }
+    }
+    // 确认之后旧进程才停止accept
+    if (conn->send("K", 1) != 1) {
+        return false;
+    }
+    MutexType::Lock lock(m_mutex);
+    for (auto& sock : socks) {
+        CPPSERVER_LOG_INFO(g_logger) << "hot restart inherit " << *sock;
+        m_inherited.push_back(sock);
+    }
+    return true;
+}
+
+Socket::ptr HotRestart::takeListener(Address::ptr addr) {
+    std::string str = addr->toString();
+    MutexType::Lock lock(m_mutex);
+    for (auto it = m_inherited.begin(); it != m_inherited.end(); ++it) {
+        if ((*it)->getLocalAddress()->toString() == str) {
+            Socket::ptr sock = *it;
+            m_inherited.erase(it);
+            return sock;
+        }
+    }
+    return nullptr;
+}
+
+size_t HotRestart::getInheritedCount() {
+    MutexType::Lock lock(m_mutex);
+    return m_inherited.size();
+}
+
+void HotRestart::addInherited(Socket::ptr sock) {
+    MutexType::Lock lock(m_mutex);
+    m_inherited.push_back(sock);
+}
+
+size_t HotRestart::closeUnclaimed() {
+    std::vector<Socket::ptr> socks;
+    {
+        MutexType::Lock lock(m_mutex);
+        socks.swap(m_inherited);
+    }
+    for (auto& sock : socks) {
+        CPPSERVER_LOG_INFO(g_logger) << "hot restart close unclaimed " << *sock;
+        sock->close();
+    }
+    return socks.size();
+}
+
+// 交接socket所在的目录只能本用户访问, 否则别的用户可以抢先连上来或者替换socket文件
+static bool PrepareSocketDir(const std::string& path) {
+    size_t pos = path.rfind('/');
+    std::string dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : path.substr(0, pos));
+    struct stat st;
+    if (stat(dir.c_str(), &st)) {
+        if (errno == ENOENT && mkdir(dir.c_str(), 0700) == 0) {
+            return true;
+        }
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart socket dir " << dir << " errno=" << errno
+            << " errstr=" << strerror(errno);
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077)) {
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart socket dir " << dir
+            << " must be owned by uid " << geteuid() << " with mode 0700";
+        return false;
+    }
+    return true;
+}
+
+// 监听fd只交给和本进程有效uid相同的进程
+static bool CheckPeer(const Socket::ptr& conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn->getSocket(), SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart SO_PEERCRED errno=" << errno
+            << " errstr=" << strerror(errno);
+        return false;
+    }
+    if (cred.uid != geteuid()) {
+        CPPSERVER_LOG_WARN(g_logger) << "hot restart refuse peer pid=" << cred.pid
+            << " uid=" << cred.uid;
+        return false;
+    }
+    return true;
+}
+
+bool HotRestart::handoff(Socket::ptr conn, const std::vector<std::shared_ptr<TcpServer> >& servers) {
+    std::vector<int> fds;
+    for (auto& server : servers) {
+        for (auto& sock : server->getSocks()) {
+            if (sock->isValid()) {
+                fds.push_back(sock->getSocket());
+            }
+        }
+    }
+    if (fds.empty() || fds.size() > s_max_fds) {
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart can not hand off " << fds.size() << " fds";
+        return false;
+    }
+
+    uint32_t count = fds.size();
+    iovec iov{&count, sizeof(count)};
+    char control[CMSG_SPACE(sizeof(int) * s_max_fds)];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+    if (sendmsg(conn->getSocket(), &msg, 0) != (int) sizeof(count)) {
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart sendmsg errno=" << errno
+            << " errstr=" << strerror(errno);
+        return false;
+    }
+
+    // 新进程收到并接管之后才确认; 它中途退出的话继续由本进程服务
+    char ack = 0;
+    if (conn->recv(&ack, 1) != 1 || ack != 'K') {
+        CPPSERVER_LOG_ERROR(g_logger) << "hot restart no ack from new process";
+        return false;
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "hot restart handed off " << fds.size() << " listeners";
+    return true;
+}
+
+bool HotRestart::serve(const std::string& path, const std::vector<std::shared_ptr<TcpServer> >& servers,
+                       uint64_t drain_ms) {
+    // 已经在服务了, 没被认领的继承socket不会再有人要
+    closeUnclaimed();
+    if (!PrepareSocketDir(path)) {
+        return false;
+    }
+    Address::ptr addr(new UnixAddress(path));
+    Socket::ptr listener = Socket::CreateUnixTCPSocket();
+    ::unlink(path.c_str());
+    if (!listener->bind(addr)) {
+        return false;
+    }
+    // bind按umask建文件, 目录已经挡住了别的用户, 这里再收紧到0600
+    if (chmod(path.c_str(), 0600) || !listener->listen()) {
+        ::unlink(path.c_str());
+        return false;
+    }
+
+    bool done = false;
+    while (!done) {
+        Socket::ptr conn = listener->accept();
+        if (!conn) {
+            break;
+        }
+        if (!CheckPeer(conn)) {
+            conn->close();
+            continue;
+        }
+        conn->setRecvTimeout(3000);
+        done = handoff(conn, servers);
+        conn->close();
+    }
+    listener->close();
+    ::unlink(path.c_str());
+    if (!done) {
+        return false;
+    }
+
+    for (auto& server : servers) {
+        server->stop();
+    }
+    bool drained = true;
+    uint64_t deadline = GetCoarseMS() + drain_ms;
+    for (auto& server : servers) {
+        uint64_t now = GetCoarseMS();
+        drained = server->drain(deadline > now ? deadline - now : 0) && drained;
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "hot restart drain " << (drained ? "finished" : "timeout");
+    return drained;
+}
+
+}  // CppServer
@@ -0,0 +1,52 @@
+#ifndef __CPPSERVER_HOT_RESTART_H__
+#define __CPPSERVER_HOT_RESTART_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "socket.h"
+#include "address.h"
+#include "thread.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace CppServer {
+
+class TcpServer;
+
+// 热重启: 旧进程通过Unix域socket用SCM_RIGHTS把监听fd交给新进程
+// 交接之后两个进程共用同一个监听队列, 重启期间不丢SYN; 旧进程随后停止accept, 处理完已有连接再退出
+// 已建立的连接不迁移, 留在旧进程里处理完
+class HotRestart : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    // 新进程启动时调用: 连到path上的旧进程取回监听socket; 没有旧进程或交接失败返回false
+    bool takeover(const std::string& path, uint64_t timeout_ms = 3000);
+    // 取出和addr地址相同的继承socket, TcpServer::bind时优先使用
+    Socket::ptr takeListener(Address::ptr addr);
+    size_t getInheritedCount();
+    // 其它途径继承来的监听socket(比如fork出的worker从master继承的), 同样交给TcpServer::bind
+    void addInherited(Socket::ptr sock);
+    // 所有server都bind完之后调用, 关闭没有被认领的继承socket, 返回关闭的个数
+    // 不关的话旧进程交过来的多余监听socket一直留在本进程, 连接会排在没人accept的队列里
+    size_t closeUnclaimed();
+
+    // 旧进程调用, 在IOManager的协程里: 在path上等新进程来接管, 交接后drain所有server(最多drain_ms)
+    // 新进程没有确认时继续等下一个; 交接完成且连接全部结束返回true
+    // path所在目录不存在时以0700创建, 已存在的必须属于本用户且只有本用户能访问; socket文件为0600
+    // 只交给有效uid相同的进程(SO_PEERCRED), 其它连接直接关闭
+    bool serve(const std::string& path, const std::vector<std::shared_ptr<TcpServer> >& servers,
+               uint64_t drain_ms);
+private:
+    bool handoff(Socket::ptr conn, const std::vector<std::shared_ptr<TcpServer> >& servers);
+private:
+    MutexType m_mutex;
+    std::vector<Socket::ptr> m_inherited;
+};
+
+typedef Singleton<HotRestart> HotRestartMgr;
+
+}  // CppServer
+
+#endif  // __CPPSERVER_HOT_RESTART_H__
@@ -0,0 +1,258 @@
+#include "http.h"
+#include "CppServer/socket_stream.h"
+
+#include <stdio.h>
+#include <strings.h>
+
+namespace CppServer {
+namespace http {
+
+std::ostream& operator<<(std::ostream& os, const StrRef& s) {
+    return os.write(s.data, s.size);
+}
+
+HttpMethod StringToHttpMethod(const char* m, size_t len) {
+#define XX(name) \
+    if (len == sizeof(#name) - 1 && !memcmp(m, #name, len)) { \
+        return HttpMethod::name; \
+    }
+    HTTP_METHOD_MAP(XX);
+#undef XX
+    return HttpMethod::INVALID_METHOD;
+}
+
+static const char* s_method_string[] = {
+#define XX(name) #name,
+    HTTP_METHOD_MAP(XX)
+#undef XX
+};
+
+const char* HttpMethodToString(HttpMethod m) {
+    uint32_t idx = (uint32_t) m;
+    if (idx >= (sizeof(s_method_string) / sizeof(s_method_string[0]))) {
+        return "<unknown>";
+    }
+    return s_method_string[idx];
+}
+
+const char* HttpStatusToString(HttpStatus s) {
+    switch (s) {
+#define XX(code, name, msg) \
+        case HttpStatus::name: \
+            return #msg;
+        HTTP_STATUS_MAP(XX);
+#undef XX
+        default:
+            return "<unknown>";
+    }
+}
+
+HttpRequest::HttpRequest() {
+    reset();
+}
+
+void HttpRequest::reset() {
+    m_method = HttpMethod::INVALID_METHOD;
+    m_methodStr = StrRef();
+    m_version = 0x11;
+    m_path = StrRef();
+    m_query = StrRef();
+    m_body = StrRef();
+    m_headerCount = 0;
+    m_keepAlive = false;
+    m_chunked = false;
+    m_expectContinue = false;
+    m_hasContentLength = false;
+    m_contentLength = 0;
+}
+
+const char* HttpRequest::getHeader(const char* name, const char* def) const {
+    for (size_t i = 0; i < m_headerCount; ++i) {
+        if (m_headers[i].name.iequals(name)) {
+            return m_headers[i].value.data;
+        }
+    }
+    return def;
+}
+
+static void Relocate(StrRef& s, const char* from, size_t len, const char* to) {
+    if (s.data >= from && s.data <= from + len) {
+        s.data = to + (s.data - from);
+    }
+}
+
+void HttpRequest::relocate(const char* from, size_t len, const char* to) {
+    Relocate(m_methodStr, from, len, to);
+    Relocate(m_path, from, len, to);
+    Relocate(m_query, from, len, to);
+    Relocate(m_body, from, len, to);
+    for (size_t i = 0; i < m_headerCount; ++i) {
+        Relocate(m_headers[i].name, from, len, to);
+        Relocate(m_headers[i].value, from, len, to);
+    }
+}
+
+std::ostream& HttpRequest::dump(std::ostream& os) const {
+    os << m_methodStr << " " << m_path;
+    if (!m_query.empty()) {
+        os << "?" << m_query;
+    }
+    os << " HTTP/" << (uint32_t) (m_version >> 4) << "." << (uint32_t) (m_version & 0x0F) << "\r\n";
+    for (size_t i = 0; i < m_headerCount; ++i) {
+        os << m_headers[i].name << ": " << m_headers[i].value << "\r\n";
+    }
+    os << "\r\n" << m_body;
+    return os;
+}
+
+HttpResponse::HttpResponse() {
+    reset(nullptr, 0x11, true, false);
+}
+
+void HttpResponse::reset(SocketStream* stream, uint8_t version, bool keep_alive, bool head) {
+    m_stream = stream;
+    m_status = HttpStatus::OK;
+    m_version = version;
+    m_keepAlive = keep_alive;
+    m_head = head;
+    m_headSent = false;
+    m_finished = false;
+    m_error = false;
+    m_headers.clear();
+    m_body.clear();
+}
+
+void HttpResponse::setHeader(const std::string& name, const std::string& value) {
+    for (auto& i : m_headers) {
+        if (!strcasecmp(i.first.c_str(), name.c_str())) {
+            i.second = value;
+            return;
+        }
+    }
+    m_headers.push_back(std::make_pair(name, value));
+}
+
+const std::string* HttpResponse::getHeader(const std::string& name) const {
+    for (auto& i : m_headers) {
+        if (!strcasecmp(i.first.c_str(), name.c_str())) {
+            return &i.second;
+        }
+    }
+    return nullptr;
+}
+
+// 只写进SocketStream的写缓冲区, 流水线上的多个响应攒在一起发
+// content_length为-1时不带长度, 靠关闭连接结束body
+bool HttpResponse::writeHead(bool chunked, size_t content_length) {
+    m_headSent = true;
+    char line[128];
+    int n = snprintf(line, sizeof(line), "HTTP/%u.%u %d %s\r\n",
+                     m_version >> 4, m_version & 0x0F,
+                     (int) m_status, HttpStatusToString(m_status));
+    bool ok = m_stream->writeFixSize(line, n) > 0;
+    for (auto& i : m_headers) {
+        ok = ok && m_stream->writeFixSize(i.first.c_str(), i.first.size()) > 0
+                && m_stream->writeFixSize(": ", 2) > 0
+                && m_stream->writeFixSize(i.second.c_str(), i.second.size()) > 0
+                && m_stream->writeFixSize("\r\n", 2) > 0;
+    }
+    n = 0;
+    if (chunked) {
+        n = snprintf(line, sizeof(line), "Transfer-Encoding: chunked\r\n");
+    } else if (content_length != (size_t) -1) {
+        n = snprintf(line, sizeof(line), "Content-Length: %zu\r\n", content_length);
+    }
+    if (!m_keepAlive) {
+        n += snprintf(line + n, sizeof(line) - n, "Connection: close\r\n");
+    } else if (m_version == 0x10) {
+        n += snprintf(line + n, sizeof(line) - n, "Connection: keep-alive\r\n");
+    }
+    n += snprintf(line + n, sizeof(line) - n, "\r\n");
+    ok = ok && m_stream->writeFixSize(line, n) > 0;
+    m_error = !ok;
+    return ok;
+}
+
+bool HttpResponse::writeChunk(const void* data, size_t len) {
+    if (m_finished || m_error) {
+        return false;
+    }
+    if (!m_headSent) {
+        // HTTP/1.0不支持chunked, 只能发完就关连接
+        if (m_version == 0x10) {
+            m_keepAlive = false;
+        }
+        if (!writeHead(m_version != 0x10, (size_t) -1)) {
+            return false;
+        }
+    }
+    if (!len || m_head) {
+        return true;
+    }
+    if (m_version == 0x10) {
+        m_error = m_stream->writeFixSize(data, len) <= 0;
+        return !m_error;
+    }
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+    m_error = m_stream->writeFixSize(size, n) <= 0
+                || m_stream->writeFixSize(data, len) <= 0
+                || m_stream->writeFixSize("\r\n", 2) <= 0;
+    return !m_error;
+}
+
+bool HttpResponse::flush() {
+    if (m_error) {
+        return false;
+    }
+    m_error = m_stream->flush() != 0;
+    return !m_error;
+}
+
+bool HttpResponse::finish() {
+    if (m_finished) {
+        return !m_error;
+    }
+    if (m_headSent && !m_body.empty()) {
+        // 流式之后又append的body, 当作最后一块
+        writeChunk(m_body.c_str(), m_body.size());
+    }
+    m_finished = true;
+    if (m_error) {
+        return false;
+    }
+    if (m_headSent) {
+        if (m_version != 0x10 && !m_head) {
+            m_error = m_stream->writeFixSize("0\r\n\r\n", 5) <= 0;
+        }
+        return !m_error;
+    }
+    if (!writeHead(false, m_body.size())) {
+        return false;
+    }
+    if (!m_head && !m_body.empty()) {
+        m_error = m_stream->writeFixSize(m_body.c_str(), m_body.size()) <= 0;
+    }
+    return !m_error;
+}
+
+std::ostream& HttpResponse::dump(std::ostream& os) const {
+    os << "HTTP/" << (uint32_t) (m_version >> 4) << "." << (uint32_t) (m_version & 0x0F)
+       << " " << (uint32_t) m_status << " " << HttpStatusToString(m_status) << "\r\n";
+    for (auto& i : m_headers) {
+        os << i.first << ": " << i.second << "\r\n";
+    }
+    os << "Content-Length: " << m_body.size() << "\r\n\r\n" << m_body;
+    return os;
+}
+
+std::ostream& operator<<(std::ostream& os, const HttpRequest& req) {
+    return req.dump(os);
+}
+
+std::ostream& operator<<(std::ostream& os, const HttpResponse& rsp) {
+    return rsp.dump(os);
+}
+
+}  // http
+}  // CppServer
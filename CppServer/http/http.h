@@ -0,0 +1,194 @@
+#ifndef __CPPSERVER_HTTP_HTTP_H__
+#define __CPPSERVER_HTTP_HTTP_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+namespace CppServer {
+
+class SocketStream;
+
+namespace http {
+
+// 指向别处内存的字符串片段, 不拥有内存
+// 请求里的都指向连接的读缓冲区, 除了body都以'\0'结尾, 可以直接当C字符串用
+struct StrRef {
+    const char* data = "";
+    size_t size = 0;
+
+    StrRef() {}
+    StrRef(const char* d, size_t s) : data(d), size(s) {}
+
+    bool empty() const { return size == 0; }
+    std::string toString() const { return std::string(data, size); }
+    bool equals(const char* s) const { return strlen(s) == size && !memcmp(data, s, size); }
+    bool iequals(const char* s) const { return strlen(s) == size && !strncasecmp(data, s, size); }
+};
+
+std::ostream& operator<<(std::ostream& os, const StrRef& s);
+
+#define HTTP_METHOD_MAP(XX) \
+    XX(GET)                 \
+    XX(HEAD)                \
+    XX(POST)                \
+    XX(PUT)                 \
+    XX(DELETE)              \
+    XX(CONNECT)             \
+    XX(OPTIONS)             \
+    XX(TRACE)               \
+    XX(PATCH)
+
+enum class HttpMethod {
+#define XX(name) name,
+    HTTP_METHOD_MAP(XX)
+#undef XX
+    INVALID_METHOD
+};
+
+#define HTTP_STATUS_MAP(XX)                         \
+    XX(100, CONTINUE, Continue)                     \
+    XX(200, OK, OK)                                 \
+    XX(201, CREATED, Created)                       \
+    XX(204, NO_CONTENT, No Content)                 \
+    XX(301, MOVED_PERMANENTLY, Moved Permanently)   \
+    XX(302, FOUND, Found)                           \
+    XX(304, NOT_MODIFIED, Not Modified)             \
+    XX(400, BAD_REQUEST, Bad Request)               \
+    XX(403, FORBIDDEN, Forbidden)                   \
+    XX(404, NOT_FOUND, Not Found)                   \
+    XX(405, METHOD_NOT_ALLOWED, Method Not Allowed) \
+    XX(408, REQUEST_TIMEOUT, Request Timeout)       \
+    XX(413, PAYLOAD_TOO_LARGE, Payload Too Large)   \
+    XX(414, URI_TOO_LONG, URI Too Long)             \
+    XX(417, EXPECTATION_FAILED, Expectation Failed) \
+    XX(431, REQUEST_HEADER_FIELDS_TOO_LARGE, Request Header Fields Too Large) \
+    XX(500, INTERNAL_SERVER_ERROR, Internal Server Error) \
+    XX(501, NOT_IMPLEMENTED, Not Implemented)       \
+    XX(503, SERVICE_UNAVAILABLE, Service Unavailable) \
+    XX(505, HTTP_VERSION_NOT_SUPPORTED, HTTP Version Not Supported)
+
+enum class HttpStatus {
+#define XX(code, name, desc) name = code,
+    HTTP_STATUS_MAP(XX)
+#undef XX
+};
+
+HttpMethod StringToHttpMethod(const char* m, size_t len);
+const char* HttpMethodToString(HttpMethod m);
+const char* HttpStatusToString(HttpStatus s);
+
+// 解析出的请求, 所有字段都指向连接的读缓冲区, 只在处理本请求期间有效
+// 头部放在定长数组里, 解析时不分配内存
+class HttpRequest {
+friend class HttpRequestParser;
+public:
+    static const size_t kMaxHeaders = 64;
+
+    struct Header {
+        StrRef name;
+        StrRef value;
+    };
+
+    HttpRequest();
+    void reset();
+
+    HttpMethod getMethod() const { return m_method; }
+    StrRef getMethodString() const { return m_methodStr; }
+    // 0x10 / 0x11
+    uint8_t getVersion() const { return m_version; }
+    // 不含query, 未做%解码
+    const StrRef& getPath() const { return m_path; }
+    const StrRef& getQuery() const { return m_query; }
+    // 不以'\0'结尾
+    const StrRef& getBody() const { return m_body; }
+
+    size_t getHeaderCount() const { return m_headerCount; }
+    const Header& getHeader(size_t i) const { return m_headers[i]; }
+    // 名字不区分大小写, 没有返回def
+    const char* getHeader(const char* name, const char* def = nullptr) const;
+    bool hasHeader(const char* name) const { return getHeader(name) != nullptr; }
+
+    bool isKeepAlive() const { return m_keepAlive; }
+    bool isChunked() const { return m_chunked; }
+    uint64_t getContentLength() const { return m_contentLength; }
+    // 带Expect: 100-continue
+    bool isExpectContinue() const { return m_expectContinue; }
+
+    // 缓冲区里[from, from + len)的数据搬到了to, 修正指向它的字段
+    void relocate(const char* from, size_t len, const char* to);
+
+    std::ostream& dump(std::ostream& os) const;
+private:
+    HttpMethod m_method;
+    StrRef m_methodStr;
+    uint8_t m_version;
+    StrRef m_path;
+    StrRef m_query;
+    StrRef m_body;
+    Header m_headers[kMaxHeaders];
+    size_t m_headerCount;
+    bool m_keepAlive;
+    bool m_chunked;
+    bool m_expectContinue;
+    bool m_hasContentLength;
+    uint64_t m_contentLength;
+};
+
+// 响应: 默认攒完整个body, 处理函数返回后带Content-Length一次发出
+// 调用writeChunk之后改为Transfer-Encoding: chunked流式发送
+// 连接上的每个请求复用同一个对象
+class HttpResponse {
+public:
+    HttpResponse();
+    void reset(SocketStream* stream, uint8_t version, bool keep_alive, bool head);
+
+    HttpStatus getStatus() const { return m_status; }
+    void setStatus(HttpStatus v) { m_status = v; }
+    // 同名的会覆盖
+    void setHeader(const std::string& name, const std::string& value);
+    const std::string* getHeader(const std::string& name) const;
+    const std::string& getBody() const { return m_body; }
+    void setBody(const std::string& v) { m_body = v; }
+    void appendBody(const char* data, size_t len) { m_body.append(data, len); }
+    bool isKeepAlive() const { return m_keepAlive; }
+    // 只能关掉, 客户端不要求保持的连接不能打开
+    void setClose() { m_keepAlive = false; }
+
+    // 流式发送一块body, 第一次调用时先发出响应头; len为0被忽略
+    // 数据先进连接的写缓冲区, 需要马上送到对端时调用flush
+    bool writeChunk(const void* data, size_t len);
+    bool flush();
+    // 发出响应(流式时发结束块), 只生效一次; 由HttpServer在处理函数返回后调用
+    bool finish();
+    bool isFinished() const { return m_finished; }
+    bool isStreaming() const { return m_headSent; }
+    bool isError() const { return m_error; }
+
+    std::ostream& dump(std::ostream& os) const;
+private:
+    bool writeHead(bool chunked, size_t content_length);
+private:
+    SocketStream* m_stream;
+    HttpStatus m_status;
+    uint8_t m_version;
+    bool m_keepAlive;
+    bool m_head;        // HEAD请求, 不发body
+    bool m_headSent;
+    bool m_finished;
+    bool m_error;
+    std::vector<std::pair<std::string, std::string> > m_headers;
+    std::string m_body;
+};
+
+std::ostream& operator<<(std::ostream& os, const HttpRequest& req);
+std::ostream& operator<<(std::ostream& os, const HttpResponse& rsp);
+
+}  // http
+}  // CppServer
+
+#endif  // __CPPSERVER_HTTP_HTTP_H__
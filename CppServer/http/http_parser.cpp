@@ -0,0 +1,389 @@
+#include "http_parser.h"
+#include "CppServer/config.h"
+#include "CppServer/log.h"
+
+#include <string.h>
+#include <strings.h>
+
+namespace CppServer {
+namespace http {
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_http_max_header_size =
+    CppServer::Config::Lookup("http.max_header_size", (uint64_t) (16 * 1024), "http request line plus headers max size");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_http_max_body_size =
+    CppServer::Config::Lookup("http.max_body_size", (uint64_t) (8 * 1024 * 1024), "http request body max size");
+
+static uint64_t s_http_max_header_size = 0;
+static uint64_t s_http_max_body_size = 0;
+
+struct _HttpParserIniter {
+    _HttpParserIniter() {
+        s_http_max_header_size = g_http_max_header_size->getValue();
+        g_http_max_header_size->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            CPPSERVER_LOG_INFO(g_logger) << "http max header size change from "
+                                         << old_value << " to " << new_value;
+            s_http_max_header_size = new_value;
+        });
+        s_http_max_body_size = g_http_max_body_size->getValue();
+        g_http_max_body_size->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            CPPSERVER_LOG_INFO(g_logger) << "http max body size change from "
+                                         << old_value << " to " << new_value;
+            s_http_max_body_size = new_value;
+        });
+    }
+};
+
+static _HttpParserIniter s_http_parser_initer;
+
+uint64_t HttpRequestParser::GetMaxHeaderSize() {
+    return s_http_max_header_size;
+}
+
+uint64_t HttpRequestParser::GetMaxBodySize() {
+    return s_http_max_body_size;
+}
+
+HttpRequestParser::HttpRequestParser()
+    : m_maxHeaderSize(s_http_max_header_size)
+    , m_maxBodySize(s_http_max_body_size) {
+    reset();
+}
+
+void HttpRequestParser::reset() {
+    m_scanned = 0;
+    m_chunkPos = 0;
+    m_chunkBody = 0;
+    m_inTrailer = false;
+}
+
+static bool IsTokenChar(char c) {
+    return c > 0x20 && c < 0x7F && !strchr("\"(),/:;<=>?@[\\]{}", c);
+}
+
+static bool IsSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// 逗号分隔的列表里有没有token, 不区分大小写
+static bool HasToken(const char* v, const char* token) {
+    size_t len = strlen(token);
+    while (*v) {
+        while (*v == ',' || IsSpace(*v)) {
+            ++v;
+        }
+        const char* end = v;
+        while (*end && *end != ',') {
+            ++end;
+        }
+        const char* last = end;
+        while (last > v && IsSpace(last[-1])) {
+            --last;
+        }
+        if ((size_t) (last - v) == len && !strncasecmp(v, token, len)) {
+            return true;
+        }
+        v = end;
+    }
+    return false;
+}
+
+int HttpRequestParser::parseRequestLine(char* p, char* eol, HttpRequest& req) {
+    char* sp = (char*) memchr(p, ' ', eol - p);
+    if (!sp || sp == p) {
+        return -400;
+    }
+    for (char* c = p; c < sp; ++c) {
+        if (!IsTokenChar(*c)) {
+            return -400;
+        }
+    }
+    *sp = '\0';
+    req.m_methodStr = StrRef(p, sp - p);
+    req.m_method = StringToHttpMethod(p, sp - p);
+
+    char* target = sp + 1;
+    sp = (char*) memchr(target, ' ', eol - target);
+    if (!sp || sp == target) {
+        return -400;
+    }
+    char* version = sp + 1;
+    if (eol - version != 8 || memcmp(version, "HTTP/1.", 7)) {
+        return (eol - version >= 5 && !memcmp(version, "HTTP/", 5)) ? -505 : -400;
+    }
+    if (version[7] == '1') {
+        req.m_version = 0x11;
+    } else if (version[7] == '0') {
+        req.m_version = 0x10;
+    } else {
+        return -505;
+    }
+    *sp = '\0';
+
+    // absolute-form: 跳过scheme://authority
+    if (*target != '/' && !(sp - target == 1 && *target == '*')) {
+        char* scheme = (char*) memmem(target, sp - target, "://", 3);
+        if (!scheme) {
+            return -400;
+        }
+        target = (char*) memchr(scheme + 3, '/', sp - scheme - 3);
+        if (!target) {
+            req.m_path = StrRef("/", 1);
+            return 0;
+        }
+    }
+    for (char* c = target; c < sp; ++c) {
+        if ((unsigned char) *c <= 0x20 || *c == 0x7F) {
+            return -400;
+        }
+    }
+    char* query = (char*) memchr(target, '?', sp - target);
+    if (query) {
+        *query = '\0';
+        req.m_path = StrRef(target, query - target);
+        req.m_query = StrRef(query + 1, sp - query - 1);
+    } else {
+        req.m_path = StrRef(target, sp - target);
+    }
+    return 0;
+}
+
+int HttpRequestParser::parseHeader(char* p, char* eol, HttpRequest& req, bool& close, bool& keep_alive) {
+    // 不支持obs-fold
+    if (IsSpace(*p)) {
+        return -400;
+    }
+    char* colon = (char*) memchr(p, ':', eol - p);
+    if (!colon || colon == p) {
+        return -400;
+    }
+    for (char* c = p; c < colon; ++c) {
+        if (!IsTokenChar(*c)) {
+            return -400;
+        }
+    }
+    char* value = colon + 1;
+    while (value < eol && IsSpace(*value)) {
+        ++value;
+    }
+    char* end = eol;
+    while (end > value && IsSpace(end[-1])) {
+        --end;
+    }
+    if (req.m_headerCount >= HttpRequest::kMaxHeaders) {
+        return -431;
+    }
+    *colon = '\0';
+    *end = '\0';
+    HttpRequest::Header& header = req.m_headers[req.m_headerCount++];
+    header.name = StrRef(p, colon - p);
+    header.value = StrRef(value, end - value);
+
+    if (header.name.iequals("Content-Length")) {
+        if (header.value.empty() || header.value.size > 19) {
+            return -400;
+        }
+        uint64_t length = 0;
+        for (char* c = value; c < end; ++c) {
+            if (*c < '0' || *c > '9') {
+                return -400;
+            }
+            length = length * 10 + (*c - '0');
+        }
+        if (req.m_hasContentLength && length != req.m_contentLength) {
+            return -400;
+        }
+        req.m_hasContentLength = true;
+        req.m_contentLength = length;
+    } else if (header.name.iequals("Transfer-Encoding")) {
+        // 只支持chunked
+        if (!header.value.iequals("chunked")) {
+            return -501;
+        }
+        req.m_chunked = true;
+    } else if (header.name.iequals("Connection")) {
+        close = close || HasToken(value, "close");
+        keep_alive = keep_alive || HasToken(value, "keep-alive");
+    } else if (header.name.iequals("Expect")) {
+        if (!header.value.iequals("100-continue")) {
+            return -417;
+        }
+        req.m_expectContinue = true;
+    }
+    return 0;
+}
+
+int HttpRequestParser::parseHead(char* buf, size_t len, HttpRequest& req) {
+    // 流水线里上一个请求body后面多余的空行
+    size_t skip = 0;
+    while (skip < len && (buf[skip] == '\r' || buf[skip] == '\n')) {
+        ++skip;
+    }
+    buf += skip;
+    len -= skip;
+    size_t from = m_scanned > skip + 3 ? m_scanned - skip - 3 : 0;
+    char* end = from < len ? (char*) memmem(buf + from, len - from, "\r\n\r\n", 4) : nullptr;
+    if (!end) {
+        m_scanned = skip + len;
+        return len > m_maxHeaderSize ? -431 : 0;
+    }
+    size_t head_len = end + 4 - buf;
+    if (head_len > m_maxHeaderSize) {
+        return -431;
+    }
+    m_scanned = 0;
+
+    req.reset();
+    char* eol = (char*) memchr(buf, '\r', end + 2 - buf);
+    if (eol[1] != '\n') {
+        return -400;
+    }
+    int rt = parseRequestLine(buf, eol, req);
+    if (rt < 0) {
+        return rt;
+    }
+
+    bool close = false;
+    bool keep_alive = false;
+    char* p = eol + 2;
+    while (p < end + 2) {
+        eol = (char*) memchr(p, '\r', end + 2 - p);
+        if (eol[1] != '\n') {
+            return -400;
+        }
+        rt = parseHeader(p, eol, req, close, keep_alive);
+        if (rt < 0) {
+            return rt;
+        }
+        p = eol + 2;
+    }
+
+    if (req.m_chunked) {
+        // 同时带Content-Length的, 按chunked处理, 处理完关闭连接(RFC 7230 3.3.3)
+        if (req.m_hasContentLength) {
+            close = true;
+        }
+        req.m_contentLength = 0;
+    } else if (req.m_contentLength > m_maxBodySize) {
+        return -413;
+    }
+    if (req.m_version == 0x11) {
+        req.m_keepAlive = !close;
+    } else {
+        req.m_keepAlive = keep_alive && !close;
+    }
+    // Content-Length的body紧跟在请求头后面, 是否收全由调用方判断; chunked的解码后再设置
+    req.m_body = StrRef(end + 4, req.m_contentLength);
+    m_chunkPos = 0;
+    m_chunkBody = 0;
+    m_inTrailer = false;
+    return skip + head_len;
+}
+
+// 解析一行chunk头: 十六进制长度[;扩展]\r\n, 返回数据开始的位置, 出错返回-1, 不完整返回0
+static int64_t ParseChunkHeader(const char* buf, size_t pos, size_t len, uint64_t& size) {
+    const char* eol = (const char*) memchr(buf + pos, '\n', len - pos);
+    if (!eol) {
+        return len - pos > 1024 ? -1 : 0;
+    }
+    const char* p = buf + pos;
+    if (eol == p || eol[-1] != '\r') {
+        return -1;
+    }
+    size = 0;
+    int digits = 0;
+    for (; p < eol - 1; ++p) {
+        int v;
+        if (*p >= '0' && *p <= '9') {
+            v = *p - '0';
+        } else if (*p >= 'a' && *p <= 'f') {
+            v = *p - 'a' + 10;
+        } else if (*p >= 'A' && *p <= 'F') {
+            v = *p - 'A' + 10;
+        } else {
+            break;
+        }
+        if (++digits > 15) {
+            return -1;
+        }
+        size = size * 16 + v;
+    }
+    if (!digits || (p < eol - 1 && *p != ';' && !IsSpace(*p))) {
+        return -1;
+    }
+    return eol + 1 - buf;
+}
+
+int64_t HttpRequestParser::parseChunked(char* buf, size_t len, HttpRequest& req) {
+    size_t pos = m_chunkPos;
+    while (true) {
+        if (m_inTrailer) {
+            char* eol = (char*) memchr(buf + pos, '\n', len - pos);
+            if (!eol) {
+                return len - pos > m_maxHeaderSize ? -431 : 0;
+            }
+            if (eol == buf + pos + 1 && buf[pos] == '\r') {
+                size_t consumed = pos + 2;
+                size_t body_len = DecodeChunked(buf, consumed);
+                req.m_body = StrRef(buf, body_len);
+                req.m_contentLength = body_len;
+                m_chunkPos = 0;
+                m_chunkBody = 0;
+                m_inTrailer = false;
+                return consumed;
+            }
+            // trailer头直接忽略
+            pos = eol + 1 - buf;
+            m_chunkPos = pos;
+            continue;
+        }
+        uint64_t size = 0;
+        int64_t data = ParseChunkHeader(buf, pos, len, size);
+        if (data < 0) {
+            return -400;
+        }
+        if (data == 0) {
+            return 0;
+        }
+        if (size == 0) {
+            m_inTrailer = true;
+            pos = data;
+            m_chunkPos = pos;
+            continue;
+        }
+        if (m_chunkBody + size > m_maxBodySize) {
+            return -413;
+        }
+        if (len < data + size + 2) {
+            return 0;
+        }
+        if (buf[data + size] != '\r' || buf[data + size + 1] != '\n') {
+            return -400;
+        }
+        m_chunkBody += size;
+        pos = data + size + 2;
+        m_chunkPos = pos;
+    }
+}
+
+// 已经确认完整, 把各块数据依次往前挪到一起
+size_t HttpRequestParser::DecodeChunked(char* buf, size_t len) {
+    size_t pos = 0;
+    size_t write = 0;
+    while (true) {
+        uint64_t size = 0;
+        int64_t data = ParseChunkHeader(buf, pos, len, size);
+        if (size == 0) {
+            break;
+        }
+        memmove(buf + write, buf + data, size);
+        write += size;
+        pos = data + size + 2;
+    }
+    return write;
+}
+
+}  // http
+}  // CppServer
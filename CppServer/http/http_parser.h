@@ -0,0 +1,48 @@
+#ifndef __CPPSERVER_HTTP_HTTP_PARSER_H__
+#define __CPPSERVER_HTTP_HTTP_PARSER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "http.h"
+
+namespace CppServer {
+namespace http {
+
+// 在连接的读缓冲区上原地解析请求, 不拷贝也不分配内存
+// 解析成功时把各字段结尾的分隔符改写成'\0', HttpRequest里的字段直接指向缓冲区
+// 数据不完整时记住已经扫描过的位置, 收到更多数据后从那里继续; 缓冲区搬移不影响(位置都是相对起点的)
+// 出错返回负的HTTP状态码, 比如-400/-413/-431/-501/-505
+class HttpRequestParser {
+public:
+    HttpRequestParser();
+
+    // 解析buf开头的请求行和头部, 会跳过请求之间多余的空行
+    // 返回: >0 请求头的长度(含结尾的空行); 0 还不完整
+    int parseHead(char* buf, size_t len, HttpRequest& req);
+    // 解析chunked body, buf从body开始; 完整时原地解码, req的body指向buf
+    // 返回: >0 chunked编码占的字节数(含trailer); 0 还不完整
+    int64_t parseChunked(char* buf, size_t len, HttpRequest& req);
+    void reset();
+
+    uint64_t getMaxHeaderSize() const { return m_maxHeaderSize; }
+    uint64_t getMaxBodySize() const { return m_maxBodySize; }
+
+    static uint64_t GetMaxHeaderSize();
+    static uint64_t GetMaxBodySize();
+private:
+    int parseRequestLine(char* p, char* eol, HttpRequest& req);
+    int parseHeader(char* p, char* eol, HttpRequest& req, bool& close, bool& keep_alive);
+    static size_t DecodeChunked(char* buf, size_t len);
+private:
+    uint64_t m_maxHeaderSize;
+    uint64_t m_maxBodySize;
+    size_t m_scanned;       // 找请求头结尾时已经扫描过的字节
+    size_t m_chunkPos;      // 下一个chunk头的位置
+    uint64_t m_chunkBody;   // 已经完整收到的chunk数据量
+    bool m_inTrailer;
+};
+
+}  // http
+}  // CppServer
+
+#endif  // __CPPSERVER_HTTP_HTTP_PARSER_H__
@@ -0,0 +1,191 @@
+#include "http_server.h"
+#include "http_parser.h"
+#include "CppServer/socket_stream.h"
+#include "CppServer/buffer_pool.h"
+#include "CppServer/config.h"
+#include "CppServer/log.h"
+
+#include <string.h>
+
+namespace CppServer {
+namespace http {
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_http_buffer_size =
+    CppServer::Config::Lookup("http.buffer_size", (uint64_t) 4096, "http connection initial read buffer size");
+
+namespace {
+
+// 一个连接上的读缓冲区和请求解析, [m_begin, m_end)为还没处理的数据
+class HttpSession {
+public:
+    HttpSession(Socket::ptr sock)
+        : m_sock(sock)
+        , m_stream(sock, false)
+        , m_buf(BufferPoolMgr::GetInstance()->allocate(g_http_buffer_size->getValue()))
+        , m_begin(0)
+        , m_end(0)
+        , m_tooLarge(false) {
+        // chunked编码本身也占空间, 按body上限的两倍算
+        m_maxBuffer = m_parser.getMaxHeaderSize() + m_parser.getMaxBodySize() * 2;
+    }
+
+    SocketStream& getStream() { return m_stream; }
+
+    // 读出一个完整的请求(含body), consumed为它在缓冲区里占的字节
+    // 返回0成功, -1为连接断开, >0为要回给客户端的错误状态码
+    int recvRequest(HttpRequest& req, size_t& consumed);
+    // 当前请求处理完之后调用
+    void consume(size_t n) {
+        m_begin += n;
+        if (m_begin == m_end) {
+            m_begin = m_end = 0;
+        }
+    }
+private:
+    char* data() const { return m_buf->data() + m_begin; }
+    size_t size() const { return m_end - m_begin; }
+    // 等新数据之前先把攒着的响应发出去; 缓冲区搬移之后修正req里的指针
+    bool fill(HttpRequest* req);
+private:
+    Socket::ptr m_sock;
+    SocketStream m_stream;
+    HttpRequestParser m_parser;
+    Buffer::ptr m_buf;
+    size_t m_begin;
+    size_t m_end;
+    size_t m_maxBuffer;
+    bool m_tooLarge;
+};
+
+bool HttpSession::fill(HttpRequest* req) {
+    if (m_stream.flush()) {
+        return false;
+    }
+    const char* old = data();
+    size_t len = size();
+    if (m_begin > 0) {
+        memmove(m_buf->data(), old, len);
+        m_begin = 0;
+        m_end = len;
+    }
+    if (m_end == m_buf->size()) {
+        if (m_buf->size() >= m_maxBuffer) {
+            m_tooLarge = true;
+            return false;
+        }
+        Buffer::ptr buf = BufferPoolMgr::GetInstance()->allocate(m_buf->size() * 2);
+        memcpy(buf->data(), m_buf->data(), m_end);
+        m_buf.swap(buf);
+    }
+    if (req && data() != old) {
+        req->relocate(old, len, data());
+    }
+    int rt = m_sock->recv(m_buf->data() + m_end, m_buf->size() - m_end);
+    if (rt <= 0) {
+        return false;
+    }
+    m_end += rt;
+    return true;
+}
+
+int HttpSession::recvRequest(HttpRequest& req, size_t& consumed) {
+    int head = 0;
+    while (true) {
+        head = size() ? m_parser.parseHead(data(), size(), req) : 0;
+        if (head < 0) {
+            return -head;
+        }
+        if (head > 0) {
+            break;
+        }
+        if (!fill(nullptr)) {
+            return -1;
+        }
+    }
+
+    bool continued = false;
+    while (true) {
+        int64_t body = 0;
+        bool complete = false;
+        if (req.isChunked()) {
+            body = m_parser.parseChunked(data() + head, size() - head, req);
+            if (body < 0) {
+                return -body;
+            }
+            complete = body > 0;
+        } else {
+            body = req.getContentLength();
+            complete = size() - head >= (uint64_t) body;
+        }
+        if (complete) {
+            consumed = head + body;
+            return 0;
+        }
+        if (req.isExpectContinue() && !continued) {
+            static const char s_continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            continued = true;
+            if (m_stream.writeFixSize(s_continue, sizeof(s_continue) - 1) <= 0) {
+                return -1;
+            }
+        }
+        if (!fill(&req)) {
+            return m_tooLarge ? (int) HttpStatus::PAYLOAD_TOO_LARGE : -1;
+        }
+    }
+}
+
+}  // namespace
+
+HttpServer::HttpServer(bool keepalive, IOManager* worker, IOManager* accept_worker)
+    : TcpServer(worker, accept_worker)
+    , m_isKeepalive(keepalive)
+    , m_dispatch(new ServletDispatch)
+    , m_requests(0) {
+}
+
+void HttpServer::handleClient(Socket::ptr client) {
+    HttpSession session(client);
+    HttpRequest req;
+    HttpResponse rsp;
+    while (true) {
+        size_t consumed = 0;
+        int rt = session.recvRequest(req, consumed);
+        if (rt != 0) {
+            if (rt > 0) {
+                CPPSERVER_LOG_DEBUG(g_logger) << "http bad request " << rt << " from " << *client;
+                rsp.reset(&session.getStream(), 0x11, false, false);
+                rsp.setStatus((HttpStatus) rt);
+                rsp.finish();
+            }
+            break;
+        }
+        ++m_requests;
+        bool keep_alive = m_isKeepalive && req.isKeepAlive() && !isStop();
+        rsp.reset(&session.getStream(), req.getVersion(), keep_alive,
+                  req.getMethod() == HttpMethod::HEAD);
+        if (getOverloadShed() && isOverloaded()) {
+            rsp.setStatus(HttpStatus::SERVICE_UNAVAILABLE);
+            rsp.setClose();
+        } else {
+            m_dispatch->handle(req, rsp);
+        }
+        if (!rsp.finish() || !rsp.isKeepAlive()) {
+            break;
+        }
+        session.consume(consumed);
+    }
+    session.getStream().flush();
+    client->close();
+}
+
+void HttpServer::handleOverload(Socket::ptr client) {
+    static const char s_busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    client->send(s_busy, sizeof(s_busy) - 1);
+    client->close();
+}
+
+}  // http
+}  // CppServer
@@ -0,0 +1,40 @@
+#ifndef __CPPSERVER_HTTP_HTTP_SERVER_H__
+#define __CPPSERVER_HTTP_HTTP_SERVER_H__
+
+#include <atomic>
+#include "CppServer/tcp_server.h"
+#include "servlet.h"
+
+namespace CppServer {
+namespace http {
+
+// HTTP/1.1服务器
+// 每个连接一个读缓冲区(从BufferPool取, 不够时翻倍), 请求在缓冲区上原地解析
+// 流水线: 缓冲区里已经收到的请求依次处理, 响应攒在写缓冲区里, 要等新数据时才一起发出去
+// 请求之间不保留状态, 处理函数拿到的HttpRequest只在本次调用内有效
+class HttpServer : public TcpServer {
+public:
+    typedef std::shared_ptr<HttpServer> ptr;
+
+    HttpServer(bool keepalive = true,
+               IOManager* worker = IOManager::GetThis(),
+               IOManager* accept_worker = IOManager::GetThis());
+
+    ServletDispatch::ptr getServletDispatch() const { return m_dispatch; }
+    void setServletDispatch(ServletDispatch::ptr v) { m_dispatch = v; }
+
+    uint64_t getRequests() const { return m_requests; }
+protected:
+    virtual void handleClient(Socket::ptr client) override;
+    // 过载时新连接直接回503
+    virtual void handleOverload(Socket::ptr client) override;
+private:
+    bool m_isKeepalive;
+    ServletDispatch::ptr m_dispatch;
+    std::atomic<uint64_t> m_requests;
+};
+
+}  // http
+}  // CppServer
+
+#endif  // __CPPSERVER_HTTP_HTTP_SERVER_H__
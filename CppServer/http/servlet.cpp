@@ -0,0 +1,129 @@
+#include "servlet.h"
+
+#include <algorithm>
+#include <fnmatch.h>
+
+namespace CppServer {
+namespace http {
+
+FunctionServlet::FunctionServlet(callback cb)
+    : Servlet("FunctionServlet")
+    , m_cb(cb) {
+}
+
+int32_t FunctionServlet::handle(HttpRequest& req, HttpResponse& rsp) {
+    return m_cb(req, rsp);
+}
+
+NotFoundServlet::NotFoundServlet()
+    : Servlet("NotFoundServlet") {
+}
+
+int32_t NotFoundServlet::handle(HttpRequest& req, HttpResponse& rsp) {
+    static const std::string s_body = "<html><head><title>404 Not Found</title></head>"
+        "<body><center><h1>404 Not Found</h1></center></body></html>";
+    rsp.setStatus(HttpStatus::NOT_FOUND);
+    rsp.setHeader("Content-Type", "text/html");
+    rsp.setBody(s_body);
+    return 0;
+}
+
+ServletDispatch::ServletDispatch()
+    : Servlet("ServletDispatch") {
+    m_default.reset(new NotFoundServlet);
+}
+
+int32_t ServletDispatch::handle(HttpRequest& req, HttpResponse& rsp) {
+    Servlet::ptr slt = getMatchedServlet(req.getPath());
+    if (slt) {
+        return slt->handle(req, rsp);
+    }
+    return 0;
+}
+
+void ServletDispatch::AddRoute(RouteList& list, const std::string& key, Servlet::ptr slt) {
+    DelRoute(list, key);
+    list.push_back(std::make_pair(key, slt));
+}
+
+void ServletDispatch::DelRoute(RouteList& list, const std::string& key) {
+    for (auto it = list.begin(); it != list.end(); ++it) {
+        if (it->first == key) {
+            list.erase(it);
+            break;
+        }
+    }
+}
+
+void ServletDispatch::addServlet(const std::string& uri, Servlet::ptr slt) {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_exact[uri] = slt;
+}
+
+void ServletDispatch::addServlet(const std::string& uri, FunctionServlet::callback cb) {
+    addServlet(uri, std::make_shared<FunctionServlet>(cb));
+}
+
+void ServletDispatch::addPrefixServlet(const std::string& prefix, Servlet::ptr slt) {
+    RWMutexType::WriteLock lock(m_mutex);
+    AddRoute(m_prefixes, prefix, slt);
+    // 长的优先, stable_sort保证同样长度时先加的在前
+    std::stable_sort(m_prefixes.begin(), m_prefixes.end(),
+        [](const RouteList::value_type& a, const RouteList::value_type& b) {
+            return a.first.size() > b.first.size();
+        });
+}
+
+void ServletDispatch::addPrefixServlet(const std::string& prefix, FunctionServlet::callback cb) {
+    addPrefixServlet(prefix, std::make_shared<FunctionServlet>(cb));
+}
+
+void ServletDispatch::addGlobServlet(const std::string& pattern, Servlet::ptr slt) {
+    RWMutexType::WriteLock lock(m_mutex);
+    AddRoute(m_globs, pattern, slt);
+}
+
+void ServletDispatch::addGlobServlet(const std::string& pattern, FunctionServlet::callback cb) {
+    addGlobServlet(pattern, std::make_shared<FunctionServlet>(cb));
+}
+
+void ServletDispatch::delServlet(const std::string& uri) {
+    RWMutexType::WriteLock lock(m_mutex);
+    m_exact.erase(uri);
+}
+
+void ServletDispatch::delPrefixServlet(const std::string& prefix) {
+    RWMutexType::WriteLock lock(m_mutex);
+    DelRoute(m_prefixes, prefix);
+}
+
+void ServletDispatch::delGlobServlet(const std::string& pattern) {
+    RWMutexType::WriteLock lock(m_mutex);
+    DelRoute(m_globs, pattern);
+}
+
+Servlet::ptr ServletDispatch::getMatchedServlet(const StrRef& path) {
+    // 复用线程里的string做查找的key, 容量够了之后不再分配
+    static thread_local std::string t_key;
+    t_key.assign(path.data, path.size);
+
+    RWMutexType::ReadLock lock(m_mutex);
+    auto it = m_exact.find(t_key);
+    if (it != m_exact.end()) {
+        return it->second;
+    }
+    for (auto& i : m_prefixes) {
+        if (i.first.size() <= path.size && !memcmp(i.first.c_str(), path.data, i.first.size())) {
+            return i.second;
+        }
+    }
+    for (auto& i : m_globs) {
+        if (!fnmatch(i.first.c_str(), path.data, 0)) {
+            return i.second;
+        }
+    }
+    return m_default;
+}
+
+}  // http
+}  // CppServer
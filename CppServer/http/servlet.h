@@ -0,0 +1,91 @@
+#ifndef __CPPSERVER_HTTP_SERVLET_H__
+#define __CPPSERVER_HTTP_SERVLET_H__
+
+#include <memory>
+#include <functional>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "http.h"
+#include "CppServer/thread.h"
+
+namespace CppServer {
+namespace http {
+
+class Servlet {
+public:
+    typedef std::shared_ptr<Servlet> ptr;
+
+    Servlet(const std::string& name) : m_name(name) {}
+    virtual ~Servlet() {}
+    // 返回值目前没有用到, 约定0为成功
+    virtual int32_t handle(HttpRequest& req, HttpResponse& rsp) = 0;
+
+    const std::string& getName() const { return m_name; }
+protected:
+    std::string m_name;
+};
+
+class FunctionServlet : public Servlet {
+public:
+    typedef std::shared_ptr<FunctionServlet> ptr;
+    typedef std::function<int32_t(HttpRequest& req, HttpResponse& rsp)> callback;
+
+    FunctionServlet(callback cb);
+    int32_t handle(HttpRequest& req, HttpResponse& rsp) override;
+private:
+    callback m_cb;
+};
+
+class NotFoundServlet : public Servlet {
+public:
+    typedef std::shared_ptr<NotFoundServlet> ptr;
+
+    NotFoundServlet();
+    int32_t handle(HttpRequest& req, HttpResponse& rsp) override;
+};
+
+// 路由: 先精确匹配, 再最长前缀匹配, 再按添加顺序glob匹配(fnmatch), 都没有用默认的(404)
+// 匹配的是未解码的path, 不含query
+class ServletDispatch : public Servlet {
+public:
+    typedef std::shared_ptr<ServletDispatch> ptr;
+    typedef RWMutex RWMutexType;
+
+    ServletDispatch();
+    int32_t handle(HttpRequest& req, HttpResponse& rsp) override;
+
+    void addServlet(const std::string& uri, Servlet::ptr slt);
+    void addServlet(const std::string& uri, FunctionServlet::callback cb);
+    // prefix一般以'/'结尾, 比如"/static/"
+    void addPrefixServlet(const std::string& prefix, Servlet::ptr slt);
+    void addPrefixServlet(const std::string& prefix, FunctionServlet::callback cb);
+    // fnmatch模式, 比如"/user/*/profile"
+    void addGlobServlet(const std::string& pattern, Servlet::ptr slt);
+    void addGlobServlet(const std::string& pattern, FunctionServlet::callback cb);
+
+    void delServlet(const std::string& uri);
+    void delPrefixServlet(const std::string& prefix);
+    void delGlobServlet(const std::string& pattern);
+
+    Servlet::ptr getDefault() const { return m_default; }
+    void setDefault(Servlet::ptr v) { m_default = v; }
+
+    // path需要以'\0'结尾(请求里的path都是)
+    Servlet::ptr getMatchedServlet(const StrRef& path);
+private:
+    typedef std::vector<std::pair<std::string, Servlet::ptr> > RouteList;
+    static void AddRoute(RouteList& list, const std::string& key, Servlet::ptr slt);
+    static void DelRoute(RouteList& list, const std::string& key);
+private:
+    RWMutexType m_mutex;
+    std::unordered_map<std::string, Servlet::ptr> m_exact;
+    RouteList m_prefixes;   // 按长度从长到短
+    RouteList m_globs;
+    Servlet::ptr m_default;
+};
+
+}  // http
+}  // CppServer
+
+#endif  // __CPPSERVER_HTTP_SERVLET_H__
@@ -1,46 +1,64 @@
 #include "iomanager.h"
+#include "config.h"
 #include "macro.h"
 #include "log.h"
+#include "util.h"
+#include "hook.h"
+#include "offload.h"
 
+#include <algorithm>
 #include <errno.h>
+#include <exception>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPOLL_IOC_TYPE 0x8A
+#define EPIOCSPARAMS _IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
+
 namespace CppServer {
 
 static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
 
-IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event) {
-    switch (event) {
-        case IOManager::READ:
-            return read;
-        case IOManager::WRITE:
-            return write;
-        default:
-            CPPSERVER_ASSERT2(false, "getContext");
+static CppServer::ConfigVar<uint64_t>::ptr g_iomanager_idle_spin =
+    CppServer::Config::Lookup("iomanager.idle.spin_us", (uint64_t) 0, "iomanager idle spin budget before epoll_wait, 0 for no spin");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_iomanager_deadline_sweep =
+    CppServer::Config::Lookup("iomanager.deadline_sweep_interval", (uint64_t) 100, "iomanager io deadline sweep interval(ms), timeouts shorter than it get their own timer");
+
+static uint64_t s_idle_spin_us = 0;
+static uint64_t s_deadline_sweep_interval = 100;
+
+struct _IOManagerIniter {
+    _IOManagerIniter() {
+        s_idle_spin_us = g_iomanager_idle_spin->getValue();
+        g_iomanager_idle_spin->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            CPPSERVER_LOG_INFO(g_logger) << "iomanager idle spin change from "
+                                         << old_value << " to " << new_value;
+            s_idle_spin_us = new_value;
+        });
+        s_deadline_sweep_interval = g_iomanager_deadline_sweep->getValue();
+        g_iomanager_deadline_sweep->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            CPPSERVER_LOG_INFO(g_logger) << "iomanager deadline sweep interval change from "
+                                         << old_value << " to " << new_value;
+            s_deadline_sweep_interval = new_value ? new_value : 1;
+        });
     }
-}
+};
 
-void IOManager::FdContext::resetContext(EventContext& ctx) {
-    ctx.scheduler = nullptr;
-    ctx.fiber.reset();
-    ctx.cb = nullptr;
-}
-// 为什么不重置eventContext? schedule之后cb/fiber不一定运行，所以当然不能重置context
-void IOManager::FdContext::triggerEvent(IOManager::Event event) {
-    CPPSERVER_ASSERT(events & event);  // 事件存在
-    events = (Event) (events & ~event);
-    EventContext& ctx = getContext(event);
-    if (ctx.cb) {
-        ctx.scheduler->schedule(&ctx.cb);
-    } else {
-        ctx.scheduler->schedule(&ctx.fiber);
-    }
-    ctx.scheduler = nullptr;
-    return;
-}
+static _IOManagerIniter s_iomanager_initer;
 
 IOManager::IOManager(size_t threads, bool use_caller, const std::string& name) 
     : Scheduler(threads, use_caller, name) {
@@ -61,8 +79,6 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event); //???
     CPPSERVER_ASSERT(!rt);
 
-    contextResize(64);
-
     start(); // schedule
 }
 
@@ -71,49 +87,36 @@ IOManager::~IOManager() {
     close(m_epfd);
     close(m_tickleFds[0]);
     close(m_tickleFds[1]);
-
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (m_fdContexts[i]) {
-            delete m_fdContexts[i];
-        }
-    }
 }
 
-void IOManager::contextResize(size_t size) {
-    m_fdContexts.resize(size);
-    for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-        if (!m_fdContexts[i]) {
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i;
-        }
+int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+    FdCtx* fd_ctx = FdMgr::GetInstance()->getRecord(fd);
+    if (!fd_ctx) {
+        CPPSERVER_LOG_ERROR(g_logger) << "addEvent invalid fd=" << fd;
+        return -1;
     }
+    return addEvent(fd_ctx, event, cb);
 }
 
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-    FdContext* fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } else {
-        lock.unlock();
-        RWMutexType::WriteLock lock2(m_mutex);
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+int IOManager::addEventNoLock(FdCtx* fd_ctx, Event event, std::function<void()>& cb) {
+    int fd = fd_ctx->m_fd;
+    if (fd_ctx->m_events && fd_ctx->m_iom != this) {
+        // 事件上下文每个fd只有一份, 不能同时挂在两个epoll上
+        CPPSERVER_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " event=" << event
+            << " already registered on iomanager " << fd_ctx->m_iom->getName()
+            << " events=" << fd_ctx->m_events;
+        return -1;
     }
-
-    // 为了安全读写这个fd_ctx, 用fd_ctx内部的锁
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (fd_ctx->events & event) {
+    if (fd_ctx->m_events & event) {
         CPPSERVER_LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
                                       << " event=" << event
-                                      << " fd_ctx.evet" << fd_ctx->events;
-        CPPSERVER_ASSERT(!(fd_ctx->events & event));
+                                      << " fd_ctx.evet" << fd_ctx->m_events;
+        CPPSERVER_ASSERT(!(fd_ctx->m_events & event));
     } 
     // fd_ctx事件非0则为mod，为0则为ADD
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    int op = fd_ctx->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     epoll_event epevent;
-    epevent.events = EPOLLET | fd_ctx->events | event;
+    epevent.events = EPOLLET | fd_ctx->m_events | event;
     epevent.data.ptr = fd_ctx;
 
     int rt = epoll_ctl(m_epfd, op, fd, &epevent);
@@ -126,8 +129,9 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
 
     ++m_pendingEventCount;
     // 设置fd_ctx各项
-    fd_ctx->events = (Event) (fd_ctx->events | event);
-    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    fd_ctx->m_iom = this;
+    fd_ctx->m_events = fd_ctx->m_events | event;
+    FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
     CPPSERVER_ASSERT(!event_ctx.scheduler
                     && !event_ctx.fiber
                     && !event_ctx.cb);
@@ -139,105 +143,305 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         CPPSERVER_ASSERT2(event_ctx.fiber->getState() == Fiber::EXEC
                           , "state=" << event_ctx.fiber->getState());
     }
+    event_ctx.timedout = false;
+    ++event_ctx.wait;
+    return 0;
+}
+
+int IOManager::addEvent(FdCtx* fd_ctx, Event event, std::function<void()> cb,
+                        uint64_t timeout_ms) {
+    bool need_register = false;
+    // 为了安全读写这个fd_ctx, 用fd_ctx内部的锁
+    FdCtx::MutexType::Lock lock2(fd_ctx->m_mutex);
+    if (addEventNoLock(fd_ctx, event, cb)) {
+        return -1;
+    }
+    FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
+    uint32_t wait = event_ctx.wait;
+    bool need_timer = false;
+    if (timeout_ms != ~0ull) {
+        // 用单调时钟, 系统时间被调整不影响超时
+        event_ctx.deadline = CppServer::GetCoarseMS() + timeout_ms;
+        if (timeout_ms < s_deadline_sweep_interval) {
+            // 比扫描间隔还短的超时, 扫描保证不了精度, 单独挂一个定时器
+            need_timer = true;
+        } else if (!fd_ctx->m_deadlineIom) {
+            // 已经在某个IOManager的列表里就由它扫描, 取消事件时会找到事件所在的IOManager
+            fd_ctx->m_deadlineIom = this;
+            need_register = true;
+        }
+    }
+    lock2.unlock();
+    // 每个fd只在进入列表时登记一次, 之后的阻塞IO只改deadline
+    if (need_register) {
+        registerDeadline(fd_ctx);
+    }
+    if (need_timer) {
+        addTimer(timeout_ms, std::bind(&IOManager::onWaitTimeout, this, fd_ctx, event, wait));
+    }
+    return 0;
+}
+
+int IOManager::watchEvent(FdCtx* fd_ctx, Event event, std::function<void()> cb,
+                          const void* key, uint32_t& wait) {
+    FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+    if (fd_ctx->m_events & event) {
+        fd_ctx->getContext(event).watchers.push_back(std::make_pair(key, cb));
+        return 1;
+    }
+    if (addEventNoLock(fd_ctx, event, cb)) {
+        return -1;
+    }
+    wait = fd_ctx->getContext(event).wait;
     return 0;
 }
 
+void IOManager::unwatchEvent(FdCtx* fd_ctx, Event event, const void* key,
+                             bool registered, uint32_t wait) {
+    FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+    FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
+    if (registered) {
+        // 事件已经触发过又被别人注册时不能取消别人的等待
+        if ((fd_ctx->m_events & event) && event_ctx.wait == wait) {
+            cancelEventNoLock(fd_ctx, event);
+        }
+        return;
+    }
+    auto& watchers = event_ctx.watchers;
+    for (auto it = watchers.begin(); it != watchers.end(); ++it) {
+        if (it->first == key) {
+            watchers.erase(it);
+            break;
+        }
+    }
+}
+
 bool IOManager::delEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int)m_fdContexts.size() <= fd) {
+    FdCtx* fd_ctx = FdMgr::GetInstance()->getRecord(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!(fd_ctx->events & event)) {
+    FdCtx::MutexType::Lock lock2(fd_ctx->m_mutex);
+    if (!(fd_ctx->m_events & event)) {
         return false;
     }
 
-    Event new_events = (Event) (fd_ctx->events & ~event);
+    // 事件可能是别的IOManager注册的, 要在它的epoll上删除
+    IOManager* iom = fd_ctx->m_iom;
+    int new_events = fd_ctx->m_events & ~event;
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = EPOLLET | new_events;
     epevent.data.ptr = fd_ctx;
-    int rt  = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt  = epoll_ctl(iom->m_epfd, op, fd, &epevent);
     if (rt) {
-        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd<<", "
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << iom->m_epfd << ", "
             << op << ", " << fd << ", " << epevent.events << "):"
             << rt << "  (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
-    --m_pendingEventCount;
-    fd_ctx->events = new_events;
-    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    --iom->m_pendingEventCount;
+    fd_ctx->m_events = new_events;
+    if (!new_events) {
+        fd_ctx->m_iom = nullptr;
+    }
+    FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
     fd_ctx->resetContext(event_ctx);
     return true;
 }
 
 bool IOManager::cancelEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int) m_fdContexts.size() <= fd) {
+    FdCtx* fd_ctx = FdMgr::GetInstance()->getRecord(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!(fd_ctx->events & event)) {
+    return cancelEvent(fd_ctx, event);
+}
+
+bool IOManager::cancelEvent(FdCtx* fd_ctx, Event event) {
+    FdCtx::MutexType::Lock lock2(fd_ctx->m_mutex);
+    return cancelEventNoLock(fd_ctx, event);
+}
+
+bool IOManager::cancelEventNoLock(FdCtx* fd_ctx, Event event) {
+    int fd = fd_ctx->m_fd;
+    if (!(fd_ctx->m_events & event)) {
         return false;
     }
 
-    Event new_events = (Event) (fd_ctx->events & ~event);
+    // 事件可能是别的IOManager注册的, 要在它的epoll上删除
+    IOManager* iom = fd_ctx->m_iom;
+    int new_events = fd_ctx->m_events & ~event;
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = EPOLLET | new_events;
     epevent.data.ptr = fd_ctx;
-    int rt  = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt  = epoll_ctl(iom->m_epfd, op, fd, &epevent);
     if (rt) {
-        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd<<", "
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << iom->m_epfd << ", "
             << op << ", " << fd << ", " << epevent.events << "):"
             << rt << "  (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
     fd_ctx->triggerEvent(event);
-    --m_pendingEventCount;
+    --iom->m_pendingEventCount;
     return true;
 }
 
+// 短超时的定时器到期, 等待还没结束就取消事件并标记超时
+void IOManager::onWaitTimeout(FdCtx* fd_ctx, Event event, uint32_t wait) {
+    FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+    FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
+    // 事件已经触发/取消, 或者已经是下一次等待
+    if (!(fd_ctx->m_events & event) || event_ctx.wait != wait) {
+        return;
+    }
+    event_ctx.timedout = true;
+    if (!cancelEventNoLock(fd_ctx, event)) {
+        event_ctx.timedout = false;
+    }
+}
+
+void IOManager::registerDeadline(FdCtx* fd_ctx) {
+    Mutex::Lock lock(m_deadlineMutex);
+    fd_ctx->m_deadlineIndex = m_deadlineFds.size();
+    m_deadlineFds.push_back(fd_ctx);
+    if (!m_sweepTimer) {
+        m_sweepTimer = addTimer(s_deadline_sweep_interval,
+                std::bind(&IOManager::sweepDeadlines, this), true);
+    }
+}
+
+// 取消超过deadline的事件并唤醒等待的协程, 没有待超时事件的fd移出列表
+void IOManager::sweepDeadlines() {
+    std::vector<FdCtx*> fds;
+    {
+        Mutex::Lock lock(m_deadlineMutex);
+        fds = m_deadlineFds;
+    }
+    uint64_t now_ms = CppServer::GetCoarseMS();
+    std::vector<FdCtx*> idle_fds;
+    for (auto& fd_ctx : fds) {
+        FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+        if (fd_ctx->m_deadlineIom != this) {
+            continue;
+        }
+        bool pending = false;
+        static const Event s_events[] = {READ, WRITE, ERROR};
+        for (auto& event : s_events) {
+            if (!(fd_ctx->m_events & event)) {
+                continue;
+            }
+            FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
+            if (!event_ctx.deadline) {
+                continue;
+            }
+            if (event_ctx.deadline > now_ms) {
+                pending = true;
+                continue;
+            }
+            // 规定时间内未完成任务
+            event_ctx.timedout = true;
+            if (!cancelEventNoLock(fd_ctx, event)) {
+                event_ctx.timedout = false;
+            }
+        }
+        if (!pending) {
+            idle_fds.push_back(fd_ctx);
+        }
+    }
+
+    Mutex::Lock lock(m_deadlineMutex);
+    for (auto& fd_ctx : idle_fds) {
+        // 持有列表锁时再确认一次, 期间新设置了deadline的fd留在列表里
+        FdCtx::MutexType::Lock lock2(fd_ctx->m_mutex);
+        if (fd_ctx->m_deadlineIom != this || fd_ctx->hasDeadline()) {
+            continue;
+        }
+        fd_ctx->m_deadlineIom = nullptr;
+        // 和末尾交换后删除, O(1)
+        size_t idx = fd_ctx->m_deadlineIndex;
+        CPPSERVER_ASSERT(idx < m_deadlineFds.size() && m_deadlineFds[idx] == fd_ctx);
+        FdCtx* last = m_deadlineFds.back();
+        m_deadlineFds[idx] = last;
+        last->m_deadlineIndex = idx;
+        m_deadlineFds.pop_back();
+    }
+    if (m_deadlineFds.empty() && m_sweepTimer) {
+        m_sweepTimer->cancel();
+        m_sweepTimer.reset();
+    }
+}
+
 bool IOManager::cancelAll(int fd) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if ((int) m_fdContexts.size() <= fd) {
+    FdCtx* fd_ctx = FdMgr::GetInstance()->getRecord(fd, false);
+    if (!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if (!fd_ctx->events) {
+    return cancelAll(fd_ctx);
+}
+
+bool IOManager::cancelAll(FdCtx* fd_ctx) {
+    int fd = fd_ctx->m_fd;
+    FdCtx::MutexType::Lock lock2(fd_ctx->m_mutex);
+    if (!fd_ctx->m_events) {
         return false;
     }
 
+    IOManager* iom = fd_ctx->m_iom;
     int op = EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = 0;
     epevent.data.ptr = fd_ctx;
 
-    int rt  = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt  = epoll_ctl(iom->m_epfd, op, fd, &epevent);
     if (rt) {
-        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd<<", "
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl(" << iom->m_epfd << ", "
             << op << ", " << fd << ", " << epevent.events << "):"
             << rt << "  (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
 
-    if (fd_ctx->events & READ) {
+    if (fd_ctx->m_events & READ) {
         fd_ctx->triggerEvent(READ);
-        --m_pendingEventCount;
+        --iom->m_pendingEventCount;
     }
-    if (fd_ctx->events & WRITE) {
+    if (fd_ctx->m_events & WRITE) {
         fd_ctx->triggerEvent(WRITE);
-        --m_pendingEventCount;
+        --iom->m_pendingEventCount;
 
     }
+    if (fd_ctx->m_events & ERROR) {
+        fd_ctx->triggerEvent(ERROR);
+        --iom->m_pendingEventCount;
+    }
+
+    CPPSERVER_ASSERT(fd_ctx->m_events == 0);
+    return true;
+}
 
-    CPPSERVER_ASSERT(fd_ctx->events == 0);
+bool IOManager::setBusyPoll(uint32_t us, uint32_t budget, bool prefer) {
+    if (budget > MAX_BUSY_POLL_BUDGET) {
+        CPPSERVER_LOG_WARN(g_logger) << "busy poll budget " << budget
+            << " clamped to " << MAX_BUSY_POLL_BUDGET;
+        budget = MAX_BUSY_POLL_BUDGET;
+    }
+    if (us == 0) {
+        prefer = false;
+        budget = 0;
+    }
+    epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = us;
+    params.busy_poll_budget = budget;
+    params.prefer_busy_poll = prefer ? 1 : 0;
+    int rt = ioctl(m_epfd, EPIOCSPARAMS, &params);
+    if (rt) {
+        CPPSERVER_LOG_WARN(g_logger) << "ioctl(" << m_epfd << ", EPIOCSPARAMS, "
+            << us << ", " << budget << ", " << prefer << "):" << rt
+            << " (" << errno << ") (" << strerror(errno) << ")";
+        return false;
+    }
     return true;
 }
 
@@ -247,17 +451,89 @@ IOManager* IOManager::GetThis() {
 
 void IOManager::tickle() {
     // 有闲置的线程才有发消息的必要
-    if (hasIdleThreads()) {
+    if (!hasIdleThreads()) {
+        return;
+    }
+    // 自旋中的线程自己会看到新任务, 不用写管道
+    // 但stop时要叫醒所有线程, 陷在epoll_wait里的线程看不到自旋线程看到的东西
+    if (m_spinningThreadCount > 0 && !m_stopping) {
         return;
     }
     int rt = write(m_tickleFds[1], "T", 1);
     CPPSERVER_ASSERT(rt == 1);
 }
 
+// 管道在所有线程共享的epoll里, 谁收到不一定; 指派给某个线程的任务写它自己的eventfd
+void IOManager::wakeThread(int thread) {
+    MutexType::Lock lock(m_wakeMutex);
+    auto it = m_wakeFds.find(thread);
+    if (it != m_wakeFds.end()) {
+        eventfd_write(it->second.eventFd, 1);
+    }
+}
+
+bool IOManager::openWakeFds(int thread, WakeFds& wake) {
+    wake.epfd = epoll_create1(EPOLL_CLOEXEC);
+    // eventfd被hook了, 这里不需要FdCtx
+    wake.eventFd = eventfd_f(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake.epfd < 0 || wake.eventFd < 0) {
+        CPPSERVER_LOG_ERROR(g_logger) << "open wakeup fds failed epfd=" << wake.epfd
+            << " eventfd=" << wake.eventFd << " (" << errno << ") (" << strerror(errno) << ")";
+        closeWakeFds(thread, wake);
+        return false;
+    }
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = m_epfd;
+    int rt = epoll_ctl(wake.epfd, EPOLL_CTL_ADD, m_epfd, &event);
+    event.data.fd = wake.eventFd;
+    rt = rt ? rt : epoll_ctl(wake.epfd, EPOLL_CTL_ADD, wake.eventFd, &event);
+    if (rt) {
+        CPPSERVER_LOG_ERROR(g_logger) << "epoll_ctl wakeup fds failed (" << errno
+            << ") (" << strerror(errno) << ")";
+        closeWakeFds(thread, wake);
+        return false;
+    }
+    MutexType::Lock lock(m_wakeMutex);
+    m_wakeFds[thread] = wake;
+    return true;
+}
+
+void IOManager::closeWakeFds(int thread, WakeFds& wake) {
+    {
+        MutexType::Lock lock(m_wakeMutex);
+        m_wakeFds.erase(thread);
+    }
+    if (wake.epfd >= 0) {
+        close(wake.epfd);
+    }
+    if (wake.eventFd >= 0) {
+        close(wake.eventFd);
+    }
+    wake.epfd = wake.eventFd = -1;
+}
+
+int IOManager::wakeableWait(const WakeFds& wake, epoll_event* events, int max_events, int timeout) {
+    epoll_event ready[2];
+    int n = epoll_wait_f(wake.epfd, ready, 2, timeout);
+    int rt = 0;
+    for (int i = 0; i < n; ++i) {
+        if (ready[i].data.fd == wake.eventFd) {
+            eventfd_t dummy;
+            eventfd_read(wake.eventFd, &dummy);
+        } else {
+            rt = epoll_wait_f(m_epfd, events, max_events, 0);
+        }
+    }
+    return rt;
+}
+
 bool IOManager::stopping(uint64_t& timeout) {
     timeout = getNextTimer();
     return timeout == ~0ull  // 一定要有这个条件，因为schduler调用stopping会调用到iomanager::stopping, 导致定时器事件存在但是scheduler跳出循环了
         && m_pendingEventCount == 0
+        && m_pendingOffloadCount == 0
         && Scheduler::stopping();
 }
 
@@ -266,6 +542,64 @@ bool IOManager::stopping() {
     return stopping(timeout);
 }
 
+void IOManager::offload(std::function<void()> cb) {
+    if (Scheduler::GetThis() != this || !is_hook_enable()) {
+        cb();
+        return;
+    }
+    Fiber::ptr fiber = Fiber::GetThis();
+    std::exception_ptr except;
+    ++m_pendingOffloadCount;
+    // cb和except都在挂起协程的栈上, 协程被重新调度前一直有效
+    OffloadMgr::GetInstance()->submit([this, fiber, &cb, &except]() {
+        try {
+            cb();
+        } catch (...) {
+            except = std::current_exception();
+        }
+        schedule(fiber);
+        --m_pendingOffloadCount;
+    });
+    Fiber::YieldToHold();
+    if (except) {
+        std::rethrow_exception(except);
+    }
+}
+
+uint64_t IOManager::getIdleSpin() const {
+    return m_idleSpinUs < 0 ? s_idle_spin_us : m_idleSpinUs;
+}
+
+// 返回值>0为就绪事件数, 0为等到了新任务, -1为自旋超时需要陷入epoll_wait
+int IOManager::spinWait(epoll_event* events, int max_events, uint64_t us) {
+    ++m_spinningThreadCount;
+    uint64_t deadline = CppServer::GetCurrentUS() + us;
+    int rt = -1;
+    do {
+        int n = epoll_wait_f(m_epfd, events, max_events, 0);
+        if (n > 0) {
+            rt = n;
+            break;
+        }
+        if (hasPendingTasks()) {
+            rt = 0;
+            break;
+        }
+        CPPSERVER_CPU_RELAX();
+    } while (CppServer::GetCurrentUS() < deadline);
+    --m_spinningThreadCount;
+    // 自旋期间tickle被跳过, 退出自旋后要再看一次任务队列
+    if (rt < 0 && hasPendingTasks()) {
+        rt = 0;
+    }
+    if (rt < 0) {
+        ++m_spinMisses;
+    } else {
+        ++m_spinHits;
+    }
+    return rt;
+}
+
 void IOManager::idle() {
     CPPSERVER_LOG_DEBUG(g_logger) << "idle";
     const uint64_t MAX_EVENTS = 256;
@@ -273,6 +607,11 @@ void IOManager::idle() {
     std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr){
         delete[] ptr;
     });
+    ThreadCtx* ctx = GetThreadCtx();
+    CPPSERVER_ASSERT(ctx);
+    WakeFds wake;
+    bool wake_ok = openWakeFds(ctx->id, wake);
+    CPPSERVER_ASSERT(wake_ok);
     while (true) {
         uint64_t next_timeout = 0;
         if (stopping(next_timeout)) {
@@ -280,8 +619,21 @@ void IOManager::idle() {
                                          << " idle stopping exit";
             break;
         }
-        int rt = 0;
-        do {
+        if (retiring()) {
+            CPPSERVER_LOG_INFO(g_logger) << "name=" << getName()
+                                         << " idle retiring exit";
+            break;
+        }
+        int rt = -1;
+        uint64_t spin_us = getIdleSpin();
+        if (spin_us && next_timeout) {
+            // 不要自旋过了下一个定时器
+            if (next_timeout != ~0ull && next_timeout * 1000 < spin_us) {
+                spin_us = next_timeout * 1000;
+            }
+            rt = spinWait(events, MAX_EVENTS, spin_us);
+        }
+        if (rt < 0) {
             static const int MAX_TIMEOUT  = 5000; // 5s
             if (next_timeout != ~0ull) {  // 有定时器的超时存在, 注意有符号的情况下，~0ull是负数
                 next_timeout = (int) next_timeout > MAX_TIMEOUT
@@ -290,13 +642,16 @@ void IOManager::idle() {
             } else {
                 next_timeout = MAX_TIMEOUT;
             }
-            rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int) next_timeout);
-
-            if (rt < 0 && errno == EINTR) {
+            // 先置位再看一次任务, 和tickleThread里先入队再看sleeping配对, 不会漏掉唤醒
+            ctx->sleeping = true;
+            if (hasPendingTasks()) {
+                rt = 0;
             } else {
-                break;
+                rt = wakeableWait(wake, events, MAX_EVENTS, (int) next_timeout);
             }
-        } while (true);
+            ctx->sleeping = false;
+            // rt为0: 被wakeThread唤醒或超时, 回到run看一次任务队列
+        }
 
         std::vector<std::function<void()>> cbs;
         listExpiredCb(cbs);
@@ -313,11 +668,25 @@ void IOManager::idle() {
                 while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0);
                 continue;
             }
-            FdContext* fd_ctx = (FdContext*) event.data.ptr;
-            FdContext::MutexType::Lock lock(fd_ctx->mutex);
-            // EPOLLHUP代表socket一端关闭，拔网线
-            if (event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events; //??? 这行是在？
+            FdCtx* fd_ctx = (FdCtx*) event.data.ptr;
+            FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+            // 取出事件之前fd已经从本epoll删除, 又注册到了别的IOManager
+            if (fd_ctx->m_iom != this) {
+                continue;
+            }
+            // EPOLLHUP代表socket一端关闭，拔网线, 读写等待者都要醒来看结果
+            if (event.events & EPOLLHUP) {
+                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->m_events;
+            }
+            // EPOLLERR也可能只是错误队列有消息(比如MSG_ZEROCOPY的完成通知), 那只和ERROR等待者有关
+            // SO_ERROR非0才是socket出错, 读出来会清掉, 存到fd_ctx里交给醒来的读写等待者
+            if ((event.events & EPOLLERR) && (fd_ctx->m_events & (READ | WRITE))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt_f(fd_ctx->m_fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err) {
+                    fd_ctx->m_sockError = err;
+                    event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->m_events;
+                }
             }
             int real_events = NONE;
             if (event.events & EPOLLIN) {
@@ -326,20 +695,24 @@ void IOManager::idle() {
             if (event.events & EPOLLOUT) {
                 real_events |= WRITE;
             }
+            // EPOLLERR不用注册也总会报告
+            if ((event.events & EPOLLERR) && (fd_ctx->m_events & ERROR)) {
+                real_events |= ERROR;
+            }
 
             // 发生的事件并未注册
-            if ((fd_ctx->events & real_events) == NONE) {
+            if ((fd_ctx->m_events & real_events) == NONE) {
                 continue;
             }
             // 剩余的事件 = 注册事件 - 发生事件
-            int left_events = (fd_ctx->events & ~real_events);
+            int left_events = (fd_ctx->m_events & ~real_events);
             int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
             event.events = EPOLLET | left_events;
 
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->m_fd, &event);
             if (rt2) {
                 CPPSERVER_LOG_ERROR(g_logger) <<  "epoll_ctl(" << m_epfd << ", "
-                    << op << "," << fd_ctx->fd << "," << event.events << "):"
+                    << op << "," << fd_ctx->m_fd << "," << event.events << "):"
                     << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
                 continue;
             }
@@ -352,6 +725,10 @@ void IOManager::idle() {
                 fd_ctx->triggerEvent(WRITE);
                 --m_pendingEventCount;
             }
+            if (real_events & ERROR) {
+                fd_ctx->triggerEvent(ERROR);
+                --m_pendingEventCount;
+            }
         }
         // 当scheduler/iomanager未调用stop()的时候,idle还未执行完，只是需要让出cpu，直接返回会被设置成TERM状态而可能导致scheduler::run协程终止（无其他任务的情况下)，所以要自己swapOut, 等到时候再swap回来继续循环
         // 因为是是直接的栈切换，RTTI无效，需要手动reset智能指针
@@ -361,6 +738,7 @@ void IOManager::idle() {
 
         raw_ptr->swapOut();
     }
+    closeWakeFds(ctx->id, wake);
 }
 
 
@@ -3,6 +3,9 @@
 
 #include  "scheduler.h"
 #include "timer.h"
+#include "fd_manager.h"
+
+struct epoll_event;
 
 namespace CppServer {
 
@@ -12,28 +15,10 @@ class IOManager : public Scheduler, public TimerManager {
     typedef RWMutex RWMutexType;
 
     enum Event {
-        NONE    = 0x0,
-        READ    = 0x1,
-        WRITE   = 0x4
-    };
- private:
-    struct FdContext {
-        typedef Mutex MutexType;
-        struct EventContext {
-            Scheduler* scheduler = nullptr;       //事件待执行的scheduler
-            Fiber::ptr fiber;           //事件协程
-            std::function<void()> cb;   //事件回调
-        };
-
-        EventContext& getContext(Event event);
-        void resetContext(EventContext& ctx);
-        void triggerEvent(IOManager::Event event);
-
-        EventContext read;       // 读事件
-        EventContext write;      // 写事件
-        int fd = 0;              // 事件关联的描述符
-        Event events = NONE;   // 已经注册的事件
-        MutexType mutex;
+        NONE    = FdCtx::NONE,
+        READ    = FdCtx::READ,
+        WRITE   = FdCtx::WRITE,
+        ERROR   = FdCtx::ERROR  // EPOLLERR: socket出错或错误队列有消息(比如MSG_ZEROCOPY的完成通知)
     };
  public:
     IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
@@ -44,23 +29,82 @@ class IOManager : public Scheduler, public TimerManager {
     bool cancelEvent(int fd, Event event);  // 取消事件: 删除事件并强制触发事件  ????
     bool cancelAll(int fd);            // 取消一个描述符下的所有事件
 
+    // 已经拿到FdCtx的调用方(hook)直接用, 省一次查找
+    // timeout_ms: 等待超过该时间由deadline扫描取消事件并唤醒, 用FdCtx::takeTimedOut判断
+    // 扫描间隔(iomanager.deadline_sweep_interval)以上的超时精度为一个间隔, 更短的单独用定时器
+    int addEvent(FdCtx* fd_ctx, Event event, std::function<void()> cb = nullptr,
+                 uint64_t timeout_ms = ~0ull);
+    bool cancelEvent(FdCtx* fd_ctx, Event event);
+    bool cancelAll(FdCtx* fd_ctx);
+
+    // poll类调用用: 事件空闲时注册事件, 已经有等待者时不抢占, 把cb挂到它后面, 事件触发或删除时一起调用
+    // 返回0为注册了事件(wait为这次等待的编号), 1为挂在已有的等待者后面, -1为fd不能交给本epoll
+    // key用来在unwatchEvent时找到自己挂的cb
+    int watchEvent(FdCtx* fd_ctx, Event event, std::function<void()> cb,
+                   const void* key, uint32_t& wait);
+    // 撤销watchEvent: 注册的事件仍是同一次等待时取消, 挂上去的cb还在时摘掉
+    void unwatchEvent(FdCtx* fd_ctx, Event event, const void* key, bool registered, uint32_t wait);
+
     static IOManager* GetThis();
 
+    // idle时先自旋(轮询任务队列和epoll_wait(0))最多us微秒再陷入epoll_wait, -1表示跟随配置
+    void setIdleSpin(int64_t us) { m_idleSpinUs = us; }
+    uint64_t getIdleSpin() const;
+    uint64_t getSpinHits() const { return m_spinHits; }     // 自旋期间等到了任务或事件
+    uint64_t getSpinMisses() const { return m_spinMisses; } // 自旋超时后陷入epoll_wait
+
+    // 把阻塞的cb交给offload线程池执行, 当前协程挂起, cb完成后回到本调度器继续
+    // cb抛出的异常在协程里重新抛出; 不在本调度器的协程里调用时直接执行cb
+    void offload(std::function<void()> cb);
+
+    // epoll的内核busy poll参数(EPIOCSPARAMS, linux 6.9+), us=0关闭
+    // budget超过内核上限MAX_BUSY_POLL_BUDGET时截断
+    static const uint32_t MAX_BUSY_POLL_BUDGET = 0xFFFF;
+    bool setBusyPoll(uint32_t us, uint32_t budget = 0, bool prefer = true);
+
  protected:
     void tickle() override;   // 有协程需要执行的时候触发
+    void wakeThread(int thread) override; // 写线程自己的eventfd, 打断它的epoll_wait
     bool stopping() override; // 协程调度模块是否应该终止
     void idle() override;     // 陷入epoll_wait
     void onTimerInsertedAtFront() override;
 
-    void contextResize(size_t size);
     bool stopping(uint64_t& timeout);
+    int spinWait(epoll_event* events, int max_events, uint64_t us);
  private:
-    int m_epfd = 0;
+    // 每个线程idle时等在自己的epoll上, 里面套着共享的m_epfd和本线程的eventfd
+    // 代价是m_epfd就绪时所有睡着的线程都会醒, 只有一个能取到事件
+    struct WakeFds {
+        int epfd = -1;
+        int eventFd = -1;
+    };
+    bool openWakeFds(int thread, WakeFds& wake);
+    void closeWakeFds(int thread, WakeFds& wake);
+    // 返回m_epfd上取到的事件数, 0为被唤醒或超时
+    int wakeableWait(const WakeFds& wake, epoll_event* events, int max_events, int timeout);
+    // 需持有fd_ctx->m_mutex, 成功返回0
+    int addEventNoLock(FdCtx* fd_ctx, Event event, std::function<void()>& cb);
+    bool cancelEventNoLock(FdCtx* fd_ctx, Event event);
+    void onWaitTimeout(FdCtx* fd_ctx, Event event, uint32_t wait);
+    void registerDeadline(FdCtx* fd_ctx);
+    void sweepDeadlines();
+ private:
+    int m_epfd = 0;     // fd只会注册在FdCtx::m_iom的m_epfd上
     int m_tickleFds[2];  // 用来tickle的管道fd
+    Mutex m_wakeMutex;
+    std::unordered_map<int, WakeFds> m_wakeFds; // 正在idle的线程的唤醒fd, 由m_wakeMutex保护
 
     std::atomic<size_t> m_pendingEventCount = {0}; // 现在要等待执行的事件数量
-    RWMutexType m_mutex;
-    std::vector<FdContext*> m_fdContexts;
+    std::atomic<size_t> m_pendingOffloadCount = {0}; // 挂起等待offload任务的协程数
+    std::atomic<size_t> m_spinningThreadCount = {0}; // 正在idle自旋的线程数
+    std::atomic<uint64_t> m_spinHits = {0};
+    std::atomic<uint64_t> m_spinMisses = {0};
+    int64_t m_idleSpinUs = -1;
+
+    // 设置了deadline的fd, 由一个周期定时器统一扫描, 代替每次阻塞IO一个定时器
+    Mutex m_deadlineMutex;
+    std::vector<FdCtx*> m_deadlineFds;
+    Timer::ptr m_sweepTimer;
 };
 
 };
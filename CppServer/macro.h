@@ -13,6 +13,15 @@
 #define CPPSERVER_UNLIKELY(x)   (x)
 #endif
 
+// 忙等循环里的CPU提示, 减少流水线和超线程上的空转开销
+#if defined(__x86_64__) || defined(__i386__)
+#define CPPSERVER_CPU_RELAX()   __asm__ __volatile__("pause")
+#elif defined(__aarch64__)
+#define CPPSERVER_CPU_RELAX()   __asm__ __volatile__("yield")
+#else
+#define CPPSERVER_CPU_RELAX()
+#endif
+
 #define CPPSERVER_ASSERT(x) \
     if (CPPSERVER_UNLIKELY(!(x))) { \
         CPPSERVER_LOG_ERROR(CPPSERVER_LOG_ROOT()) << "ASSERTION: " #x \
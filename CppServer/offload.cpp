@@ -0,0 +1,96 @@
+#include "offload.h"
+#include "config.h"
+#include "log.h"
+
+#include <algorithm>
+
+namespace CppServer {
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_offload_threads =
+    CppServer::Config::Lookup("offload.threads", (uint32_t) 4, "offload thread pool size");
+
+OffloadPool::OffloadPool()
+    : m_stopping(false) {
+}
+
+OffloadPool::~OffloadPool() {
+    stop();
+}
+
+void OffloadPool::submit(std::function<void()> cb) {
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_stopping) {
+            lock.unlock();
+            cb();
+            return;
+        }
+        if (m_threads.empty()) {
+            size_t count = std::max(g_offload_threads->getValue(), (uint32_t) 1);
+            for (size_t i = 0; i < count; ++i) {
+                m_threads.push_back(Thread::ptr(new Thread(
+                    std::bind(&OffloadPool::run, this), "offload_" + std::to_string(i))));
+            }
+        }
+        m_tasks.push_back(cb);
+    }
+    m_semaphore.notify();
+}
+
+void OffloadPool::stop() {
+    std::vector<Thread::ptr> thrs;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_stopping) {
+            return;
+        }
+        m_stopping = true;
+        thrs = m_threads;
+    }
+    // 每个线程一个信号, 队列空了就退出
+    for (size_t i = 0; i < thrs.size(); ++i) {
+        m_semaphore.notify();
+    }
+    for (auto& i : thrs) {
+        i->join();
+    }
+}
+
+size_t OffloadPool::getThreadCount() {
+    MutexType::Lock lock(m_mutex);
+    return m_threads.size();
+}
+
+size_t OffloadPool::getPendingCount() {
+    MutexType::Lock lock(m_mutex);
+    return m_tasks.size();
+}
+
+void OffloadPool::run() {
+    while (true) {
+        m_semaphore.wait();
+        std::function<void()> cb;
+        {
+            MutexType::Lock lock(m_mutex);
+            if (m_tasks.empty()) {
+                if (m_stopping) {
+                    break;
+                }
+                continue;
+            }
+            cb.swap(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        try {
+            cb();
+        } catch (std::exception& ex) {
+            CPPSERVER_LOG_ERROR(g_logger) << "offload task except: " << ex.what();
+        } catch (...) {
+            CPPSERVER_LOG_ERROR(g_logger) << "offload task except";
+        }
+    }
+}
+
+}  // CppServer
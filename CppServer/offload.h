@@ -0,0 +1,41 @@
+#ifndef __CPPSERVER_OFFLOAD_H__
+#define __CPPSERVER_OFFLOAD_H__
+
+#include <list>
+#include <vector>
+#include <functional>
+#include "thread.h"
+#include "singleton.h"
+#include "noncopyable.h"
+
+namespace CppServer {
+
+// 执行阻塞任务(磁盘IO, 大量计算)的线程池, 线程不开hook, 第一次提交任务时才创建
+// 协程一般不直接用, 通过IOManager::offload挂起自己等任务完成
+class OffloadPool : Noncopyable {
+public:
+    typedef Mutex MutexType;
+
+    OffloadPool();
+    ~OffloadPool();
+
+    void submit(std::function<void()> cb);
+    void stop();
+
+    size_t getThreadCount();
+    size_t getPendingCount();
+private:
+    void run();
+private:
+    MutexType m_mutex;
+    Semaphore m_semaphore;
+    std::list<std::function<void()> > m_tasks;
+    std::vector<Thread::ptr> m_threads;
+    bool m_stopping;
+};
+
+typedef Singleton<OffloadPool> OffloadMgr;
+
+}  // CppServer
+
+#endif  // __CPPSERVER_OFFLOAD_H__
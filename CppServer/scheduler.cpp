@@ -9,6 +9,32 @@ static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
 
 static thread_local Scheduler* t_scheduler = nullptr;    // 当前线程对应的调度器
 static thread_local Fiber* t_scheduler_fiber = nullptr;  // 线程中执行run的的协程
+static thread_local bool t_retiring = false;             // 当前线程已认领退役, 空闲后退出run
+static thread_local Scheduler::ThreadCtx* t_thread_ctx = nullptr;
+
+static CppServer::ConfigVar<uint64_t>::ptr g_scheduler_overload_target =
+    CppServer::Config::Lookup("scheduler.overload_target", (uint64_t) 5000, "scheduler overload queueing delay target(us)");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_scheduler_overload_interval =
+    CppServer::Config::Lookup("scheduler.overload_interval", (uint64_t) 100, "scheduler overload detection interval(ms)");
+
+static uint64_t s_overload_target = 0;
+static uint64_t s_overload_interval = 0;
+
+struct _SchedulerIniter {
+    _SchedulerIniter() {
+        s_overload_target = g_scheduler_overload_target->getValue();
+        g_scheduler_overload_target->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            s_overload_target = new_value;
+        });
+        s_overload_interval = g_scheduler_overload_interval->getValue() * 1000;
+        g_scheduler_overload_interval->addListener([](const uint64_t& old_value, const uint64_t& new_value) {
+            s_overload_interval = new_value * 1000;
+        });
+    }
+};
+
+static _SchedulerIniter s_scheduler_initer;
 // 其它线程的run协程就是主协程，schedule本身的线程的run协程不是主协程
 
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name) 
@@ -28,6 +54,7 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
         t_scheduler_fiber = m_rootFiber.get(); //因为主线程要作为线程池的一员，需要跑run方法，但是作为主线程没法跑run方法，所以另开一个协程跑run方法
         m_rootThread = CppServer::GetThreadId();
         m_threadIds.push_back(m_rootThread);
+        m_threadCtxs[m_rootThread].reset(new ThreadCtx(m_rootThread));
     } else {
         m_rootThread = -1;
     }
@@ -36,6 +63,9 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
 
 Scheduler::~Scheduler() {
     CPPSERVER_ASSERT(m_stopping);
+    if (m_threadCountVar) {
+        m_threadCountVar->delListener(m_threadCountListener);
+    }
     if (GetThis() == this) {
         t_scheduler = nullptr;
     }
@@ -57,11 +87,8 @@ void Scheduler::start() {
     m_stopping = false;
     CPPSERVER_ASSERT(m_threads.empty());
 
-    m_threads.resize(m_threadCount);
     for (size_t i = 0; i < m_threadCount; ++i) {
-        m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this), 
-                                      m_name + "_" + std::to_string(i)));
-        m_threadIds.push_back(m_threads[i]->getId());
+        addThread();
     }
     lock.unlock();
     // 下面rootFiber还是要跑run，还要再锁一次
@@ -96,14 +123,8 @@ void Scheduler::stop() {
     }
 
     m_stopping = true;
-    for (size_t i = 0; i < m_threadCount; ++i) {
-        // 唤醒线程，让他们自己结束
-        tickle(); // wake up
-    }
-
-    if (m_rootFiber) {
-        tickle();
-    }
+    // 唤醒线程，让他们自己结束
+    tickleAll();
 
     if (m_rootFiber) {
         // while (!stopping()) {  //等待其它线程完成
@@ -120,15 +141,13 @@ void Scheduler::stop() {
         }
     }
 
-    if (stopping()) { //?
-        return;
-    }
-
-
+    // 不能在这里提前返回: 根协程退出时其它线程(包括退役中的)可能还在idle里访问本对象, 必须join
     std::vector<Thread::ptr> thrs;
     {
         MutexType::Lock lock(m_mutex);
         thrs.swap(m_threads);
+        thrs.insert(thrs.end(), m_retiredThreads.begin(), m_retiredThreads.end());
+        m_retiredThreads.clear();
     }
 
     for (auto&& i : thrs) {
@@ -146,13 +165,18 @@ void Scheduler::run() {
     if (CppServer::GetThreadId() != m_rootThread) { // rootThread在use_caller的情况下已经在构造函数里创建主协程了
         t_scheduler_fiber = Fiber::GetThis().get();    
     }
+    {
+        MutexType::Lock lock(m_mutex);
+        auto it = m_threadCtxs.find(CppServer::GetThreadId());
+        CPPSERVER_ASSERT(it != m_threadCtxs.end());
+        t_thread_ctx = it->second.get();
+    }
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
     Fiber::ptr cb_fiber; // callback
 
     FiberAndThread ft;
     while (true) {
         ft.reset();
-        bool tickle_me = false;
         bool is_active = false;
         {
             // 从任务队列中找到任务
@@ -160,8 +184,7 @@ void Scheduler::run() {
             auto it = m_fibers.begin();
             while (it != m_fibers.end()) {
                 if (it->thread != -1 && it->thread != CppServer::GetThreadId()) {
-                    ++it;
-                    tickle_me = true; //该线程不能处理下一个协程，tickle_me让信号量驱使下一个新的线程来找任务
+                    ++it; // 入队时已经单独唤醒了被指派的线程
                     continue;
                 }
                 CPPSERVER_ASSERT(it->fiber || it->cb);
@@ -171,18 +194,20 @@ void Scheduler::run() {
                 }
 
                 ft = *it;
+                updateQueueDelay(ft.enqueueUs, GetMonotonicUS());
                 m_fibers.erase(it++);
+                --m_taskCount;
+                if (ft.thread != -1) {
+                    --t_thread_ctx->pinnedTasks;
+                } else {
+                    --m_sharedTaskCount;
+                }
                 ++m_activeThreadCount;
                 is_active = true;
                 break;
             }
         }
 
-
-        if (tickle_me) {
-            tickle();
-        }
-
         if (ft.fiber && ft.fiber->getState() != Fiber::TERM
                      && ft.fiber->getState() != Fiber::EXCEPT) {
             ft.fiber->swapIn();
@@ -227,6 +252,10 @@ void Scheduler::run() {
                 CPPSERVER_LOG_INFO(g_logger) << "idle fiber term";
                 break;
             }
+            // 没有任务(包括指派给本线程的任务)时才认领退役, 让idle协程退出
+            if (!t_retiring && tryRetire()) {
+                t_retiring = true;
+            }
 
             ++m_idleThreadCount;
             idle_fiber->swapIn();
@@ -238,12 +267,52 @@ void Scheduler::run() {
         }
 
     }
+
+    if (t_retiring) {
+        retire();
+    } else {
+        MutexType::Lock lock(m_mutex);
+        m_threadCtxs.erase(CppServer::GetThreadId());
+    }
+    t_thread_ctx = nullptr;
 }
 
 void Scheduler::tickle() {
     CPPSERVER_LOG_INFO(g_logger) << "tickle";
 }
 
+void Scheduler::tickleThread(const ThreadCtx::ptr& ctx, bool force) {
+    if (!force && !ctx->sleeping) {
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    auto it = m_threadCtxs.find(ctx->id);
+    if (it != m_threadCtxs.end() && it->second == ctx) {
+        wakeThread(ctx->id);
+    }
+}
+
+void Scheduler::tickleAll() {
+    MutexType::Lock lock(m_mutex);
+    for (auto& i : m_threadCtxs) {
+        if (i.first != CppServer::GetThreadId()) {
+            wakeThread(i.first);
+        }
+    }
+}
+
+void Scheduler::wakeThread(int thread) {
+    tickle();
+}
+
+Scheduler::ThreadCtx* Scheduler::GetThreadCtx() {
+    return t_thread_ctx;
+}
+
+bool Scheduler::hasPendingTasks() const {
+    return m_sharedTaskCount > 0 || (t_thread_ctx && t_thread_ctx->pinnedTasks > 0);
+}
+
 bool Scheduler::stopping() {
     MutexType::Lock lock(m_mutex); // for m_fibers(it is a list)
     return m_autoStop && m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
@@ -251,7 +320,7 @@ bool Scheduler::stopping() {
 
 void Scheduler::idle() {
     CPPSERVER_LOG_INFO(g_logger) << "idle!!";
-    while (!stopping()) {
+    while (!stopping() && !retiring()) {
         Fiber::YieldToHold();
     }
 }
@@ -260,5 +329,140 @@ void Scheduler::setThis() {
     t_scheduler = this;
 }
 
+bool Scheduler::retiring() const {
+    return t_retiring;
+}
+
+// 需持有m_mutex
+void Scheduler::addThread() {
+    Thread::ptr thr(new Thread(std::bind(&Scheduler::run, this),
+                               m_name + "_" + std::to_string(m_nextThreadIndex++)));
+    m_threads.push_back(thr);
+    m_threadIds.push_back(thr->getId());
+    m_threadCtxs[thr->getId()].reset(new ThreadCtx(thr->getId()));
+}
+
+void Scheduler::setThreadCount(size_t threads) {
+    CPPSERVER_ASSERT(threads > 0);
+    if (m_rootThread != -1) { // use_caller的线程不参与增减
+        --threads;
+    }
+    size_t retire_count = 0;
+    std::vector<Thread::ptr> retired;
+    {
+        MutexType::Lock lock(m_mutex);
+        retired.swap(m_retiredThreads);
+        if (!m_stopping && threads > m_threadCount) {
+            size_t add = threads - m_threadCount;
+            // 先撤销还未被线程认领的退役, 不够再新建线程
+            size_t pending = m_retireCount;
+            while (add > 0 && pending > 0) {
+                if (m_retireCount.compare_exchange_weak(pending, pending - 1)) {
+                    --add;
+                    pending = m_retireCount;
+                }
+            }
+            for (; add > 0; --add) {
+                addThread();
+            }
+        } else if (!m_stopping && threads < m_threadCount) {
+            retire_count = m_threadCount - threads;
+            m_retireCount += retire_count;
+        }
+        CPPSERVER_LOG_INFO(g_logger) << m_name << " thread count change from "
+            << m_threadCount << " to " << threads;
+        m_threadCount = threads;
+    }
+    if (retire_count) {
+        tickleAll();
+    }
+    for (auto& i : retired) {
+        i->join();
+    }
+}
+
+size_t Scheduler::getThreadCount() const {
+    return m_threadCount + (m_rootThread != -1 ? 1 : 0);
+}
+
+std::vector<int> Scheduler::getThreadIds() {
+    MutexType::Lock lock(m_mutex);
+    return m_threadIds;
+}
+
+void Scheduler::bindThreadCount(ConfigVar<uint32_t>::ptr var) {
+    if (m_threadCountVar) {
+        m_threadCountVar->delListener(m_threadCountListener);
+    }
+    m_threadCountVar = var;
+    m_threadCountListener = var->addListener([this](const uint32_t& old_value, const uint32_t& new_value) {
+        if (new_value > 0) {
+            setThreadCount(new_value);
+        }
+    });
+    if (var->getValue() > 0) {
+        setThreadCount(var->getValue());
+    }
+}
+
+bool Scheduler::tryRetire() {
+    if (CppServer::GetThreadId() == m_rootThread) {
+        return false;
+    }
+    size_t n = m_retireCount;
+    while (n > 0) {
+        if (m_retireCount.compare_exchange_weak(n, n - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 取一个interval内的最小值: 突发排起的队只要有一次被排空就不算过载
+void Scheduler::updateQueueDelay(uint64_t enqueue_us, uint64_t now) {
+    uint64_t delay = now > enqueue_us ? now - enqueue_us : 0;
+    m_minDelay = std::min(m_minDelay, delay);
+    if (m_intervalStart == 0) {
+        m_intervalStart = now;
+    }
+    if (now - m_intervalStart >= s_overload_interval) {
+        m_queueDelay = m_minDelay;
+        m_overloaded = m_minDelay > s_overload_target;
+        m_minDelay = UINT64_MAX;
+        m_intervalStart = now;
+    }
+}
+
+// 退役线程退出run之前, 把还指派给自己的任务转交给任一线程
+void Scheduler::retire() {
+    int id = CppServer::GetThreadId();
+    bool need_tickle = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        for (auto& ft : m_fibers) {
+            if (ft.thread == id) {
+                ft.thread = -1;
+                --t_thread_ctx->pinnedTasks;
+                ++m_sharedTaskCount;
+                need_tickle = true;
+            }
+        }
+        m_threadCtxs.erase(id);
+        m_threadIds.erase(std::remove(m_threadIds.begin(), m_threadIds.end(), id),
+                          m_threadIds.end());
+        for (auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+            if ((*it)->getId() == id) {
+                m_retiredThreads.push_back(*it);
+                m_threads.erase(it);
+                break;
+            }
+        }
+    }
+    CPPSERVER_LOG_INFO(g_logger) << m_name << " thread " << id << " retired";
+    if (need_tickle) {
+        tickle();
+    }
+}
+
 
 } // CppServer
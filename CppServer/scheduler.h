@@ -4,8 +4,12 @@
 #include <memory>
 #include <vector>
 #include <list>
+#include <unordered_map>
+#include <algorithm>
 #include "fiber.h"
 #include "thread.h"
+#include "config.h"
+#include "util.h"
 
 namespace CppServer {
 
@@ -14,6 +18,16 @@ class Scheduler {
     typedef std::shared_ptr<Scheduler> ptr;
     typedef Mutex MutexType;
 
+    // 每个调度线程一份, 用来单独唤醒指派了任务的线程
+    struct ThreadCtx {
+        typedef std::shared_ptr<ThreadCtx> ptr;
+        int id = -1;
+        std::atomic<size_t> pinnedTasks = {0};  // 指派给本线程还没执行的任务数
+        std::atomic<bool> sleeping = {false};   // 子类idle陷入阻塞等待前置位, 醒来后清除
+
+        ThreadCtx(int thread) : id(thread) {}
+    };
+
     Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name =""); 
     virtual ~Scheduler();
 
@@ -24,14 +38,33 @@ class Scheduler {
     void start();
     void stop();
 
+    // 运行时调整线程数(含use_caller的线程), 缩容时由空闲线程自行退出
+    void setThreadCount(size_t threads);
+    size_t getThreadCount() const;
+    // 线程数跟随配置项变化
+    void bindThreadCount(ConfigVar<uint32_t>::ptr var);
+    // 当前所有调度线程的id(含use_caller的线程)
+    std::vector<int> getThreadIds();
+    // use_caller的线程id, 没有为-1; 它只在stop时才参与调度
+    int getRootThread() const { return m_rootThread; }
+
+    // 过载检测(CoDel): 一个interval(scheduler.overload_interval)内出队任务的最小排队时间
+    // 仍超过target(scheduler.overload_target), 说明不是瞬时突发而是处理不过来; 队列排空即解除
+    bool isOverloaded() const { return m_overloaded && m_taskCount > 0; }
+    // 上一个interval内任务的最小排队时间(us)
+    uint64_t getQueueDelay() const { return m_queueDelay; }
+
     template<class FiberOrCb>
     void schedule(FiberOrCb fc, int thread = -1) {
         bool need_tickle = false;
+        ThreadCtx::ptr target;
         {
             MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
+            need_tickle = scheduleNoLock(fc, thread, target);
         }
-        if (need_tickle) {
+        if (target) {
+            tickleThread(target, false);
+        } else if (need_tickle) {
             tickle();
         }
     }
@@ -39,33 +72,79 @@ class Scheduler {
     template<class InputIterator>
     void schedule(InputIterator begin, InputIterator end) {
         bool need_tickle = false;
+        std::vector<ThreadCtx::ptr> targets;
         {
             MutexType::Lock lock(m_mutex);
             while (begin != end) {
-                need_tickle = scheduleNoLock(&*begin, -1) || need_tickle; // ??? why &*, why pass by pointer ?
+                ThreadCtx::ptr target;
+                need_tickle = scheduleNoLock(&*begin, -1, target) || need_tickle; // ??? why &*, why pass by pointer ?
+                if (target && std::find(targets.begin(), targets.end(), target) == targets.end()) {
+                    targets.push_back(target);
+                }
                 ++begin;
             }
         }
+        for (auto& i : targets) {
+            tickleThread(i, false);
+        }
         if (need_tickle) {
             tickle();
         }
     }
  protected:
     virtual void tickle();
+    // 唤醒指定线程; force为false时只唤醒睡着的, 没睡的回到run时自己会看到指派给它的任务
+    void tickleThread(const ThreadCtx::ptr& ctx, bool force);
+    // 唤醒所有线程(stop/缩容)
+    void tickleAll();
+    // 打断thread的阻塞等待, 持有m_mutex调用, 保证线程还没退出run; 默认退化为tickle
+    virtual void wakeThread(int thread);
+    // 当前线程的ThreadCtx, 不在调度线程里为nullptr
+    static ThreadCtx* GetThreadCtx();
     void run();
     virtual bool stopping();
     virtual void idle(); // 解决线程没事做的时候干的事情，让子类实现
 
     void setThis(); // protected?
     bool hasIdleThreads() { return m_idleThreadCount > 0; }
+    // 无锁查看有没有本线程可以执行的任务(未指派的, 或指派给本线程的)
+    bool hasPendingTasks() const;
+    bool retiring() const; // 当前线程是否正在退役
  private:
+    bool tryRetire();
+    void retire();
+    void addThread();
+    // 任务出队时调用, 需持有m_mutex
+    void updateQueueDelay(uint64_t enqueue_us, uint64_t now);
+
+    // 指派给某个线程的任务由target带回, 入队后单独唤醒它; 返回是否需要tickle任一线程
     template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread) {
-        bool need_tickle = m_fibers.empty();
+    bool scheduleNoLock(FiberOrCb fc, int thread, ThreadCtx::ptr& target) {
+        bool need_tickle = m_sharedTaskCount == 0;
         FiberAndThread ft(fc, thread);
-        if (ft.fiber || ft.cb) {
-            m_fibers.push_back(ft);
+        if (ft.thread == -1 && ft.fiber) {
+            ft.thread = ft.fiber->getAffinity(); // 协程固定在某个线程上
+        }
+        if (ft.thread != -1) {
+            auto it = m_threadCtxs.find(ft.thread);
+            if (it == m_threadCtxs.end()) {
+                ft.thread = -1; // 指派的线程已退役
+            } else {
+                target = it->second;
+            }
+        }
+        if (!ft.fiber && !ft.cb) {
+            target = nullptr;
+            return false;
+        }
+        ft.enqueueUs = GetMonotonicUS();
+        m_fibers.push_back(ft);
+        ++m_taskCount;
+        if (target) {
+            ++target->pinnedTasks;
+            return false;
         }
+        ++m_sharedTaskCount;
         return need_tickle;
     }
  private:
@@ -73,6 +152,7 @@ class Scheduler {
         Fiber::ptr fiber;
         std::function<void()> cb;
         int thread; // 该任务/协程被指派的线程，-1代表任一线程
+        uint64_t enqueueUs = 0; // 入队时间, 用于统计排队时间
 
         FiberAndThread(Fiber::ptr f, int thr) : fiber{f}, thread{thr} {}
         FiberAndThread(Fiber::ptr* f, int thr) : thread{thr} { fiber.swap(*f); }
@@ -84,15 +164,23 @@ class Scheduler {
             fiber = nullptr;
             cb = nullptr;
             thread =  -1;
+            enqueueUs = 0;
         }
     };
 
  private:
     MutexType m_mutex;
     std::vector<Thread::ptr> m_threads;
+    std::vector<Thread::ptr> m_retiredThreads; // 已退役待join的线程
     std::list<FiberAndThread> m_fibers; // 等待执行的协程任务
+    std::unordered_map<int, ThreadCtx::ptr> m_threadCtxs; // 正在run的线程
     Fiber::ptr m_rootFiber; // rootFiber是创建sceduler的线程里面那个run的协程
     std::string m_name;
+    size_t m_nextThreadIndex = 0;
+    ConfigVar<uint32_t>::ptr m_threadCountVar;
+    uint64_t m_threadCountListener = 0;
+    uint64_t m_minDelay = UINT64_MAX;   // 当前interval内的最小排队时间
+    uint64_t m_intervalStart = 0;
 
  protected:
     std::vector<int> m_threadIds;
@@ -102,6 +190,11 @@ class Scheduler {
 
     std::atomic<size_t> m_activeThreadCount = {0};
     std::atomic<size_t> m_idleThreadCount = {0};
+    std::atomic<size_t> m_retireCount = {0}; // 等待线程认领的退役数
+    std::atomic<size_t> m_taskCount = {0};   // m_fibers的大小
+    std::atomic<size_t> m_sharedTaskCount = {0}; // m_fibers里没有指派线程的任务数, 供idle自旋时无锁查看
+    std::atomic<uint64_t> m_queueDelay = {0};
+    std::atomic<bool> m_overloaded = {false};
     bool m_stopping = true;
     bool m_autoStop = true; // 是否主动停止???
     int m_rootThread = 0; // 启动scheduler的主线程
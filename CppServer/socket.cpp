@@ -1,15 +1,327 @@
 #include "socket.h"
+#include "config.h"
 #include "iomanager.h"
 #include "fd_manager.h"
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "util.h"
 
+#include <algorithm>
+#include <list>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
 
 namespace CppServer {
 
 static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
 
+static CppServer::ConfigVar<uint64_t>::ptr g_zerocopy_close_timeout =
+    CppServer::Config::Lookup("socket.zerocopy_close_timeout", (uint64_t) 10000, "max time(ms) a closed socket waits for pending MSG_ZEROCOPY completions before its fd is released");
+
+// MSG_ZEROCOPY的完成通知: 每次成功的零拷贝发送按顺序分到一个id(从0开始),
+// 内核在错误队列里以[lo, hi]区间通知这些发送引用的页已经释放
+// 等待者挂在IOManager的ERROR事件上, 小于等于它的id全部完成后回调
+// 关闭时还有发送没完成的话, 内核还引用着调用方的页, 关掉fd就再也收不到通知, 只能让调用方提前释放
+// 所以这种情况下fd留给本对象继续收通知, 到齐(或者socket.zerocopy_close_timeout超时)后再关闭fd
+class ZeroCopyContext : public std::enable_shared_from_this<ZeroCopyContext>, Noncopyable {
+public:
+    typedef std::shared_ptr<ZeroCopyContext> ptr;
+    typedef Mutex MutexType;
+
+    ZeroCopyContext(int fd)
+        : m_fd(fd)
+        , m_enabled(true)
+        , m_nextId(0)
+        , m_done(0)
+        , m_registered(false)
+        , m_closed(false)
+        , m_failed(false)
+        , m_lingering(false)
+        , m_released(false)
+        , m_completed(0)
+        , m_copied(0) {
+    }
+
+    bool isEnabled() const { return m_enabled; }
+    void setEnabled(bool v) { m_enabled = v; }
+
+    // 一次成功的MSG_ZEROCOPY发送, 返回它的通知id
+    uint32_t onSend() {
+        MutexType::Lock lock(m_mutex);
+        return m_nextId++;
+    }
+
+    // id及之前的发送全部完成后调用cb(true), socket出错或关闭时cb(false)
+    // 不在IOManager里时阻塞等待, cb在返回前调用
+    void wait(uint32_t id, std::function<void(bool)> cb);
+    // socket关闭前调用. 返回true表示还有发送在等完成通知, fd交给本对象, 到齐或超时后由它关闭
+    // 返回false时之后不再碰fd, 还在等的都以失败回调, 调用方自己关闭fd
+    bool close();
+
+    uint64_t getCompleted() const { return m_completed; }
+    uint64_t getCopied() const { return m_copied; }
+private:
+    bool isDone(uint32_t id) const { return (int32_t) (m_done - id) > 0; }
+    void drain(bool check_error);
+    void complete(uint32_t lo, uint32_t hi);
+    bool registerEvent(IOManager* iom);
+    void onReady();
+    void onLingerTimeout();
+private:
+    int m_fd;
+    bool m_enabled;
+    MutexType m_mutex;
+    IOManager* m_iom = nullptr;
+    uint32_t m_nextId;
+    uint32_t m_done;                            // 小于m_done的id都已完成
+    std::map<uint32_t, uint32_t> m_ranges;      // 乱序到达的完成区间
+    std::list<std::pair<uint32_t, std::function<void(bool)> > > m_waiters;
+    bool m_registered;
+    bool m_closed;
+    bool m_failed;
+    bool m_lingering;                           // socket已关闭, fd留着等剩下的完成通知
+    bool m_released;                            // 等到头了, fd已经关闭
+    Timer::ptr m_lingerTimer;
+    std::atomic<uint64_t> m_completed;
+    std::atomic<uint64_t> m_copied;
+};
+
+void ZeroCopyContext::wait(uint32_t id, std::function<void(bool)> cb) {
+    IOManager* iom = IOManager::GetThis();
+    MutexType::Lock lock(m_mutex);
+    bool check_error = false;
+    while (true) {
+        if (!m_closed && !m_failed) {
+            drain(check_error);
+        }
+        bool ok = !m_closed && !m_failed;
+        if (!ok || isDone(id)) {
+            lock.unlock();
+            cb(ok);
+            return;
+        }
+        if (iom) {
+            break;
+        }
+        lock.unlock();
+        // 错误队列有消息时poll总会报告POLLERR
+        pollfd pfd;
+        pfd.fd = m_fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        poll_f(&pfd, 1, 100);
+        check_error = pfd.revents & POLLERR;
+        lock.lock();
+    }
+
+    m_waiters.push_back(std::make_pair(id, cb));
+    if (!m_registered && !registerEvent(iom)) {
+        m_waiters.pop_back();
+        lock.unlock();
+        cb(false);
+    }
+}
+
+bool ZeroCopyContext::close() {
+    IOManager* iom = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_registered && !m_waiters.empty() && !m_failed) {
+            m_lingering = true;
+            m_lingerTimer = m_iom->addTimer(g_zerocopy_close_timeout->getValue(),
+                    std::bind(&ZeroCopyContext::onLingerTimeout, shared_from_this()));
+            lock.unlock();
+            // 先让对端看到连接结束, 已经在发送队列里的数据照常发完
+            ::shutdown(m_fd, SHUT_RDWR);
+            return true;
+        }
+        m_closed = true;
+        if (m_registered) {
+            iom = m_iom;
+        }
+    }
+    // 触发ERROR回调, 由onReady让等待者失败
+    if (iom) {
+        iom->cancelEvent(m_fd, IOManager::ERROR);
+    }
+    return false;
+}
+
+void ZeroCopyContext::onLingerTimeout() {
+    IOManager* iom = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        if (m_released) {
+            return;
+        }
+        CPPSERVER_LOG_WARN(g_logger) << "zerocopy fd=" << m_fd << " close timeout, "
+            << m_waiters.size() << " sends still pending";
+        m_closed = true;
+        if (m_registered) {
+            iom = m_iom;
+        }
+    }
+    // 由onReady让剩下的等待者失败并关闭fd
+    if (iom) {
+        iom->cancelEvent(m_fd, IOManager::ERROR);
+    }
+}
+
+void ZeroCopyContext::drain(bool check_error) {
+    bool drained = false;
+    while (true) {
+        char control[128];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        // 错误队列不会阻塞, 用原始函数避免hook让出协程等读事件
+        int rt = recvmsg_f(m_fd, &msg, MSG_ERRQUEUE);
+        if (rt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                m_failed = true;
+            }
+            break;
+        }
+        drained = true;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) {
+                continue;
+            }
+            complete(serr.ee_info, serr.ee_data);
+            uint32_t count = serr.ee_data - serr.ee_info + 1;
+            m_completed += count;
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                m_copied += count;
+            }
+        }
+    }
+    // 报告了EPOLLERR但错误队列是空的, 是socket本身出错了, 不处理会一直触发
+    if (check_error && !drained && !m_failed) {
+        // 有读写等待者时IOManager已经把SO_ERROR读走存在FdCtx里
+        FdCtx* ctx = FdMgr::GetInstance()->get(m_fd);
+        int err = ctx ? ctx->getSockError() : 0;
+        socklen_t len = sizeof(err);
+        if (err || (getsockopt_f(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err)) {
+            CPPSERVER_LOG_WARN(g_logger) << "zerocopy fd=" << m_fd << " socket error="
+                << err << " errstr=" << strerror(err);
+            m_failed = true;
+        }
+    }
+}
+
+void ZeroCopyContext::complete(uint32_t lo, uint32_t hi) {
+    if (lo != m_done) {
+        m_ranges[lo] = hi;
+        return;
+    }
+    m_done = hi + 1;
+    auto it = m_ranges.find(m_done);
+    while (it != m_ranges.end()) {
+        m_done = it->second + 1;
+        m_ranges.erase(it);
+        it = m_ranges.find(m_done);
+    }
+}
+
+bool ZeroCopyContext::registerEvent(IOManager* iom) {
+    if (iom->addEvent(m_fd, IOManager::ERROR,
+                std::bind(&ZeroCopyContext::onReady, shared_from_this()))) {
+        CPPSERVER_LOG_ERROR(g_logger) << "zerocopy fd=" << m_fd << " addEvent ERROR fail";
+        return false;
+    }
+    m_iom = iom;
+    m_registered = true;
+    return true;
+}
+
+void ZeroCopyContext::onReady() {
+    std::vector<std::function<void(bool)> > cbs;
+    std::vector<std::function<void(bool)> > failed_cbs;
+    Timer::ptr linger_timer;
+    {
+        MutexType::Lock lock(m_mutex);
+        m_registered = false;
+        if (!m_closed && !m_failed) {
+            drain(true);
+        }
+        bool ok = !m_closed && !m_failed;
+        for (auto it = m_waiters.begin(); it != m_waiters.end();) {
+            if (!ok) {
+                failed_cbs.push_back(std::move(it->second));
+                it = m_waiters.erase(it);
+            } else if (isDone(it->first)) {
+                cbs.push_back(std::move(it->second));
+                it = m_waiters.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (!m_waiters.empty() && !registerEvent(m_iom)) {
+            for (auto& i : m_waiters) {
+                failed_cbs.push_back(std::move(i.second));
+            }
+            m_waiters.clear();
+        }
+        if (m_lingering && m_waiters.empty() && !m_released) {
+            m_released = true;
+            linger_timer.swap(m_lingerTimer);
+        }
+    }
+    for (auto& cb : cbs) {
+        cb(true);
+    }
+    for (auto& cb : failed_cbs) {
+        cb(false);
+    }
+    if (linger_timer) {
+        linger_timer->cancel();
+        // 通知都到齐了, 页已经不再被内核引用, 现在才真正关闭fd
+        ::close(m_fd);
+    }
+}
+
 Socket::ptr Socket::CreateTCP(CppServer::Address::ptr address) {
     Socket::ptr sock(new Socket(address->getFamily(), TCP, 0));
     return sock;
@@ -17,6 +329,8 @@ Socket::ptr Socket::CreateTCP(CppServer::Address::ptr address) {
 
 Socket::ptr Socket::CreateUDP(CppServer::Address::ptr address) {
     Socket::ptr sock(new Socket(address->getFamily(), UDP, 0));
+    sock->newSock();
+    sock->m_isConnected = true;
     return sock;
 }
 
@@ -27,6 +341,8 @@ Socket::ptr Socket::CreateTCPSocket() {
 
 Socket::ptr Socket::CreateUDPSocket() {
     Socket::ptr sock(new Socket(IPv4, UDP, 0));
+    sock->newSock();
+    sock->m_isConnected = true;
     return sock;
 }
 
@@ -37,6 +353,8 @@ Socket::ptr Socket::CreateTCPSocket6() {
 
 Socket::ptr Socket::CreateUDPSocket6() {
     Socket::ptr sock(new Socket(IPv6, UDP, 0));
+    sock->newSock();
+    sock->m_isConnected = true;
     return sock;
 }
 
@@ -47,6 +365,34 @@ Socket::ptr Socket::CreateUnixTCPSocket() {
 
 Socket::ptr Socket::CreateUnixUDPSocket() {
     Socket::ptr sock(new Socket(UNIX, UDP, 0));
+    sock->newSock();
+    sock->m_isConnected = true;
+    return sock;
+}
+
+Socket::ptr Socket::FromFd(int fd) {
+    int family = 0;
+    int type = 0;
+    int protocol = 0;
+    int listening = 0;
+    socklen_t len = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &family, &len)
+            || getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len)
+            || getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len)
+            || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len)) {
+        CPPSERVER_LOG_ERROR(g_logger) << "FromFd(" << fd << ") errno=" << errno
+            << " errstr=" << strerror(errno);
+        return nullptr;
+    }
+    // fd号可能是刚被别人关掉复用的, 丢掉旧记录
+    FdMgr::GetInstance()->del(fd);
+    FdCtx* ctx = FdMgr::GetInstance()->get(fd, true);
+    if (!ctx || !ctx->isSocket()) {
+        return nullptr;
+    }
+    Socket::ptr sock(new Socket(family, type, protocol));
+    sock->m_sock = fd;
+    sock->m_isConnected = !listening;
     return sock;
 }
 
@@ -55,7 +401,8 @@ Socket::Socket(int family, int type, int protocol)
     , m_family {family}
     , m_type {type}
     , m_protocol {protocol}
-    , m_isConnected {false} {
+    , m_isConnected {false}
+    , m_lastActive {0} {
 }
 
 Socket::~Socket() {
@@ -63,7 +410,7 @@ Socket::~Socket() {
 }
 
 int64_t Socket::getSendTimeout() {
-    FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_sock);
+    FdCtx* ctx = FdMgr::GetInstance()->get(m_sock);
     if (ctx) {
         return ctx->getTimeout(SO_SNDTIMEO);
     }
@@ -76,7 +423,7 @@ void Socket::setSendTimeout(int64_t v) {
 }
 
 int64_t Socket::getRecvTimeout() {
-    FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_sock);
+    FdCtx* ctx = FdMgr::GetInstance()->get(m_sock);
     if (ctx) {
         return ctx->getTimeout(SO_RCVTIMEO);
     }
@@ -111,30 +458,128 @@ bool Socket::setOption(int level, int option, const void* result, size_t len) {
     return true;
 }
 
+bool Socket::setBusyPoll(uint32_t us, uint32_t budget, bool prefer) {
+    int val = us;
+    if (!setOption(SOL_SOCKET, SO_BUSY_POLL, val)) {
+        return false;
+    }
+    val = (us && prefer) ? 1 : 0;
+    bool rt = setOption(SOL_SOCKET, SO_PREFER_BUSY_POLL, val);
+    if (us && budget) {
+        val = budget > IOManager::MAX_BUSY_POLL_BUDGET ? IOManager::MAX_BUSY_POLL_BUDGET : budget;
+        rt = setOption(SOL_SOCKET, SO_BUSY_POLL_BUDGET, val) && rt;
+    }
+    return rt;
+}
+
+bool Socket::setUdpSegment(uint16_t size) {
+    int val = size;
+    return setOption(SOL_UDP, UDP_SEGMENT, val);
+}
+
+bool Socket::setUdpGro(bool on) {
+    int val = on ? 1 : 0;
+    return setOption(SOL_UDP, UDP_GRO, val);
+}
+
+// 监听在具体地址上时, 新连接的本端地址就是监听地址
+static bool IsWildcard(const Address::ptr& addr) {
+    if (addr->getFamily() == AF_INET) {
+        return ((const sockaddr_in*) addr->getAddr())->sin_addr.s_addr == htonl(INADDR_ANY);
+    }
+    if (addr->getFamily() == AF_INET6) {
+        return IN6_IS_ADDR_UNSPECIFIED(&((const sockaddr_in6*) addr->getAddr())->sin6_addr);
+    }
+    return true;
+}
+
 Socket::ptr Socket::accept() {
-    Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
-    // 不需要拿到远端地址？为什么？
-    int newsock = ::accept(m_sock, nullptr, nullptr);
+    // accept4顺带取回远端地址, 省掉一次getpeername; hook会给新fd加上SOCK_NONBLOCK
+    bool capture = m_family == AF_INET || m_family == AF_INET6;
+    sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    int newsock = ::accept4(m_sock, capture ? (sockaddr*) &peer : nullptr,
+                            capture ? &peer_len : nullptr, SOCK_CLOEXEC);
     if (newsock == -1) {
         CPPSERVER_LOG_ERROR(g_logger) << "accept(" << m_sock << ") errno="
             << errno << " errstr=" << strerror(errno);
         return nullptr;
     }
-    if (sock->init(newsock)) {
-        return sock;
+    if (!is_hook_enable()) {
+        // 没开hook时accept不登记新fd; 同号的旧记录可能是关闭时没开hook留下的, 先作废
+        FdMgr::GetInstance()->del(newsock);
+        FdMgr::GetInstance()->get(newsock, true);
+    }
+    return acceptFd(newsock, peer, peer_len, capture);
+}
+
+size_t Socket::acceptBatch(std::vector<Socket::ptr>& socks, size_t max) {
+    if (max == 0) {
+        return 0;
+    }
+    Socket::ptr first = accept();
+    if (!first) {
+        return 0;
+    }
+    socks.push_back(first);
+    size_t count = 1;
+
+    // 监听socket在内核层不是非阻塞的(没开hook)就只取一个, 否则后面的accept会阻塞线程
+    FdCtx* ctx = FdMgr::GetInstance()->get(m_sock);
+    if (!ctx || !ctx->getSysNonblock()) {
+        return count;
+    }
+    bool capture = m_family == AF_INET || m_family == AF_INET6;
+    while (count < max) {
+        sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        // 不经过hook, 没有连接时直接返回EAGAIN而不是让出协程
+        int newsock = accept4_f(m_sock, capture ? (sockaddr*) &peer : nullptr,
+                                capture ? &peer_len : nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsock == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                CPPSERVER_LOG_ERROR(g_logger) << "accept(" << m_sock << ") errno="
+                    << errno << " errstr=" << strerror(errno);
+            }
+            break;
+        }
+        FdCtx* client_ctx = FdMgr::GetInstance()->addSocket(newsock);
+        if (client_ctx) {
+            client_ctx->setUserNonblock(false);
+        }
+        Socket::ptr sock = acceptFd(newsock, peer, peer_len, capture);
+        if (sock) {
+            socks.push_back(sock);
+            ++count;
+        }
+    }
+    return count;
+}
+
+Socket::ptr Socket::acceptFd(int newsock, const sockaddr_storage& peer, socklen_t peer_len, bool capture) {
+    Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
+    if (!sock->init(newsock)) {
+        ::close(newsock);
+        return nullptr;
+    }
+    if (capture) {
+        sock->m_remoteAddress = Address::Create((const sockaddr*) &peer, peer_len);
+    }
+    Address::ptr local = getLocalAddress();
+    if (local && !IsWildcard(local)) {
+        sock->m_localAddress = local;
     }
-    return nullptr;
+    return sock;
 }
 
-// 为啥不做成构造函数啊？ 应该是这里要返回一个已连接的socket吧，而不是全新的未连接的, 而且socket的构造函数只是指定familly等属性，并未真正申请socket, 但这个会
+// 只用于accept出来的连接: TCP_NODELAY从监听socket继承, SO_REUSEADDR对已连接socket没用
+// 地址在第一次getLocalAddress/getRemoteAddress时才查
 bool Socket::init(int sock) {
-    FdCtx::ptr ctx = FdMgr::GetInstance()->get(sock);
+    FdCtx* ctx = FdMgr::GetInstance()->get(sock);
     if (ctx && ctx->isSocket() &&!ctx->isClose()) {
         m_sock = sock;
         m_isConnected = true;
-        initSock();
-        getLocalAddress();
-        getRemoteAddress();
+        touch();
         return true;
     } 
     return false;
@@ -217,16 +662,37 @@ bool Socket::close() {
         return true;
     }
     m_isConnected = false;
+    bool lingering = false;
+    if (m_zeroCopy) {
+        lingering = m_zeroCopy->close();
+        m_zeroCopy.reset();
+    }
     if (m_sock != -1) {
-        ::close(m_sock);
-        m_sock = -1;
+        int fd = m_sock;
+        {
+            Spinlock::Lock lock(m_closeMutex);
+            m_sock = -1;
+        }
+        // 还有零拷贝发送没收到完成通知时fd已经交给ZeroCopyContext, 由它关闭
+        if (!lingering) {
+            ::close(fd);
+        }
     }
     return false;
 }
 
+bool Socket::shutdown(int how) {
+    Spinlock::Lock lock(m_closeMutex);
+    return m_sock != -1 && ::shutdown(m_sock, how) == 0;
+}
+
 int Socket::send(const void* buffer, size_t length, int flags) {
     if (isConnected()) {
-        return ::send(m_sock, buffer, length, flags);
+        int rt = ::send(m_sock, buffer, length, flags);
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -237,14 +703,22 @@ int Socket::send(const iovec* buffers, size_t length, int flags) {
         memset(&msg, 0, sizeof(msg));
         msg.msg_iov = (iovec*) buffers;
         msg.msg_iovlen = length;
-        return ::sendmsg(m_sock, &msg, flags);
+        int rt = ::sendmsg(m_sock, &msg, flags);
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
 
 int Socket::sendTo(const void* buffer, size_t length, const Address::ptr to, int flags) {
     if (isConnected()) {
-        return ::sendto(m_sock, buffer, length, flags, to->getAddr(), to->getAddrLen());
+        int rt = ::sendto(m_sock, buffer, length, flags, to->getAddr(), to->getAddrLen());
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -257,14 +731,127 @@ int Socket::sendTo(const iovec* buffers, size_t length, const Address::ptr to, i
         msg.msg_iovlen = length;
         msg.msg_name = to->getAddr();
         msg.msg_namelen = to->getAddrLen();
-        return ::sendmsg(m_sock, &msg, flags);
+        int rt = ::sendmsg(m_sock, &msg, flags);
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
 
+bool Socket::setZeroCopy(bool on) {
+    if (!isValid()) {
+        return false;
+    }
+    int val = on ? 1 : 0;
+    if (!setOption(SOL_SOCKET, SO_ZEROCOPY, val)) {
+        return false;
+    }
+    // 关掉之后保留上下文, 还在路上的通知id要接着用
+    if (!m_zeroCopy && on) {
+        m_zeroCopy.reset(new ZeroCopyContext(m_sock));
+    } else if (m_zeroCopy) {
+        m_zeroCopy->setEnabled(on);
+    }
+    return true;
+}
+
+ssize_t Socket::sendZeroCopyAsync(const void* buffer, size_t length,
+                                  std::function<void(bool)> cb, int flags) {
+    if (!isConnected()) {
+        if (cb) {
+            cb(false);
+        }
+        return -1;
+    }
+    ZeroCopyContext::ptr ctx = m_zeroCopy;
+    bool zerocopy = ctx && ctx->isEnabled();
+    const char* ptr = (const char*) buffer;
+    size_t left = length;
+    bool has_id = false;
+    uint32_t last_id = 0;
+    while (left > 0) {
+        int rt = -1;
+        if (zerocopy) {
+            rt = ::send(m_sock, ptr, left, flags | MSG_ZEROCOPY);
+            if (rt > 0) {
+                last_id = ctx->onSend();
+                has_id = true;
+            } else if (rt < 0 && errno == ENOBUFS) {
+                // 锁定页的配额(optmem_max)用完了, 这一段退回普通拷贝
+                rt = ::send(m_sock, ptr, left, flags);
+            }
+        } else {
+            rt = ::send(m_sock, ptr, left, flags);
+        }
+        if (rt <= 0) {
+            break;
+        }
+        // 大块数据可能发很久, 每段都刷新活跃时间
+        touch();
+        ptr += rt;
+        left -= rt;
+    }
+
+    if (has_id) {
+        ctx->wait(last_id, cb ? cb : [](bool) {});
+    } else if (cb) {
+        cb(left == 0);
+    }
+    if (left == length && length > 0) {
+        return -1;
+    }
+    return length - left;
+}
+
+ssize_t Socket::sendZeroCopy(const void* buffer, size_t length, int flags) {
+    Scheduler* scheduler = Scheduler::GetThis();
+    if (!IOManager::GetThis() || !scheduler) {
+        // 不在协程里时wait会阻塞到完成, 回调在返回前已经调用
+        return sendZeroCopyAsync(buffer, length, nullptr, flags);
+    }
+    // 回调可能在yield之前就调用了(已经完成), 调度器不会执行还在EXEC状态的协程, 所以是安全的
+    Fiber::ptr fiber = Fiber::GetThis();
+    ssize_t rt = sendZeroCopyAsync(buffer, length, [scheduler, fiber](bool) {
+        scheduler->schedule(fiber);
+    }, flags);
+    Fiber::YieldToHold();
+    return rt;
+}
+
+uint64_t Socket::getZeroCopyCompleted() const {
+    return m_zeroCopy ? m_zeroCopy->getCompleted() : 0;
+}
+
+uint64_t Socket::getZeroCopyCopied() const {
+    return m_zeroCopy ? m_zeroCopy->getCopied() : 0;
+}
+
+ssize_t Socket::sendFile(int fd, off_t offset, size_t length) {
+    if (!isConnected()) {
+        return -1;
+    }
+    size_t left = length;
+    while (left > 0) {
+        ssize_t rt = ::sendfile(m_sock, fd, &offset, left);
+        if (rt <= 0) {
+            // 已经发送了一部分就返回发送的长度
+            return left == length ? rt : (ssize_t) (length - left);
+        }
+        touch();
+        left -= rt;
+    }
+    return length;
+}
+
 int Socket::recv(void* buffer, size_t length, int flags) {
     if (isConnected()) {
-        return ::recv(m_sock, buffer, length, flags);
+        int rt = ::recv(m_sock, buffer, length, flags);
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -275,7 +862,11 @@ int Socket::recv(iovec* buffers, size_t length, int flags) {
         memset(&msg, 0, sizeof(msg));
         msg.msg_iov = (iovec*) buffers;
         msg.msg_iovlen = length;
-        return ::recvmsg(m_sock, &msg, flags);
+        int rt = ::recvmsg(m_sock, &msg, flags);
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -283,7 +874,11 @@ int Socket::recv(iovec* buffers, size_t length, int flags) {
 int Socket::recvFrom(void* buffer, size_t length, Address::ptr from, int flags) {
     if (isConnected()) {
         socklen_t len = from->getAddrLen();
-        return ::recvfrom(m_sock, buffer, length, flags, from->getAddr(), &len);
+        int rt = ::recvfrom(m_sock, buffer, length, flags, from->getAddr(), &len);
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
@@ -296,11 +891,170 @@ int Socket::recvFrom(iovec* buffers, size_t length, Address::ptr from, int flags
         msg.msg_iovlen = length;
         msg.msg_name = from->getAddr();
         msg.msg_namelen = from->getAddrLen();
-        return ::recvmsg(m_sock, &msg, flags);
+        int rt = ::recvmsg(m_sock, &msg, flags);
+        if (rt > 0) {
+            touch();
+        }
+        return rt;
     }
     return -1;
 }
 
+int Socket::sendToSegmented(const void* buffer, size_t length, uint16_t segment_size,
+                            const Address::ptr to, int flags) {
+    if (!isConnected()) {
+        return -1;
+    }
+    iovec iov;
+    iov.iov_base = (void*) buffer;
+    iov.iov_len = length;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (to) {
+        msg.msg_name = to->getAddr();
+        msg.msg_namelen = to->getAddrLen();
+    }
+
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    if (segment_size > 0 && length > segment_size) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+    }
+    int rt = ::sendmsg(m_sock, &msg, flags);
+    if (rt > 0) {
+        touch();
+    }
+    return rt;
+}
+
+int Socket::recvFromGro(void* buffer, size_t length, Address::ptr from, uint16_t& segment_size, int flags) {
+    if (!isConnected()) {
+        return -1;
+    }
+    iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (from) {
+        msg.msg_name = from->getAddr();
+        msg.msg_namelen = from->getAddrLen();
+    }
+    char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int rt = ::recvmsg(m_sock, &msg, flags);
+    if (rt < 0) {
+        return rt;
+    }
+    touch();
+    segment_size = rt;
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int gso_size = 0;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            segment_size = gso_size;
+            break;
+        }
+    }
+    return rt;
+}
+
+size_t Socket::SplitSegments(void* buffer, size_t length, uint16_t segment_size,
+                             std::vector<iovec>& segments) {
+    size_t step = segment_size ? segment_size : length;
+    size_t count = 0;
+    for (size_t offset = 0; offset < length; offset += step) {
+        iovec iov;
+        iov.iov_base = (char*) buffer + offset;
+        iov.iov_len = std::min(step, length - offset);
+        segments.push_back(iov);
+        ++count;
+    }
+    return count;
+}
+
+// 小批量用栈上的数组, 不能用thread_local: hook的调用会让出协程, 恢复时可能换了线程
+static const size_t s_batch_stack_count = 64;
+
+int Socket::sendToBatch(const iovec* buffers, const Address::ptr* tos, size_t count, int flags) {
+    if (!isConnected() || count == 0) {
+        return -1;
+    }
+    mmsghdr stack_msgs[s_batch_stack_count];
+    std::vector<mmsghdr> heap_msgs;
+    mmsghdr* msgs = stack_msgs;
+    if (count > s_batch_stack_count) {
+        heap_msgs.resize(count);
+        msgs = &heap_msgs[0];
+    }
+    memset(msgs, 0, sizeof(mmsghdr) * count);
+    for (size_t i = 0; i < count; ++i) {
+        msgs[i].msg_hdr.msg_iov = (iovec*) &buffers[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (tos) {
+            msgs[i].msg_hdr.msg_name = tos[i]->getAddr();
+            msgs[i].msg_hdr.msg_namelen = tos[i]->getAddrLen();
+        }
+    }
+
+    // 发送缓冲区满时sendmmsg只发出一部分, 剩下的接着发
+    size_t sent = 0;
+    while (sent < count) {
+        int rt = ::sendmmsg(m_sock, msgs + sent, count - sent, flags);
+        if (rt <= 0) {
+            return sent ? (int) sent : -1;
+        }
+        touch();
+        sent += rt;
+    }
+    return sent;
+}
+
+int Socket::recvFromBatch(iovec* buffers, Address::ptr* froms, size_t* lengths, size_t count, int flags) {
+    if (!isConnected() || count == 0) {
+        return -1;
+    }
+    mmsghdr stack_msgs[s_batch_stack_count];
+    std::vector<mmsghdr> heap_msgs;
+    mmsghdr* msgs = stack_msgs;
+    if (count > s_batch_stack_count) {
+        heap_msgs.resize(count);
+        msgs = &heap_msgs[0];
+    }
+    memset(msgs, 0, sizeof(mmsghdr) * count);
+    for (size_t i = 0; i < count; ++i) {
+        msgs[i].msg_hdr.msg_iov = &buffers[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (froms) {
+            msgs[i].msg_hdr.msg_name = froms[i]->getAddr();
+            msgs[i].msg_hdr.msg_namelen = froms[i]->getAddrLen();
+        }
+    }
+
+    int rt = ::recvmmsg(m_sock, msgs, count, flags, nullptr);
+    if (rt > 0) {
+        touch();
+    }
+    if (rt > 0 && lengths) {
+        for (int i = 0; i < rt; ++i) {
+            lengths[i] = msgs[i].msg_len;
+        }
+    }
+    return rt;
+}
+
 Address::ptr Socket::getRemoteAddress() {
     if (m_remoteAddress) {
         return m_remoteAddress;
@@ -415,6 +1169,10 @@ bool Socket::cancelAll() {
     return IOManager::GetThis()->cancelAll(m_sock);
 }
 
+void Socket::touch() {
+    m_lastActive.store(GetCoarseMS(), std::memory_order_relaxed);
+}
+
 void Socket::initSock() {
     int val = 1;
     setOption(SOL_SOCKET, SO_REUSEADDR, val);
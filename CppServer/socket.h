@@ -5,12 +5,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
+#include <vector>
+#include <functional>
+#include <atomic>
 
 #include "noncopyable.h"
+#include "thread.h"
 #include "address.h"
 
 namespace CppServer {
 
+class ZeroCopyContext;
+
 class Socket : public std::enable_shared_from_this<Socket>, Noncopyable {
 public:
     typedef std::shared_ptr<Socket> ptr;
@@ -38,6 +44,8 @@ public:
 
     static Socket::ptr CreateUnixTCPSocket();
     static Socket::ptr CreateUnixUDPSocket();
+    // 接管一个已有的socket fd(比如从其它进程收到的), 类型从fd上查
+    static Socket::ptr FromFd(int fd);
 
     Socket(int family, int type, int protocol = 0);
     ~Socket();
@@ -60,22 +68,70 @@ public:
         return setOption(level, option, &value, sizeof(T));
     }
 
+    // 内核busy poll(SO_BUSY_POLL/SO_PREFER_BUSY_POLL), us=0关闭
+    // 超过net.core.busy_read的值需要CAP_NET_ADMIN; budget同IOManager::setBusyPoll, 超过上限截断
+    bool setBusyPoll(uint32_t us, uint32_t budget = 0, bool prefer = true);
+
+    // UDP GSO: 一次发送交给内核一大块数据, 由内核(或网卡)按size切成多个数据报; 0为关闭
+    bool setUdpSegment(uint16_t size);
+    // UDP GRO: 同一个流连续到达的数据报合并成一次接收, 分段大小在cmsg里
+    bool setUdpGro(bool on);
+
     Socket::ptr accept();
+    // 第一个连接照常等待, 之后不再等待, 把已完成握手的连接一次取完(最多max个); 返回取到的个数
+    size_t acceptBatch(std::vector<Socket::ptr>& socks, size_t max);
     bool bind(const Address::ptr addr);
     bool connect(const Address::ptr addr, uint64_t timeout_ms = -1);
     bool listen(int backlog = SOMAXCONN);
     bool close();
+    // 可以在其它线程调用, 和close互斥, 不会作用到关闭后被复用的fd上
+    bool shutdown(int how = SHUT_RDWR);
 
     int send(const void* buffer, size_t length, int flags = 0);
     int send(const iovec* buffers, size_t length, int flags = 0); // length means number of io_vectors
     int sendTo(const void* buffer, size_t length, const Address::ptr to, int flags = 0);
     int sendTo(const iovec* buffers, size_t length, const Address::ptr to, int flags = 0);
 
+    // 开启SO_ZEROCOPY, 之后sendZeroCopy才真正走MSG_ZEROCOPY
+    bool setZeroCopy(bool on);
+    // MSG_ZEROCOPY发送: 内核直接引用buffer所在的页, 不拷贝, 适合几百K以上的大块数据
+    // 等到内核的完成通知(错误队列)才返回, 返回后buffer可以复用; 返回已发送的字节数
+    // 同一个socket同时只能有一个协程发送
+    ssize_t sendZeroCopy(const void* buffer, size_t length, int flags = 0);
+    // 发完就返回, 完成通知到齐后调用cb(ok), 在那之前buffer不能修改和释放
+    // 通知到齐前close的话fd会留到通知到齐(或socket.zerocopy_close_timeout)再关闭, cb照常在那时调用
+    // cb(false)只说明发送失败, 超时的情况下内核可能还引用着buffer
+    ssize_t sendZeroCopyAsync(const void* buffer, size_t length,
+                              std::function<void(bool)> cb, int flags = 0);
+    // 完成的零拷贝发送次数, 以及其中内核退化为拷贝的次数(比如loopback)
+    uint64_t getZeroCopyCompleted() const;
+    uint64_t getZeroCopyCopied() const;
+
+    // 用sendfile把文件fd从offset开始的length字节发出去, 返回已发送的字节数
+    ssize_t sendFile(int fd, off_t offset, size_t length);
+
     int recv(void* buffer, size_t length, int flags = 0);
     int recv(iovec* buffers, size_t length, int flags = 0); // length means number of io_vectors
     int recvFrom(void* buffer, size_t length, Address::ptr from, int flags = 0); // 这个Address::ptr不是const的因为，要写入发送者的地址
     int recvFrom(iovec* buffers, size_t length, Address::ptr from, int flags = 0); // length means number of io_vectors
 
+    // 一次系统调用(sendmmsg/recvmmsg)收发多个数据报, buffers[i]是第i个数据报
+    // 返回实际收发的数据报个数, 一个都没有成功返回-1
+    // tos为nullptr时发给已connect的地址
+    int sendToBatch(const iovec* buffers, const Address::ptr* tos, size_t count, int flags = 0);
+    // 带UDP_SEGMENT cmsg发送, length按segment_size切成多个数据报(最多64个, 总长不超过64K)
+    // to为nullptr时发给已connect的地址
+    int sendToSegmented(const void* buffer, size_t length, uint16_t segment_size,
+                        const Address::ptr to = nullptr, int flags = 0);
+    // 开了GRO时接收合并后的数据, buffer最好有64K; segment_size为分段大小, 没有合并时等于返回的长度
+    int recvFromGro(void* buffer, size_t length, Address::ptr from, uint16_t& segment_size, int flags = 0);
+    // 把合并的数据按分段大小切成数据报视图, 不拷贝, 最后一段可能更短; 返回段数
+    static size_t SplitSegments(void* buffer, size_t length, uint16_t segment_size,
+                                std::vector<iovec>& segments);
+
+    // froms为nullptr时不取对端地址, 否则froms[i]要预先创建好(同recvFrom); lengths[i]为第i个数据报的长度
+    int recvFromBatch(iovec* buffers, Address::ptr* froms, size_t* lengths, size_t count, int flags = 0);
+
     Address::ptr getRemoteAddress();
     Address::ptr getLocalAddress();
     
@@ -89,6 +145,9 @@ public:
 
     std::ostream& dump(std::ostream& os) const;
     int getSocket() const { return m_sock; }
+    // 最后一次成功收发数据的时间(GetCoarseMS), 所有send/recv类接口都会更新
+    uint64_t getLastActive() const { return m_lastActive.load(std::memory_order_relaxed); }
+    void touch();
 
     bool cancelRead();
     bool cancelWrite();
@@ -98,15 +157,20 @@ protected:
     void initSock();
     void newSock();
     bool init(int sock);
+private:
+    Socket::ptr acceptFd(int newsock, const sockaddr_storage& peer, socklen_t peer_len, bool capture);
 private:
     int m_sock;
     int m_family;
     int m_type;
     int m_protocol;
     bool m_isConnected;
+    std::atomic<uint64_t> m_lastActive;
+    Spinlock m_closeMutex;
 
     Address::ptr m_localAddress;
     Address::ptr m_remoteAddress;
+    std::shared_ptr<ZeroCopyContext> m_zeroCopy;
 };
 
 std::ostream& operator<<(std::ostream& os, const Socket& sock);
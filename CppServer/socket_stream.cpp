@@ -0,0 +1,207 @@
+#include "socket_stream.h"
+
+#include <algorithm>
+#include <string.h>
+#include <sys/uio.h>
+
+namespace CppServer {
+
+SocketStream::SocketStream(Socket::ptr sock, bool owner, size_t buffer_size)
+    : m_socket(sock)
+    , m_owner(owner)
+    , m_bufferSize(buffer_size ? buffer_size : 4096)
+    , m_rpos(0)
+    , m_rend(0)
+    , m_wlen(0)
+    , m_recvCalls(0)
+    , m_sendCalls(0) {
+}
+
+SocketStream::~SocketStream() {
+    if (m_owner) {
+        close();
+    } else {
+        flush();
+    }
+}
+
+bool SocketStream::isConnected() const {
+    return m_socket && m_socket->isConnected();
+}
+
+int SocketStream::read(void* buffer, size_t length) {
+    if (!isConnected()) {
+        return -1;
+    }
+    if (m_rpos == m_rend) {
+        // 大块读直接进用户的缓冲区, 省一次拷贝
+        if (length >= m_bufferSize) {
+            ++m_recvCalls;
+            return m_socket->recv(buffer, length);
+        }
+        int rt = fill();
+        if (rt <= 0) {
+            return rt;
+        }
+    }
+    size_t len = std::min(length, m_rend - m_rpos);
+    memcpy(buffer, m_rbuf->data() + m_rpos, len);
+    m_rpos += len;
+    if (m_rpos == m_rend) {
+        m_rbuf.reset();
+        m_rpos = m_rend = 0;
+    }
+    return len;
+}
+
+int SocketStream::readLine(std::string& line, const std::string& delim, size_t max_size) {
+    if (!isConnected() || delim.empty()) {
+        return -1;
+    }
+    size_t searched = 0;  // 相对m_rpos已经找过的长度, fill之后不用从头再找
+    while (true) {
+        size_t avail = m_rend - m_rpos;
+        if (avail >= delim.size()) {
+            const char* begin = m_rbuf->data() + m_rpos;
+            size_t from = searched >= delim.size() ? searched - delim.size() + 1 : 0;
+            const char* end = begin + avail;
+            const char* found = std::search(begin + from, end, delim.begin(), delim.end());
+            if (found != end) {
+                size_t len = found - begin;
+                line.assign(begin, len);
+                m_rpos += len + delim.size();
+                if (m_rpos == m_rend) {
+                    m_rbuf.reset();
+                    m_rpos = m_rend = 0;
+                }
+                return len + delim.size();
+            }
+            searched = avail;
+        }
+        if (avail >= max_size) {
+            return -1;
+        }
+        int rt = fill();
+        if (rt <= 0) {
+            return rt;
+        }
+    }
+}
+
+int SocketStream::write(const void* buffer, size_t length) {
+    if (!isConnected()) {
+        return -1;
+    }
+    if (m_wlen + length <= m_bufferSize) {
+        if (length == 0) {
+            return 0;
+        }
+        if (!m_wbuf) {
+            m_wbuf = BufferPoolMgr::GetInstance()->allocate(m_bufferSize);
+        }
+        memcpy(m_wbuf->data() + m_wlen, buffer, length);
+        m_wlen += length;
+        return length;
+    }
+    return sendv(buffer, length);
+}
+
+int SocketStream::flush() {
+    while (m_wlen > 0) {
+        if (!isConnected()) {
+            return -1;
+        }
+        ++m_sendCalls;
+        int rt = m_socket->send(m_wbuf->data(), m_wlen);
+        if (rt <= 0) {
+            return -1;
+        }
+        consumeWrite(rt);
+    }
+    return 0;
+}
+
+void SocketStream::close() {
+    flush();
+    if (m_socket) {
+        m_socket->close();
+    }
+    m_rbuf.reset();
+    m_rpos = m_rend = 0;
+    m_wbuf.reset();
+    m_wlen = 0;
+}
+
+// 未读的数据挪到缓冲区头部, 再recv一次; 缓冲区满了(一行太长)就换一块大的
+int SocketStream::fill() {
+    if (!m_rbuf) {
+        m_rbuf = BufferPoolMgr::GetInstance()->allocate(m_bufferSize);
+        m_rpos = m_rend = 0;
+    } else if (m_rpos > 0) {
+        memmove(m_rbuf->data(), m_rbuf->data() + m_rpos, m_rend - m_rpos);
+        m_rend -= m_rpos;
+        m_rpos = 0;
+    }
+    if (m_rend == m_rbuf->size()) {
+        Buffer::ptr buf = BufferPoolMgr::GetInstance()->allocate(m_rbuf->size() * 2);
+        memcpy(buf->data(), m_rbuf->data(), m_rend);
+        m_rbuf = buf;
+    }
+    ++m_recvCalls;
+    int rt = m_socket->recv(m_rbuf->data() + m_rend, m_rbuf->size() - m_rend);
+    if (rt > 0) {
+        m_rend += rt;
+    } else if (m_rend == 0) {
+        m_rbuf.reset();
+    }
+    return rt;
+}
+
+// 写缓冲区和新数据用一次writev发出去, 剩下的新数据放得进缓冲区就先攒着
+int SocketStream::sendv(const void* buffer, size_t length) {
+    size_t sent = 0;
+    while (true) {
+        iovec iov[2];
+        size_t count = 0;
+        if (m_wlen > 0) {
+            iov[count].iov_base = m_wbuf->data();
+            iov[count].iov_len = m_wlen;
+            ++count;
+        }
+        iov[count].iov_base = (char*) buffer + sent;
+        iov[count].iov_len = length - sent;
+        ++count;
+
+        ++m_sendCalls;
+        int rt = m_socket->send(iov, count);
+        if (rt <= 0) {
+            return sent ? (int) sent : rt;
+        }
+        size_t len = rt;
+        size_t from_buf = std::min(len, m_wlen);
+        consumeWrite(from_buf);
+        sent += len - from_buf;
+        if (m_wlen == 0 && length - sent <= m_bufferSize) {
+            if (sent < length) {
+                if (!m_wbuf) {
+                    m_wbuf = BufferPoolMgr::GetInstance()->allocate(m_bufferSize);
+                }
+                memcpy(m_wbuf->data(), (const char*) buffer + sent, length - sent);
+                m_wlen = length - sent;
+            }
+            return length;
+        }
+    }
+}
+
+void SocketStream::consumeWrite(size_t length) {
+    if (length >= m_wlen) {
+        m_wlen = 0;
+        m_wbuf.reset();
+        return;
+    }
+    memmove(m_wbuf->data(), m_wbuf->data() + length, m_wlen - length);
+    m_wlen -= length;
+}
+
+}  // CppServer
@@ -0,0 +1,61 @@
+#ifndef __CPPSERVER_SOCKET_STREAM_H__
+#define __CPPSERVER_SOCKET_STREAM_H__
+
+#include <string>
+#include "stream.h"
+#include "socket.h"
+#include "buffer_pool.h"
+
+namespace CppServer {
+
+// 带缓冲的socket流
+// 读: 一次recv尽量读满预读缓冲区, 小的read和按行读都从缓冲区取
+// 写: 小的write先攒在写缓冲区, 满了或者flush时和新数据一起用一次writev发出去
+// 两个缓冲区都从BufferPool取, 数据取空/发完就还回去, 空闲的连接不占缓冲区
+class SocketStream : public Stream {
+public:
+    typedef std::shared_ptr<SocketStream> ptr;
+
+    // owner为true时析构会关闭socket
+    SocketStream(Socket::ptr sock, bool owner = true, size_t buffer_size = 4096);
+    ~SocketStream();
+
+    int read(void* buffer, size_t length) override;
+    int write(const void* buffer, size_t length) override;
+    void close() override;
+
+    // 读到delim为止, line不含delim; 返回消耗的字节数(含delim)
+    // 0为读到分隔符之前对端关闭, -1为出错或者一行超过max_size
+    int readLine(std::string& line, const std::string& delim = "\n", size_t max_size = 64 * 1024);
+    // 把写缓冲区全部发出去, 成功返回0
+    int flush();
+
+    Socket::ptr getSocket() const { return m_socket; }
+    bool isConnected() const;
+    // 预读缓冲区里还没被取走的字节数, 为0时说明对端暂时没有更多数据, 适合flush
+    size_t getReadBuffered() const { return m_rend - m_rpos; }
+    size_t getWriteBuffered() const { return m_wlen; }
+    uint64_t getRecvCalls() const { return m_recvCalls; }
+    uint64_t getSendCalls() const { return m_sendCalls; }
+private:
+    int fill();
+    int sendv(const void* buffer, size_t length);
+    void consumeWrite(size_t length);
+private:
+    Socket::ptr m_socket;
+    bool m_owner;
+    size_t m_bufferSize;
+
+    Buffer::ptr m_rbuf;
+    size_t m_rpos;
+    size_t m_rend;
+    Buffer::ptr m_wbuf;
+    size_t m_wlen;
+
+    uint64_t m_recvCalls;
+    uint64_t m_sendCalls;
+};
+
+}  // CppServer
+
+#endif  // __CPPSERVER_SOCKET_STREAM_H__
@@ -0,0 +1,29 @@
+#include "stream.h"
+
+namespace CppServer {
+
+int Stream::readFixSize(void* buffer, size_t length) {
+    size_t offset = 0;
+    while (offset < length) {
+        int len = read((char*) buffer + offset, length - offset);
+        if (len <= 0) {
+            return len;
+        }
+        offset += len;
+    }
+    return length;
+}
+
+int Stream::writeFixSize(const void* buffer, size_t length) {
+    size_t offset = 0;
+    while (offset < length) {
+        int len = write((const char*) buffer + offset, length - offset);
+        if (len <= 0) {
+            return len;
+        }
+        offset += len;
+    }
+    return length;
+}
+
+}  // CppServer
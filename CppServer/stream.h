@@ -0,0 +1,25 @@
+#ifndef __CPPSERVER_STREAM_H__
+#define __CPPSERVER_STREAM_H__
+
+#include <memory>
+
+namespace CppServer {
+
+// 流接口, read/write语义同recv/send: >0为读写的字节数, 0为对端关闭, <0出错
+class Stream {
+public:
+    typedef std::shared_ptr<Stream> ptr;
+    virtual ~Stream() {}
+
+    virtual int read(void* buffer, size_t length) = 0;
+    virtual int write(const void* buffer, size_t length) = 0;
+    virtual void close() = 0;
+
+    // 读/写满length字节才返回, 成功返回length
+    virtual int readFixSize(void* buffer, size_t length);
+    virtual int writeFixSize(const void* buffer, size_t length);
+};
+
+}  // CppServer
+
+#endif  // __CPPSERVER_STREAM_H__
@@ -0,0 +1,295 @@
+#include "supervisor.h"
+#include "hot_restart.h"
+#include "fd_manager.h"
+#include "iomanager.h"
+#include "config.h"
+#include "hook.h"
+#include "log.h"
+#include "util.h"
+
+#include <algorithm>
+#include <iostream>
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace CppServer {
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_supervisor_workers =
+    CppServer::Config::Lookup("supervisor.workers", (uint32_t) 0, "supervisor worker process count, 0 for cpu count");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_supervisor_worker_threads =
+    CppServer::Config::Lookup("supervisor.worker_threads", (uint32_t) 1, "supervisor iomanager threads per worker");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_supervisor_restart_delay =
+    CppServer::Config::Lookup("supervisor.restart_delay", (uint64_t) 1000, "supervisor delay(ms) before restarting a worker that crashed right after start");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_supervisor_drain_timeout =
+    CppServer::Config::Lookup("supervisor.drain_timeout", (uint64_t) 5000, "supervisor worker drain timeout(ms) on stop, killed after that");
+
+static int s_worker_id = -1;
+// worker里信号处理函数通过管道把信号交给协程处理
+static int s_signal_pipe[2] = {-1, -1};
+
+static void OnWorkerSignal(int sig) {
+    int saved = errno;
+    char c = sig;
+    write_f(s_signal_pipe[1], &c, 1);
+    errno = saved;
+}
+
+int Supervisor::GetWorkerId() {
+    return s_worker_id;
+}
+
+Supervisor::Supervisor(uint32_t workers)
+    : m_restarts(0) {
+    if (!workers) {
+        workers = g_supervisor_workers->getValue();
+    }
+    if (!workers) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? cpus : 1;
+    }
+    m_workers.resize(workers);
+}
+
+bool Supervisor::bind(Address::ptr addr) {
+    std::vector<Address::ptr> addrs;
+    std::vector<Address::ptr> fails;
+    addrs.push_back(addr);
+    return bind(addrs, fails);
+}
+
+bool Supervisor::bind(const std::vector<Address::ptr>& addrs, std::vector<Address::ptr>& fails) {
+    for (auto& addr : addrs) {
+        Socket::ptr sock = Socket::CreateTCP(addr);
+        if (!sock->bind(addr) || !sock->listen()) {
+            CPPSERVER_LOG_ERROR(g_logger) << "supervisor bind fail errno="
+                << errno << " strerror=" << strerror(errno)
+                << " addr=[" << addr->toString() << "]";
+            fails.push_back(addr);
+            continue;
+        }
+        // master里没有开hook, 这里登记并设成非阻塞, fork出的worker直接继承
+        FdMgr::GetInstance()->get(sock->getSocket(), true);
+        m_listeners.push_back(sock);
+    }
+    return fails.empty();
+}
+
+void Supervisor::spawn(int id) {
+    Worker& w = m_workers[id];
+    pid_t pid = fork();
+    if (pid == 0) {
+        runWorker(id);
+        // 不跑master留下的静态析构, 只把日志刷出去
+        std::cout.flush();
+        _exit(0);
+    }
+    if (pid < 0) {
+        CPPSERVER_LOG_ERROR(g_logger) << "supervisor fork worker " << id << " errno="
+            << errno << " strerror=" << strerror(errno);
+        w.respawnTime = GetCurrentMS() + g_supervisor_restart_delay->getValue();
+        return;
+    }
+    w.pid = pid;
+    w.startTime = GetCurrentMS();
+    w.respawnTime = 0;
+    CPPSERVER_LOG_INFO(g_logger) << "supervisor start worker " << id << " pid=" << pid;
+}
+
+// 只等自己的worker, 不影响调用方的其它子进程
+void Supervisor::reap(bool stopping) {
+    uint64_t now = GetCurrentMS();
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        Worker& w = m_workers[i];
+        if (!w.pid) {
+            continue;
+        }
+        int status = 0;
+        if (waitpid(w.pid, &status, WNOHANG) != w.pid) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            CPPSERVER_LOG_ERROR(g_logger) << "supervisor worker " << i << " pid=" << w.pid
+                << " killed by signal " << WTERMSIG(status);
+        } else {
+            CPPSERVER_LOG_INFO(g_logger) << "supervisor worker " << i << " pid=" << w.pid
+                << " exit " << WEXITSTATUS(status);
+        }
+        w.pid = 0;
+        if (stopping) {
+            continue;
+        }
+        // 刚启动就退出的, 延迟一会再拉起, 避免反复崩溃占满CPU
+        uint64_t delay = g_supervisor_restart_delay->getValue();
+        w.respawnTime = now - w.startTime < delay ? now + delay : now;
+        ++m_restarts;
+    }
+}
+
+void Supervisor::reload() {
+    if (!m_configFile.empty()) {
+        try {
+            Config::LoadFromYaml(YAML::LoadFile(m_configFile));
+            CPPSERVER_LOG_INFO(g_logger) << "supervisor reload " << m_configFile;
+        } catch (std::exception& e) {
+            CPPSERVER_LOG_ERROR(g_logger) << "supervisor reload " << m_configFile
+                << " error: " << e.what();
+        }
+    }
+    if (m_reloadCb) {
+        m_reloadCb();
+    }
+}
+
+void Supervisor::signalWorkers(int sig) {
+    for (auto& w : m_workers) {
+        if (w.pid) {
+            kill(w.pid, sig);
+        }
+    }
+}
+
+int Supervisor::run() {
+    if (!m_workerCb || m_listeners.empty()) {
+        CPPSERVER_LOG_ERROR(g_logger) << "supervisor run without worker cb or listeners";
+        return -1;
+    }
+    // master是单线程的, 信号都用sigtimedwait同步处理
+    sigset_t set;
+    sigset_t old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigprocmask(SIG_BLOCK, &set, &old_set);
+
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        spawn(i);
+    }
+
+    bool stopping = false;
+    uint64_t kill_time = 0;
+    while (true) {
+        uint64_t now = GetCurrentMS();
+        uint64_t next = now + 1000;
+        bool alive = false;
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            Worker& w = m_workers[i];
+            if (!w.pid && !stopping) {
+                if (w.respawnTime <= now) {
+                    spawn(i);
+                } else {
+                    next = std::min(next, w.respawnTime);
+                }
+            }
+            alive = alive || w.pid;
+        }
+        if (stopping) {
+            if (!alive) {
+                break;
+            }
+            if (now >= kill_time) {
+                signalWorkers(SIGKILL);
+            }
+        }
+
+        uint64_t wait_ms = next > now ? next - now : 1;
+        timespec ts{(time_t) (wait_ms / 1000), (long) (wait_ms % 1000 * 1000000)};
+        int sig = sigtimedwait(&set, nullptr, &ts);
+        if (sig == SIGCHLD) {
+            reap(stopping);
+        } else if (sig == SIGHUP) {
+            reload();
+            signalWorkers(SIGHUP);
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            if (!stopping) {
+                CPPSERVER_LOG_INFO(g_logger) << "supervisor stopping";
+                stopping = true;
+                kill_time = now + g_supervisor_drain_timeout->getValue() + 1000;
+                signalWorkers(SIGTERM);
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old_set, nullptr);
+    for (auto& sock : m_listeners) {
+        sock->close();
+    }
+    m_listeners.clear();
+    CPPSERVER_LOG_INFO(g_logger) << "supervisor exit, restarts=" << m_restarts;
+    return 0;
+}
+
+void Supervisor::runWorker(int id) {
+    s_worker_id = id;
+    for (auto& sock : m_listeners) {
+        HotRestartMgr::GetInstance()->addInherited(sock);
+    }
+
+    if (pipe2(s_signal_pipe, O_CLOEXEC)) {
+        CPPSERVER_LOG_ERROR(g_logger) << "worker pipe errno=" << errno
+            << " strerror=" << strerror(errno);
+        return;
+    }
+    FdMgr::GetInstance()->get(s_signal_pipe[0], true);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnWorkerSignal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+    signal(SIGCHLD, SIG_DFL);
+    // fork之后还是master屏蔽信号的状态, 处理函数装好之后再放开
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, nullptr);
+
+    {
+        IOManager iom(g_supervisor_worker_threads->getValue(), true, "worker_" + std::to_string(id));
+        iom.schedule([this]() {
+            std::vector<TcpServer::ptr> servers;
+            m_workerCb(servers);
+            // 回调里没有bind的监听socket在worker里关掉, master里的还在
+            HotRestartMgr::GetInstance()->closeUnclaimed();
+            waitSignal(servers);
+        });
+    }
+}
+
+void Supervisor::waitSignal(std::vector<TcpServer::ptr>& servers) {
+    while (true) {
+        char sig = 0;
+        if (read(s_signal_pipe[0], &sig, 1) != 1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (sig == SIGHUP) {
+            reload();
+            continue;
+        }
+        break;
+    }
+
+    for (auto& server : servers) {
+        server->stop();
+    }
+    uint64_t deadline = GetCurrentMS() + g_supervisor_drain_timeout->getValue();
+    for (auto& server : servers) {
+        uint64_t now = GetCurrentMS();
+        server->drain(deadline > now ? deadline - now : 0);
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "worker " << s_worker_id << " pid=" << getpid() << " exit";
+}
+
+}  // CppServer
@@ -0,0 +1,69 @@
+#ifndef __CPPSERVER_SUPERVISOR_H__
+#define __CPPSERVER_SUPERVISOR_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <sys/types.h>
+#include "tcp_server.h"
+#include "noncopyable.h"
+
+namespace CppServer {
+
+// 多进程模式(master/worker): master只负责bind监听socket、fork worker、拉起崩溃的worker、转发信号
+// 每个worker跑自己的IOManager, worker之间不共享任何内存, 一个worker崩溃不影响其它worker
+// SIGHUP: 每个进程重新加载配置文件并调用reload回调; SIGTERM/SIGINT: worker停止accept并drain后退出
+class Supervisor : Noncopyable {
+public:
+    // 在worker的协程里调用, 创建并启动TcpServer, 放进servers由Supervisor负责停止
+    // TcpServer::bind会直接用master已经监听的同地址socket
+    typedef std::function<void(std::vector<TcpServer::ptr>& servers)> WorkerCb;
+    typedef std::function<void()> ReloadCb;
+
+    // workers为0时用配置supervisor.workers, 再为0用CPU核数
+    Supervisor(uint32_t workers = 0);
+
+    // 在master里bind+listen, 要在run之前调用
+    bool bind(Address::ptr addr);
+    bool bind(const std::vector<Address::ptr>& addrs, std::vector<Address::ptr>& fails);
+
+    void setWorkerCb(WorkerCb cb) { m_workerCb = cb; }
+    void setReloadCb(ReloadCb cb) { m_reloadCb = cb; }
+    // SIGHUP时重新加载的YAML配置文件, 为空只调用reload回调
+    void setConfigFile(const std::string& v) { m_configFile = v; }
+
+    // master: fork并监督worker, 收到SIGTERM/SIGINT且worker全部退出后返回0
+    // worker: 不返回, 退出时直接_exit
+    int run();
+
+    uint32_t getWorkerCount() const { return m_workers.size(); }
+    uint64_t getRestarts() const { return m_restarts; }
+
+    // 当前进程的worker编号, master为-1
+    static int GetWorkerId();
+private:
+    struct Worker {
+        pid_t pid = 0;
+        uint64_t startTime = 0;
+        uint64_t respawnTime = 0;
+    };
+
+    void spawn(int id);
+    void reap(bool stopping);
+    void reload();
+    void signalWorkers(int sig);
+    void runWorker(int id);
+    void waitSignal(std::vector<TcpServer::ptr>& servers);
+private:
+    std::vector<Socket::ptr> m_listeners;
+    std::vector<Worker> m_workers;
+    WorkerCb m_workerCb;
+    ReloadCb m_reloadCb;
+    std::string m_configFile;
+    uint64_t m_restarts;
+};
+
+}  // CppServer
+
+#endif  // __CPPSERVER_SUPERVISOR_H__
@@ -1,6 +1,14 @@
 #include "tcp_server.h"
 #include "config.h"
 #include "log.h"
+#include "util.h"
+#include "hot_restart.h"
+#include "hook.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 
 namespace CppServer {
@@ -8,14 +16,76 @@ namespace CppServer {
 static CppServer::ConfigVar<uint64_t>::ptr g_tcp_server_read_timeout = 
     CppServer::Config::Lookup("tcp_server.read_timeout", (uint64_t) (60 * 1000 * 2) /* 2min */, "tcp server read timeout");
 
+static CppServer::ConfigVar<uint32_t>::ptr g_tcp_server_busy_poll =
+    CppServer::Config::Lookup("tcp_server.busy_poll_us", (uint32_t) 0, "tcp server busy poll usecs, 0 for off");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_tcp_server_busy_poll_budget =
+    CppServer::Config::Lookup("tcp_server.busy_poll_budget", (uint32_t) 0, "tcp server busy poll budget, 0 for kernel default");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_tcp_server_max_connections =
+    CppServer::Config::Lookup("tcp_server.max_connections", (uint32_t) 0, "tcp server max concurrent connections, 0 for unlimited");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_tcp_server_max_accept_rate =
+    CppServer::Config::Lookup("tcp_server.max_accept_rate", (uint32_t) 0, "tcp server max accepted connections per second, 0 for unlimited");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_tcp_server_max_per_ip =
+    CppServer::Config::Lookup("tcp_server.max_connections_per_ip", (uint32_t) 0, "tcp server max concurrent connections per remote ip, 0 for unlimited");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_tcp_server_accept_batch =
+    CppServer::Config::Lookup("tcp_server.accept_batch", (uint32_t) 64, "tcp server max connections accepted per readiness event");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_tcp_server_idle_timeout =
+    CppServer::Config::Lookup("tcp_server.idle_timeout", (uint64_t) 0, "tcp server idle connection timeout(ms), 0 for off");
+
+static CppServer::ConfigVar<uint64_t>::ptr g_tcp_server_idle_sweep =
+    CppServer::Config::Lookup("tcp_server.idle_sweep_interval", (uint64_t) 1000, "tcp server connection sweep interval(ms), for idle reaping and affinity rebalance");
+
+static CppServer::ConfigVar<std::string>::ptr g_tcp_server_affinity =
+    CppServer::Config::Lookup("tcp_server.affinity", std::string("none"), "tcp server connection thread affinity: none, least_load, incoming_cpu");
+
+static CppServer::ConfigVar<uint32_t>::ptr g_tcp_server_migrate_threshold =
+    CppServer::Config::Lookup("tcp_server.affinity_migrate_threshold", (uint32_t) 50, "tcp server migrate pinned connections when a thread exceeds the average load by this percent");
+
 static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_NAME("system");
 
+static CppServer::ConfigVar<bool>::ptr g_tcp_server_overload_shed =
+    CppServer::Config::Lookup("tcp_server.overload_shed", false, "tcp server fast-fail new connections while the worker is overloaded");
+
+static TcpServer::Affinity ParseAffinity(const std::string& v) {
+    if (v == "least_load") {
+        return TcpServer::AFFINITY_LEAST_LOAD;
+    }
+    if (v == "incoming_cpu") {
+        return TcpServer::AFFINITY_INCOMING_CPU;
+    }
+    return TcpServer::AFFINITY_NONE;
+}
+
 TcpServer::TcpServer(CppServer::IOManager* worker, CppServer::IOManager* accept_worker)
     : m_worker(worker)
     , m_acceptWorker(accept_worker)
     , m_recvTimeout(g_tcp_server_read_timeout->getValue())
+    , m_busyPollUs(g_tcp_server_busy_poll->getValue())
+    , m_busyPollBudget(g_tcp_server_busy_poll_budget->getValue())
+    , m_workerBusyPoll(false)
     , m_name("CppServer/1.0.0")
-    , m_isStop(true) {
+    , m_isStop(true)
+    , m_maxConnections(g_tcp_server_max_connections->getValue())
+    , m_maxAcceptRate(g_tcp_server_max_accept_rate->getValue())
+    , m_maxPerIp(g_tcp_server_max_per_ip->getValue())
+    , m_acceptBatch(std::max(g_tcp_server_accept_batch->getValue(), (uint32_t) 1))
+    , m_tokens(0)
+    , m_lastRefill(0)
+    , m_connections(0)
+    , m_accepted(0)
+    , m_rejected(0)
+    , m_idleTimeout(g_tcp_server_idle_timeout->getValue())
+    , m_reaped(0)
+    , m_affinity(ParseAffinity(g_tcp_server_affinity->getValue()))
+    , m_migrateThreshold(g_tcp_server_migrate_threshold->getValue())
+    , m_migrations(0)
+    , m_overloadShed(g_tcp_server_overload_shed->getValue())
+    , m_shed(0) {
 }
 
 TcpServer::~TcpServer() {
@@ -35,7 +105,13 @@ bool TcpServer::bind(CppServer::Address::ptr addr) {
 bool TcpServer::bind(const std::vector<Address::ptr>& addrs,
                         std::vector<Address::ptr>& fails) {
     for (auto& addr : addrs) {
-        Socket::ptr sock = Socket::CreateTCP(addr);
+        // 热重启时从旧进程继承来的监听socket, 已经bind+listen过
+        Socket::ptr sock = HotRestartMgr::GetInstance()->takeListener(addr);
+        if (sock) {
+            m_socks.push_back(sock);
+            continue;
+        }
+        sock = Socket::CreateTCP(addr);
         if (!sock->bind(addr)) {
             CPPSERVER_LOG_ERROR(g_logger) << "bind fail errno="
                 << errno << " strerror=" << strerror(errno)
@@ -50,6 +126,9 @@ bool TcpServer::bind(const std::vector<Address::ptr>& addrs,
             fails.push_back(addr);
             continue;
         }
+        if (m_busyPollUs) {
+            sock->setBusyPoll(m_busyPollUs, m_busyPollBudget);
+        }
         m_socks.push_back(sock);
     }
 
@@ -64,16 +143,356 @@ bool TcpServer::bind(const std::vector<Address::ptr>& addrs,
     return true;
 }
 
+// 远端IP的原始字节, 不做字符串格式化
+static std::string IpKey(const Address::ptr& addr) {
+    if (!addr) {
+        return "";
+    }
+    if (addr->getFamily() == AF_INET) {
+        const sockaddr_in* in = (const sockaddr_in*) addr->getAddr();
+        return std::string((const char*) &in->sin_addr, sizeof(in->sin_addr));
+    }
+    if (addr->getFamily() == AF_INET6) {
+        const sockaddr_in6* in6 = (const sockaddr_in6*) addr->getAddr();
+        return std::string((const char*) &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    return "";
+}
+
+bool TcpServer::admit(const Socket::ptr& client, std::string& key) {
+    // 多个accept协程可能同时检查, 先原子地占住一个名额, 后面的检查不通过再退回
+    uint64_t conns = m_connections;
+    do {
+        if (m_maxConnections && conns >= m_maxConnections) {
+            return false;
+        }
+    } while (!m_connections.compare_exchange_weak(conns, conns + 1));
+    if (m_maxPerIp) {
+        key = IpKey(client->getRemoteAddress());
+    }
+
+    MutexType::Lock lock(m_mutex);
+    if (m_maxAcceptRate) {
+        uint64_t now = GetCurrentMS();
+        if (m_lastRefill == 0) {
+            m_tokens = m_maxAcceptRate;
+        } else if (now > m_lastRefill) {
+            m_tokens = std::min((double) m_maxAcceptRate,
+                                m_tokens + (now - m_lastRefill) * m_maxAcceptRate / 1000.0);
+        }
+        m_lastRefill = now;
+        if (m_tokens < 1) {
+            if (--m_connections == 0) {
+                notifyDrain();
+            }
+            return false;
+        }
+    }
+    if (!key.empty()) {
+        uint32_t& count = m_perIp[key];
+        if (count >= m_maxPerIp) {
+            if (--m_connections == 0) {
+                notifyDrain();
+            }
+            return false;
+        }
+        ++count;
+    }
+    if (m_maxAcceptRate) {
+        m_tokens -= 1;
+    }
+    return true;
+}
+
+void TcpServer::release(const std::string& key) {
+    bool last = --m_connections == 0;
+    if (key.empty() && !last) {
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    if (!key.empty()) {
+        auto it = m_perIp.find(key);
+        if (it != m_perIp.end() && --it->second == 0) {
+            m_perIp.erase(it);
+        }
+    }
+    if (last) {
+        notifyDrain();
+    }
+}
+
+void TcpServer::notifyDrain() {
+    std::vector<std::function<void()> > waiters;
+    waiters.swap(m_drainWaiters);
+    for (auto& i : waiters) {
+        i();
+    }
+}
+
+TcpServer::ClientShard& TcpServer::getShard(const Socket::ptr& client) {
+    // 对象至少按16字节对齐, 去掉低位再取模
+    return m_clients[((uintptr_t) client.get() >> 4) % CLIENT_SHARDS];
+}
+
+void TcpServer::runClient(Socket::ptr client, const std::string& key, int thread) {
+    ClientShard& shard = getShard(client);
+    {
+        MutexType::Lock lock(shard.mutex);
+        ClientCtx& ctx = shard.clients[client];
+        if (thread != -1) {
+            ctx.fiber = Fiber::GetThis();
+            ctx.thread = thread;
+        }
+    }
+    handleClient(client);
+    {
+        MutexType::Lock lock(shard.mutex);
+        auto it = shard.clients.find(client);
+        // 可能已经被迁移过, 以登记的线程为准
+        thread = it->second.thread;
+        shard.clients.erase(it);
+    }
+    if (thread != -1) {
+        MutexType::Lock lock(m_mutex);
+        --m_threadLoad[thread];
+    }
+    release(key);
+}
+
+std::vector<int> TcpServer::getAffinityThreads() {
+    std::vector<int> threads = m_worker->getThreadIds();
+    if (threads.size() > 1) {
+        threads.erase(std::remove(threads.begin(), threads.end(), m_worker->getRootThread()),
+                      threads.end());
+    }
+    return threads;
+}
+
+int TcpServer::pickThread(const Socket::ptr& client, const std::vector<int>& threads) {
+    if (threads.empty()) {
+        return -1;
+    }
+    int thread = -1;
+    if (m_affinity == AFFINITY_INCOMING_CPU) {
+        // 线程没有绑核, 按CPU号取模, 同一个CPU收到的连接落在同一个线程
+        int cpu = -1;
+        if (client->getOption(SOL_SOCKET, SO_INCOMING_CPU, cpu) && cpu >= 0) {
+            thread = threads[cpu % threads.size()];
+        }
+    }
+    MutexType::Lock lock(m_mutex);
+    if (thread == -1) {
+        uint32_t min_load = UINT32_MAX;
+        for (auto& id : threads) {
+            uint32_t load = m_threadLoad[id];
+            if (load < min_load) {
+                min_load = load;
+                thread = id;
+            }
+        }
+    }
+    ++m_threadLoad[thread];
+    return thread;
+}
+
+// 负载最高的线程超过平均值的threshold%时, 把连接挪到负载最低的线程; 退役线程上的连接全部挪走
+void TcpServer::rebalance() {
+    if (m_affinity == AFFINITY_NONE) {
+        return;
+    }
+    std::vector<int> threads = getAffinityThreads();
+    if (threads.empty()) {
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    // 先只看每个线程的计数, 已经均衡并且退役线程上没有连接时不用遍历连接
+    bool has_retired = false;
+    uint64_t total = 0;
+    uint32_t max_load = 0;
+    uint32_t min_load = UINT32_MAX;
+    for (auto it = m_threadLoad.begin(); it != m_threadLoad.end();) {
+        total += it->second;
+        if (std::find(threads.begin(), threads.end(), it->first) != threads.end()) {
+            ++it;
+        } else if (it->second > 0) {
+            has_retired = true;
+            ++it;
+        } else {
+            it = m_threadLoad.erase(it);  // 已经挪空的退役线程
+        }
+    }
+    for (auto& id : threads) {
+        auto it = m_threadLoad.find(id);
+        uint32_t load = it == m_threadLoad.end() ? 0 : it->second;
+        max_load = std::max(max_load, load);
+        min_load = std::min(min_load, load);
+    }
+    uint64_t limit = total * (100 + m_migrateThreshold) / (100 * threads.size());
+    if (!has_retired && (max_load <= limit || max_load < min_load + 2)) {
+        return;
+    }
+
+    std::unordered_map<int, std::vector<Socket::ptr> > pinned;
+    for (auto& shard : m_clients) {
+        MutexType::Lock shard_lock(shard.mutex);
+        for (auto& i : shard.clients) {
+            if (i.second.thread != -1) {
+                pinned[i.second.thread].push_back(i.first);
+            }
+        }
+    }
+    // 先建好目标线程的项, 下面遍历pinned时往里加不会rehash
+    for (auto& id : threads) {
+        pinned[id];
+    }
+    auto move = [&](int from, int to) {
+        Socket::ptr client = pinned[from].back();
+        pinned[from].pop_back();
+        ClientShard& shard = getShard(client);
+        MutexType::Lock shard_lock(shard.mutex);
+        auto it = shard.clients.find(client);
+        // 已经结束的连接, 负载由runClient扣掉
+        if (it == shard.clients.end() || it->second.thread != from) {
+            return;
+        }
+        pinned[to].push_back(client);
+        it->second.fiber->setAffinity(to);
+        it->second.thread = to;
+        --m_threadLoad[from];
+        ++m_threadLoad[to];
+        ++m_migrations;
+    };
+    auto least = [&]() {
+        int thread = threads[0];
+        for (auto& id : threads) {
+            if (m_threadLoad[id] < m_threadLoad[thread]) {
+                thread = id;
+            }
+        }
+        return thread;
+    };
+
+    for (auto& i : pinned) {
+        if (std::find(threads.begin(), threads.end(), i.first) == threads.end()) {
+            while (!i.second.empty()) {
+                move(i.first, least());
+            }
+        }
+    }
+    while (true) {
+        int max_thread = threads[0];
+        for (auto& id : threads) {
+            if (m_threadLoad[id] > m_threadLoad[max_thread]) {
+                max_thread = id;
+            }
+        }
+        int min_thread = least();
+        if (m_threadLoad[max_thread] <= limit
+                || m_threadLoad[max_thread] < m_threadLoad[min_thread] + 2
+                || pinned[max_thread].empty()) {
+            break;
+        }
+        move(max_thread, min_thread);
+    }
+}
+
+void TcpServer::onSweep() {
+    reapIdle();
+    rebalance();
+}
+
+// 一个定时器扫所有连接, 不给每次读写挂定时器
+void TcpServer::reapIdle() {
+    uint64_t timeout = m_idleTimeout;
+    if (!timeout) {
+        return;
+    }
+    uint64_t now = GetCoarseMS();
+    std::vector<Socket::ptr> idles;
+    for (auto& shard : m_clients) {
+        MutexType::Lock lock(shard.mutex);
+        for (auto& i : shard.clients) {
+            if (i.first->getLastActive() + timeout <= now) {
+                idles.push_back(i.first);
+            }
+        }
+    }
+    for (auto& client : idles) {
+        // 唤醒阻塞在recv上的协程, 由它自己收尾
+        if (client->shutdown()) {
+            ++m_reaped;
+            CPPSERVER_LOG_DEBUG(g_logger) << "reap idle connection " << *client;
+        }
+    }
+}
+
+// 直接RST, 不进TIME_WAIT, 也不占worker
+static void ResetClose(const Socket::ptr& client) {
+    linger lg{1, 0};
+    client->setOption(SOL_SOCKET, SO_LINGER, lg);
+    client->close();
+}
+
+void TcpServer::handleOverload(Socket::ptr client) {
+    ResetClose(client);
+}
+
 void TcpServer::startAccept(Socket::ptr sock) {
+    std::vector<Socket::ptr> clients;
+    std::vector<std::function<void()> > tasks;
+    std::vector<Fiber::ptr> fibers;
     while (!m_isStop) {
-        Socket::ptr client = sock->accept();
-        if (client) {
-            client->setRecvTimeout(m_recvTimeout);
-            m_worker->schedule(std::bind(&TcpServer::handleClient, 
-                shared_from_this(), client));
-        } else {
+        clients.clear();
+        if (sock->acceptBatch(clients, m_acceptBatch) == 0) {
+            if (m_isStop) {
+                break;
+            }
             CPPSERVER_LOG_ERROR(g_logger) << "accept errno=" << errno
                 << " strerror=" << strerror(errno);
+            continue;
+        }
+        tasks.clear();
+        fibers.clear();
+        std::vector<int> threads;
+        if (m_affinity != AFFINITY_NONE) {
+            threads = getAffinityThreads();
+        }
+        // 每批只看一次, 过载时整批快速失败, 不再往worker的队列里压任务
+        bool shed = m_overloadShed && isOverloaded();
+        for (auto& client : clients) {
+            if (shed) {
+                ++m_shed;
+                handleOverload(client);
+                continue;
+            }
+            std::string key;
+            if (!admit(client, key)) {
+                ++m_rejected;
+                ResetClose(client);
+                continue;
+            }
+            ++m_accepted;
+            client->setRecvTimeout(m_recvTimeout);
+            if (m_busyPollUs) {
+                client->setBusyPoll(m_busyPollUs, m_busyPollBudget);
+            }
+            if (m_affinity == AFFINITY_NONE) {
+                tasks.push_back(std::bind(&TcpServer::runClient,
+                    shared_from_this(), client, key, -1));
+                continue;
+            }
+            // 固定线程的连接用独立的协程, 之后每次唤醒都回到这个线程
+            int thread = pickThread(client, threads);
+            Fiber::ptr fiber(new Fiber(std::bind(&TcpServer::runClient,
+                shared_from_this(), client, key, thread)));
+            fiber->setAffinity(thread);
+            fibers.push_back(fiber);
+        }
+        if (!tasks.empty()) {
+            m_worker->schedule(tasks.begin(), tasks.end());
+        }
+        if (!fibers.empty()) {
+            m_worker->schedule(fibers.begin(), fibers.end());
         }
     }
 }
@@ -83,15 +502,19 @@ bool TcpServer::start() {
         return true;
     }
     m_isStop = false;
+    applyWorkerBusyPoll(m_busyPollUs);
     for (auto& sock : m_socks) {
         m_acceptWorker->schedule(std::bind(&TcpServer::startAccept,
                     shared_from_this(), sock));
     }
+    updateSweepTimer();
     return true;
 }
 
 void TcpServer::stop() {
     m_isStop = true;
+    applyWorkerBusyPoll(0);
+    updateSweepTimer();
     auto self = shared_from_this();
     m_acceptWorker->schedule([this, self]() {
         for (auto& sock : m_socks) {
@@ -102,6 +525,98 @@ void TcpServer::stop() {
     });
 }
 
+void TcpServer::setIdleTimeout(uint64_t v) {
+    m_idleTimeout = v;
+    updateSweepTimer();
+}
+
+void TcpServer::setAffinity(Affinity v) {
+    m_affinity = v;
+    updateSweepTimer();
+}
+
+void TcpServer::updateSweepTimer() {
+    // setIdleTimeout/setAffinity/stop可能在不同线程同时调用, m_sweepTimer的检查和替换要在同一把锁里
+    MutexType::Lock lock(m_mutex);
+    bool need = !m_isStop && (m_idleTimeout || m_affinity != AFFINITY_NONE);
+    if (need && !m_sweepTimer) {
+        // 定时器不持有server, server析构后自动失效
+        m_sweepTimer = m_worker->addConditionTimer(g_tcp_server_idle_sweep->getValue(),
+                std::bind(&TcpServer::onSweep, this), shared_from_this(), true);
+    } else if (!need && m_sweepTimer) {
+        m_sweepTimer->cancel();
+        m_sweepTimer = nullptr;
+    }
+}
+
+void TcpServer::setBusyPoll(uint32_t us, uint32_t budget) {
+    m_busyPollUs = us;
+    m_busyPollBudget = budget;
+    if (!m_isStop) {
+        applyWorkerBusyPoll(us);
+    }
+}
+
+void TcpServer::applyWorkerBusyPoll(uint32_t us) {
+    if (us) {
+        m_workerBusyPoll = m_worker->setBusyPoll(us, m_busyPollBudget) || m_workerBusyPoll;
+    } else if (m_workerBusyPoll) {
+        // 只清除自己开的, worker可能是别人配置的IOManager
+        m_worker->setBusyPoll(0);
+        m_workerBusyPoll = false;
+    }
+}
+
+bool TcpServer::drain(uint64_t timeout_ms) {
+    if (!m_isStop) {
+        stop();
+    }
+    // 连接数归零时由release唤醒, 不再轮询
+    IOManager* iom = IOManager::GetThis();
+    if (iom && is_hook_enable()) {
+        // 在协程里: 归零和超时谁先到谁调度, 只调度一次
+        Fiber::ptr fiber = Fiber::GetThis();
+        std::shared_ptr<std::atomic<bool> > woken(new std::atomic<bool>(false));
+        auto wake = [iom, fiber, woken]() {
+            if (!woken->exchange(true)) {
+                iom->schedule(fiber);
+            }
+        };
+        {
+            MutexType::Lock lock(m_mutex);
+            if (m_connections == 0) {
+                return true;
+            }
+            m_drainWaiters.push_back(wake);
+        }
+        Timer::ptr timer = iom->addTimer(timeout_ms, wake);
+        Fiber::YieldToHold();
+        timer->cancel();
+    } else {
+        struct Notify {
+            std::mutex mutex;
+            std::condition_variable cond;
+            bool done = false;
+        };
+        std::shared_ptr<Notify> notify(new Notify);
+        {
+            MutexType::Lock lock(m_mutex);
+            if (m_connections == 0) {
+                return true;
+            }
+            m_drainWaiters.push_back([notify]() {
+                std::lock_guard<std::mutex> lock(notify->mutex);
+                notify->done = true;
+                notify->cond.notify_all();
+            });
+        }
+        std::unique_lock<std::mutex> lock(notify->mutex);
+        notify->cond.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                              [notify]() { return notify->done; });
+    }
+    return m_connections == 0;
+}
+
 void TcpServer::handleClient(Socket::ptr client) {
     CPPSERVER_LOG_INFO(g_logger) << " handleClient: " << *client;
 }
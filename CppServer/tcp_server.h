@@ -3,6 +3,8 @@
 
 #include <memory>
 #include <functional>
+#include <atomic>
+#include <unordered_map>
 #include "iomanager.h"
 #include "address.h"
 #include "socket.h"
@@ -14,6 +16,13 @@ class TcpServer : public std::enable_shared_from_this<TcpServer>
                     , Noncopyable {
 public:
     typedef std::shared_ptr<TcpServer> ptr;
+
+    // 连接和worker线程的亲和
+    enum Affinity {
+        AFFINITY_NONE = 0,          // 每次唤醒都可能换线程
+        AFFINITY_LEAST_LOAD = 1,    // 固定在连接数最少的线程
+        AFFINITY_INCOMING_CPU = 2   // 按SO_INCOMING_CPU(网卡中断所在的CPU)选线程
+    };
     TcpServer(CppServer::IOManager* worker = CppServer::IOManager::GetThis(),
               CppServer::IOManager* accept_worker = CppServer::IOManager::GetThis());
     virtual ~TcpServer();
@@ -23,23 +32,130 @@ public:
                          std::vector<Address::ptr>& fails);
     virtual bool start();
     virtual void stop();
+    // 停止accept, 等正在处理的连接结束, 最多等timeout_ms; 全部结束返回true
+    bool drain(uint64_t timeout_ms);
+
+    const std::vector<Socket::ptr>& getSocks() const { return m_socks; }
 
     uint64_t getRecvTimeout() const { return m_recvTimeout; }
     std::string getName() const { return m_name; }
     void setRecvTimeout(uint64_t v) { m_recvTimeout = v; }
     void setName(const std::string& v) { m_name = v; }
 
+    // 低延迟配置: 监听/连接socket开SO_BUSY_POLL, worker的epoll开busy poll, us=0关闭
+    // 运行中修改立即作用于worker的epoll, socket上的在下次bind/accept时生效
+    uint32_t getBusyPoll() const { return m_busyPollUs; }
+    void setBusyPoll(uint32_t us, uint32_t budget = 0);
+
+    // 准入控制, 0为不限制; 超出限制的连接accept之后立即RST关闭
+    // 连接数在handleClient返回时释放, 子类不要把连接交给别的协程后提前返回
+    uint32_t getMaxConnections() const { return m_maxConnections; }
+    uint32_t getMaxAcceptRate() const { return m_maxAcceptRate; }
+    uint32_t getMaxConnectionsPerIp() const { return m_maxPerIp; }
+    uint32_t getAcceptBatch() const { return m_acceptBatch; }
+    void setMaxConnections(uint32_t v) { m_maxConnections = v; }
+    void setMaxAcceptRate(uint32_t v) { m_maxAcceptRate = v; }
+    void setMaxConnectionsPerIp(uint32_t v) { m_maxPerIp = v; }
+    void setAcceptBatch(uint32_t v) { m_acceptBatch = v ? v : 1; }
+
+    // 空闲回收: 超过idleTimeout毫秒没有收发的连接被shutdown, 由处理它的协程读到EOF后自己关闭; 0为关闭
+    uint64_t getIdleTimeout() const { return m_idleTimeout; }
+    void setIdleTimeout(uint64_t v);
+
+    // 固定之后只有线程间连接数差超过平均值的threshold%才迁移, 在idle_sweep_interval的定时器里检查
+    // 空闲回收和亲和都关闭时不启动扫描定时器
+    Affinity getAffinity() const { return m_affinity; }
+    void setAffinity(Affinity v);
+    uint32_t getMigrateThreshold() const { return m_migrateThreshold; }
+    void setMigrateThreshold(uint32_t v) { m_migrateThreshold = v; }
+
+    // 过载保护: worker调度器排队时间持续超标时(见Scheduler::isOverloaded), 新连接交给handleOverload快速失败
+    // 已建立连接上的请求可以在handleClient里用isOverloaded()自行判断是否快速失败
+    bool getOverloadShed() const { return m_overloadShed; }
+    void setOverloadShed(bool v) { m_overloadShed = v; }
+    bool isOverloaded() const { return m_worker->isOverloaded(); }
+
+    uint64_t getConnections() const { return m_connections; }
+    uint64_t getAccepted() const { return m_accepted; }
+    uint64_t getRejected() const { return m_rejected; }
+    uint64_t getReaped() const { return m_reaped; }
+    uint64_t getMigrations() const { return m_migrations; }
+    uint64_t getShed() const { return m_shed; }
+
     bool isStop() const { return m_isStop; }
 protected:
     virtual void handleClient(Socket::ptr client);
     virtual void startAccept(Socket::ptr sock);
+    // 过载时被拒绝的新连接, 在accept协程里调用, 不能阻塞; 默认直接RST, 子类可以先回一个"服务繁忙"再关闭
+    virtual void handleOverload(Socket::ptr client);
 private:
+    // 通过准入检查返回true并占用名额, key为远端IP(非IP地址为空)
+    bool admit(const Socket::ptr& client, std::string& key);
+    void release(const std::string& key);
+    // 连接数归零, 唤醒drain里等待的调用方, 需持有m_mutex
+    void notifyDrain();
+    void runClient(Socket::ptr client, const std::string& key, int thread);
+    void onSweep();
+    // 按当前配置启动或取消扫描定时器, m_sweepTimer由m_mutex保护
+    void updateSweepTimer();
+    void reapIdle();
+    // 可以固定连接的线程: use_caller的线程平时不跑调度, 有其它线程时不用它
+    std::vector<int> getAffinityThreads();
+    int pickThread(const Socket::ptr& client, const std::vector<int>& threads);
+    void rebalance();
+    // 按m_busyPollUs设置或清除worker的epoll busy poll
+    void applyWorkerBusyPoll(uint32_t us);
+private:
+    typedef Spinlock MutexType;
     std::vector<Socket::ptr> m_socks;
     IOManager* m_worker;
     IOManager* m_acceptWorker;
     uint64_t m_recvTimeout;
+    uint32_t m_busyPollUs;
+    uint32_t m_busyPollBudget;
+    bool m_workerBusyPoll;      // 本server在worker的epoll上开了busy poll
     std::string m_name;
     bool m_isStop;
+
+    uint32_t m_maxConnections;
+    uint32_t m_maxAcceptRate;
+    uint32_t m_maxPerIp;
+    uint32_t m_acceptBatch;
+
+    MutexType m_mutex;
+    std::unordered_map<std::string, uint32_t> m_perIp;
+    double m_tokens;            // 接受速率的令牌桶, 桶容量为一秒的量
+    uint64_t m_lastRefill;
+    std::atomic<uint64_t> m_connections;
+    std::atomic<uint64_t> m_accepted;
+    std::atomic<uint64_t> m_rejected;
+    std::vector<std::function<void()> > m_drainWaiters;    // 等连接数归零的drain, 由m_mutex保护
+
+    struct ClientCtx {
+        Fiber::ptr fiber;       // 固定了线程的连接协程
+        int thread = -1;
+    };
+    // 正在handleClient里的连接, 按socket分片, 扫描时一次只锁一片, 不和accept抢m_mutex
+    // 同时要锁m_mutex时先锁m_mutex
+    static const size_t CLIENT_SHARDS = 16;
+    struct ClientShard {
+        MutexType mutex;
+        std::unordered_map<Socket::ptr, ClientCtx> clients;
+    };
+    ClientShard& getShard(const Socket::ptr& client);
+
+    uint64_t m_idleTimeout;
+    ClientShard m_clients[CLIENT_SHARDS];
+    Timer::ptr m_sweepTimer;
+    std::atomic<uint64_t> m_reaped;
+
+    Affinity m_affinity;
+    uint32_t m_migrateThreshold;
+    std::unordered_map<int, uint32_t> m_threadLoad;     // 每个线程固定的连接数
+    std::atomic<uint64_t> m_migrations;
+
+    bool m_overloadShed;
+    std::atomic<uint64_t> m_shed;
 };
 
 
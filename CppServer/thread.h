@@ -6,6 +6,7 @@
 #define __CPPSERVER_THREAD_H__
 
 #include <thread>
+#include <string>
 #include <functional>
 #include <memory>
 #include <pthread.h>
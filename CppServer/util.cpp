@@ -1,5 +1,6 @@
 #include "util.h"
 #include <execinfo.h>
+#include <time.h>
 
 #include "log.h"
 #include "fiber.h"
@@ -51,11 +52,23 @@ uint64_t GetCurrentMS() {
     return tv.tv_sec * 1000ul + tv.tv_usec / 1000;
 }
 
-uint64_t GetCurrentU() {
+uint64_t GetCurrentUS() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
     return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
 }
 
+uint64_t GetCoarseMS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
+}
+
+uint64_t GetMonotonicUS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+}
+
 
 }  // CppServer
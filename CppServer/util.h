@@ -24,6 +24,10 @@ std::string BacktraceToString(int size = 64, int skip = 2, const std::string& pr
 // Time
 uint64_t GetCurrentMS();
 uint64_t GetCurrentUS();
+// 单调时钟, 精度为一个tick(几毫秒), 比gettimeofday便宜, 适合在IO路径上打时间戳
+uint64_t GetCoarseMS();
+// 单调时钟, 微秒精度
+uint64_t GetMonotonicUS();
 
 }  // CppServer
 
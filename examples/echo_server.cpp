@@ -1,8 +1,7 @@
 #include "CppServer/tcp_server.h"
+#include "CppServer/socket_stream.h"
 #include "CppServer/log.h"
 
-#include <sys/uio.h>
-
 static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
 
 class EchoServer : public CppServer::TcpServer {
@@ -20,10 +19,12 @@ EchoServer::EchoServer(int type)
 
 void EchoServer::handleClient(CppServer::Socket::ptr client) {
     CPPSERVER_LOG_INFO(g_logger) << "handleClient " << *client;
-    std::string buffer;
+    // 按行回显; 行比读缓冲区小, 一次recv读进来的多行都从缓冲区里取
+    // 客户端连续发来的行攒到读缓冲区空了再一起发回去
+    CppServer::SocketStream stream(client, false);
+    std::string line;
     while (true) {
-        buffer.resize(4096);
-        int rt = client->recv(&buffer[0], buffer.size());
+        int rt = stream.readLine(line);
         if (rt == 0) {
             CPPSERVER_LOG_INFO(g_logger) << "client close: " << *client;
             break;
@@ -32,15 +33,16 @@ void EchoServer::handleClient(CppServer::Socket::ptr client) {
                 << " errno=" << errno << " errstr=" << strerror(errno);
             break;
         }
-        if (rt > 4096) {
-            CPPSERVER_LOG_ERROR(g_logger) << "Received too much";
-            break;
-        }
-        buffer.resize(rt);
 
         if (m_type == 1) {
-            CPPSERVER_LOG_INFO(g_logger) << buffer;
-            client->send(&buffer[0], buffer.size());
+            CPPSERVER_LOG_INFO(g_logger) << line;
+            line.push_back('\n');
+            if (stream.writeFixSize(line.c_str(), line.size()) < 0) {
+                break;
+            }
+            if (stream.getReadBuffered() == 0 && stream.flush()) {
+                break;
+            }
         } else {
             CPPSERVER_LOG_INFO(g_logger) << "Don't support binary type";
         }
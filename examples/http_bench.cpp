@@ -0,0 +1,124 @@
+#include "CppServer/http/http_server.h"
+#include "CppServer/socket_stream.h"
+#include "CppServer/log.h"
+
+#include <atomic>
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+// 同样的连接数/请求数, 对比按行回显和HTTP的吞吐, 差值就是HTTP每个请求的开销
+class LineEchoServer : public CppServer::TcpServer {
+ public:
+    void handleClient(CppServer::Socket::ptr client) override;
+};
+
+// 和examples/echo_server一样: 读缓冲区空了才flush
+void LineEchoServer::handleClient(CppServer::Socket::ptr client) {
+    CppServer::SocketStream stream(client, false);
+    std::string line;
+    while (stream.readLine(line) > 0) {
+        line.push_back('\n');
+        if (stream.writeFixSize(line.c_str(), line.size()) < 0) {
+            break;
+        }
+        if (stream.getReadBuffered() == 0 && stream.flush()) {
+            break;
+        }
+    }
+    client->close();
+}
+
+int connections = 8;
+int requests = 20000;
+int depth = 1;
+
+static std::atomic<int> s_done = {0};
+static std::atomic<uint64_t> s_completed = {0};
+
+// 每次发depth个请求, 收齐depth个定长的响应
+void client(CppServer::Address::ptr addr, std::string req, size_t rsp_len) {
+    CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+    if (sock->connect(addr)) {
+        std::string batch;
+        for (int i = 0; i < depth; ++i) {
+            batch += req;
+        }
+        std::vector<char> buffer(rsp_len * depth);
+        for (int i = 0; i < requests; i += depth) {
+            if (sock->send(batch.c_str(), batch.size()) <= 0) {
+                break;
+            }
+            size_t got = 0;
+            while (got < buffer.size()) {
+                int rt = sock->recv(&buffer[got], buffer.size() - got);
+                if (rt <= 0) {
+                    break;
+                }
+                got += rt;
+            }
+            if (got < buffer.size()) {
+                break;
+            }
+            s_completed += depth;
+        }
+    }
+    sock->close();
+    ++s_done;
+}
+
+void bench(const std::string& name, CppServer::TcpServer::ptr server, uint16_t port,
+           const std::string& req, size_t rsp_len) {
+    auto addr = CppServer::Address::LookupAny("127.0.0.1:" + std::to_string(port));
+    if (!server->bind(addr)) {
+        return;
+    }
+    server->start();
+    s_done = 0;
+    s_completed = 0;
+    uint64_t begin = CppServer::GetCurrentUS();
+    for (int i = 0; i < connections; ++i) {
+        CppServer::IOManager::GetThis()->schedule(std::bind(client, addr, req, rsp_len));
+    }
+    while (s_done < connections) {
+        usleep(10 * 1000);
+    }
+    uint64_t used = CppServer::GetCurrentUS() - begin;
+    server->stop();
+
+    CPPSERVER_LOG_INFO(g_logger) << name
+        << " connections=" << connections << " depth=" << depth
+        << " requests=" << s_completed
+        << " time=" << used / 1000 << "ms"
+        << " qps=" << (uint64_t) (s_completed * 1000000.0 / used)
+        << " per_request=" << (double) used / (s_completed ? (uint64_t) s_completed : 1) << "us";
+}
+
+void run() {
+    bench("echo", CppServer::TcpServer::ptr(new LineEchoServer), 8023, "ping\n", 5);
+
+    CppServer::http::HttpServer::ptr http(new CppServer::http::HttpServer);
+    http->getServletDispatch()->addServlet("/ping",
+        [](CppServer::http::HttpRequest& req, CppServer::http::HttpResponse& rsp) {
+            rsp.setBody("pong");
+            return 0;
+        });
+    // HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\npong
+    bench("http", http, 8024, "GET /ping HTTP/1.1\r\nHost: bench\r\n\r\n", 42);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        connections = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        requests = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        depth = std::max(atoi(argv[3]), 1);
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "used as [" << argv[0] << " connections requests pipeline_depth]";
+    CPPSERVER_LOG_NAME("system")->setLevel(CppServer::LogLevel::WARN);
+    CppServer::IOManager iom(2);
+    iom.schedule(run);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include "CppServer/tcp_server.h"
+#include "CppServer/log.h"
+
+#include <algorithm>
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+// loopback上ping-pong测往返延迟, 对比busy poll开/关
+class PingServer : public CppServer::TcpServer {
+ public:
+    void handleClient(CppServer::Socket::ptr client) override;
+};
+
+void PingServer::handleClient(CppServer::Socket::ptr client) {
+    char buffer[64];
+    while (true) {
+        int rt = client->recv(buffer, sizeof(buffer));
+        if (rt <= 0) {
+            break;
+        }
+        if (client->send(buffer, rt) <= 0) {
+            break;
+        }
+    }
+}
+
+int count = 100000;
+uint32_t busy_poll_us = 50;
+
+void bench(uint32_t busy_poll, uint16_t port) {
+    PingServer::ptr server(new PingServer);
+    server->setBusyPoll(busy_poll);
+    auto addr = CppServer::Address::LookupAny("127.0.0.1:" + std::to_string(port));
+    if (!server->bind(addr)) {
+        return;
+    }
+    server->start();
+
+    CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+    if (!sock->connect(addr)) {
+        server->stop();
+        return;
+    }
+    if (busy_poll) {
+        sock->setBusyPoll(busy_poll);
+    }
+    char buffer[64] = {0};
+    std::vector<uint64_t> rtts;
+    rtts.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        uint64_t begin = CppServer::GetCurrentUS();
+        if (sock->send(buffer, sizeof(buffer)) <= 0
+                || sock->recv(buffer, sizeof(buffer)) <= 0) {
+            break;
+        }
+        rtts.push_back(CppServer::GetCurrentUS() - begin);
+    }
+    sock->close();
+    server->stop();
+    if (rtts.empty()) {
+        return;
+    }
+
+    std::sort(rtts.begin(), rtts.end());
+    uint64_t sum = 0;
+    for (auto& i : rtts) {
+        sum += i;
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "busy_poll=" << busy_poll << "us"
+        << " count=" << rtts.size()
+        << " avg=" << (double) sum / rtts.size() << "us"
+        << " p50=" << rtts[rtts.size() / 2] << "us"
+        << " p99=" << rtts[rtts.size() * 99 / 100] << "us"
+        << " max=" << rtts.back() << "us";
+}
+
+void run() {
+    bench(0, 8021);
+    bench(busy_poll_us, 8022);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        busy_poll_us = atoi(argv[2]);
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "used as [" << argv[0] << " count busy_poll_us]";
+    CPPSERVER_LOG_NAME("system")->setLevel(CppServer::LogLevel::WARN);
+    CppServer::IOManager iom(2);
+    iom.schedule(run);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "CppServer/buffer_pool.h"
+#include "CppServer/socket_stream.h"
+#include "CppServer/iomanager.h"
+#include "CppServer/log.h"
+#include "CppServer/macro.h"
+
+#include <sstream>
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+static std::string stats() {
+    std::stringstream ss;
+    CppServer::BufferPoolMgr::GetInstance()->getStats().dump(ss);
+    return ss.str();
+}
+
+void test_slice() {
+    CppServer::BufferSlice s(1000);
+    CPPSERVER_ASSERT(s.getBuffer()->size() == 1024);
+    memcpy(s.data(), "hello world", 11);
+    CppServer::BufferSlice w = s.slice(6, 5);
+    s.reset();
+    // 子切片还持有引用, 块没有回到池里
+    CPPSERVER_ASSERT(std::string(w.data(), w.size()) == "world");
+    CPPSERVER_LOG_INFO(g_logger) << "slice alive: " << stats();
+    w.reset();
+    CPPSERVER_LOG_INFO(g_logger) << "slice released: " << stats();
+}
+
+void test_threads() {
+    std::vector<CppServer::Thread::ptr> thrs;
+    for (int i = 0; i < 4; ++i) {
+        thrs.push_back(CppServer::Thread::ptr(new CppServer::Thread([]() {
+            for (int n = 0; n < 100000; ++n) {
+                std::vector<CppServer::Buffer::ptr> bufs;
+                for (size_t size = 100; size <= 100000; size *= 4) {
+                    bufs.push_back(CppServer::BufferPoolMgr::GetInstance()->allocate(size));
+                }
+            }
+        }, "buffer_" + std::to_string(i))));
+    }
+    for (auto& i : thrs) {
+        i->join();
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "threads: " << stats();
+}
+
+// 读空/发完之后缓冲区还回池里, 空闲连接不占内存
+void test_stream() {
+    auto addr = CppServer::Address::LookupAnyIPAddress("127.0.0.1:0");
+    CppServer::Socket::ptr listener = CppServer::Socket::CreateTCP(addr);
+    listener->bind(addr);
+    listener->listen();
+    CppServer::Socket::ptr a = CppServer::Socket::CreateTCP(addr);
+    a->connect(listener->getLocalAddress());
+    CppServer::Socket::ptr b = listener->accept();
+    CppServer::SocketStream sa(a);
+    CppServer::SocketStream sb(b);
+
+    sa.write("ping\nping\n", 10);
+    CPPSERVER_LOG_INFO(g_logger) << "buffered write: " << stats();
+    sa.flush();
+    std::string line;
+    sb.readLine(line);
+    CPPSERVER_LOG_INFO(g_logger) << "half read: " << stats();
+    sb.readLine(line);
+    CPPSERVER_LOG_INFO(g_logger) << "idle: " << stats();
+}
+
+int main(int argc, char** argv) {
+    test_slice();
+    test_threads();
+    CppServer::IOManager iom(1);
+    iom.schedule(test_stream);
+    return 0;
+}
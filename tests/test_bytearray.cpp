@@ -0,0 +1,120 @@
+#include "CppServer/bytearray.h"
+#include "CppServer/log.h"
+#include "CppServer/macro.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+// 随机写一组值再读回来, 块很小, 保证跨块
+void test() {
+#define XX(type, len, write_fun, read_fun, base_len) { \
+    std::vector<type> vec; \
+    for (int i = 0; i < len; ++i) { \
+        vec.push_back(rand() * (rand() % 2 ? 1 : -1)); \
+    } \
+    CppServer::ByteArray::ptr ba(new CppServer::ByteArray(base_len)); \
+    for (auto& i : vec) { \
+        ba->write_fun(i); \
+    } \
+    ba->setPosition(0); \
+    for (size_t i = 0; i < vec.size(); ++i) { \
+        type v = ba->read_fun(); \
+        CPPSERVER_ASSERT(v == vec[i]); \
+    } \
+    CPPSERVER_ASSERT(ba->getReadSize() == 0); \
+    CPPSERVER_LOG_INFO(g_logger) << #write_fun "/" #read_fun " (" #type ") len=" << len \
+        << " base_len=" << base_len << " size=" << ba->getSize(); \
+}
+
+    XX(int8_t,  100, writeFint8, readFint8, 1);
+    XX(uint8_t, 100, writeFuint8, readFuint8, 1);
+    XX(int16_t,  100, writeFint16, readFint16, 1);
+    XX(uint16_t, 100, writeFuint16, readFuint16, 1);
+    XX(int32_t,  100, writeFint32, readFint32, 1);
+    XX(uint32_t, 100, writeFuint32, readFuint32, 1);
+    XX(int64_t,  100, writeFint64, readFint64, 1);
+    XX(uint64_t, 100, writeFuint64, readFuint64, 1);
+
+    XX(int32_t,  100, writeInt32, readInt32, 1);
+    XX(uint32_t, 100, writeUint32, readUint32, 1);
+    XX(int64_t,  100, writeInt64, readInt64, 1);
+    XX(uint64_t, 100, writeUint64, readUint64, 1);
+#undef XX
+
+    CppServer::ByteArray ba(3);
+    ba.setIsLittleEndian(true);
+    ba.writeDouble(3.25);
+    ba.writeFloat(-1.5f);
+    ba.writeStringVint("hello");
+    ba.writeStringF16(std::string(1000, 'x'));
+    ba.writeInt64(-1);
+    ba.setPosition(0);
+    CPPSERVER_ASSERT(ba.readDouble() == 3.25);
+    CPPSERVER_ASSERT(ba.readFloat() == -1.5f);
+    CPPSERVER_ASSERT(ba.readStringVint() == "hello");
+    CPPSERVER_ASSERT(ba.readStringF16() == std::string(1000, 'x'));
+    CPPSERVER_ASSERT(ba.readInt64() == -1);
+    try {
+        ba.readFint8();
+        CPPSERVER_ASSERT2(false, "read past end");
+    } catch (std::out_of_range& e) {
+        CPPSERVER_LOG_INFO(g_logger) << "out_of_range: " << e.what();
+    }
+}
+
+// 通过iovec直接收发, 不经过连续的临时缓冲区
+void test_iovec() {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+    CppServer::ByteArray out(16);
+    for (int i = 0; i < 100; ++i) {
+        out.writeUint32(i * 1000);
+        out.writeStringVint("msg" + std::to_string(i));
+    }
+    out.setPosition(0);
+    std::vector<iovec> iovs;
+    uint64_t len = out.getReadBuffers(iovs);
+    int rt = writev(fds[0], &iovs[0], iovs.size());
+    CPPSERVER_LOG_INFO(g_logger) << "writev iovs=" << iovs.size() << " len=" << len << " rt=" << rt;
+
+    CppServer::ByteArray in(64);
+    iovs.clear();
+    in.getWriteBuffers(iovs, len);
+    rt = readv(fds[1], &iovs[0], iovs.size());
+    in.setPosition(in.getPosition() + rt);
+    in.setPosition(0);
+    for (int i = 0; i < 100; ++i) {
+        CPPSERVER_ASSERT(in.readUint32() == (uint32_t) i * 1000);
+        CPPSERVER_ASSERT(in.readStringVint() == "msg" + std::to_string(i));
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "readv iovs=" << iovs.size() << " rt=" << rt << " ok";
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// 空串的长度正好写满最后一块, 读完长度后位置在块末尾, 读0字节不能访问后面不存在的块
+void test_empty_at_block_end() {
+    CppServer::ByteArray ba(2);
+    ba.writeStringF16("");
+    ba.setPosition(0);
+    CPPSERVER_ASSERT(ba.readStringF16() == "");
+
+    CppServer::ByteArray ba2;
+    ba2.write(std::string(4094, 'x').c_str(), 4094);
+    ba2.writeStringF16("");
+    ba2.setPosition(4094);
+    CPPSERVER_ASSERT(ba2.readStringF16() == "");
+    std::string tmp;
+    ba2.read(&tmp[0], 0, ba2.getSize());
+    CPPSERVER_LOG_INFO(g_logger) << "empty string at block end ok";
+}
+
+int main(int argc, char** argv) {
+    test();
+    test_iovec();
+    test_empty_at_block_end();
+    return 0;
+}
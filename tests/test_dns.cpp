@@ -0,0 +1,117 @@
+#include "CppServer/dns.h"
+#include "CppServer/address.h"
+#include "CppServer/config.h"
+#include "CppServer/iomanager.h"
+#include "CppServer/log.h"
+#include "CppServer/util.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+
+CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+static int s_queries = 0;
+
+// 本地的简易DNS服务器: *.test的A记录返回10.0.0.1, ttl 2秒; 其它名字NXDOMAIN
+void dns_server() {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(5353);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (sockaddr*) &addr, sizeof(addr))) {
+        CPPSERVER_LOG_ERROR(g_logger) << "bind 5353 errno=" << errno;
+        close(sock);
+        return;
+    }
+    // 一段时间没有查询就退出
+    struct timeval tv{3, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    uint8_t buf[512];
+    while (true) {
+        sockaddr_in from;
+        socklen_t len = sizeof(from);
+        int n = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr*) &from, &len);
+        if (n < 12) {
+            break;
+        }
+        ++s_queries;
+        // 解析问题里的名字
+        std::string name;
+        int pos = 12;
+        while (pos < n && buf[pos]) {
+            if (!name.empty()) {
+                name.push_back('.');
+            }
+            name.append((const char*) buf + pos + 1, buf[pos]);
+            pos += buf[pos] + 1;
+        }
+        pos += 5;
+        uint16_t qtype = (buf[pos - 4] << 8) | buf[pos - 3];
+        CPPSERVER_LOG_INFO(g_logger) << "dns server query name=" << name << " type=" << qtype;
+        usleep(50 * 1000);
+
+        std::string resp((const char*) buf, pos);
+        resp[2] = (char) 0x81;   // QR RD
+        resp[3] = (char) 0x80;   // RA
+        bool known = name.size() > 5 && name.substr(name.size() - 5) == ".test";
+        if (!known) {
+            resp[3] |= 3;         // NXDOMAIN
+        } else if (qtype == 1) {
+            resp[7] = 1;          // ANCOUNT
+            const uint8_t answer[] = {0xC0, 12, 0, 1, 0, 1, 0, 0, 0, 2, 0, 4, 10, 0, 0, 1};
+            resp.append((const char*) answer, sizeof(answer));
+        }
+        sendto(sock, resp.c_str(), resp.size(), 0, (sockaddr*) &from, len);
+    }
+    close(sock);
+}
+
+void lookup(const std::string& host) {
+    std::vector<CppServer::Address::ptr> addrs;
+    uint64_t start = CppServer::GetCurrentMS();
+    bool rt = CppServer::Address::Lookup(addrs, host);
+    CPPSERVER_LOG_INFO(g_logger) << "lookup " << host << " rt=" << rt
+        << " addr=" << (addrs.empty() ? "" : addrs[0]->toString())
+        << " used=" << CppServer::GetCurrentMS() - start << "ms";
+}
+
+void test_dns() {
+    CppServer::IOManager* iom = CppServer::IOManager::GetThis();
+    iom->schedule(dns_server);
+    usleep(10 * 1000);
+
+    // 并发查询同一个名字只会发一个请求
+    for (int i = 0; i < 5; ++i) {
+        iom->schedule(std::bind(lookup, "www.example.test:80"));
+    }
+    usleep(200 * 1000);
+    CPPSERVER_LOG_INFO(g_logger) << "server queries=" << s_queries;
+
+    // 缓存命中, 不再发请求
+    lookup("www.example.test");
+    lookup("nothing.invalid");
+    lookup("nothing.invalid");
+    // /etc/hosts
+    lookup("localhost");
+    CPPSERVER_LOG_INFO(g_logger) << "server queries=" << s_queries
+        << " cache hits=" << CppServer::DnsMgr::GetInstance()->getCacheHits();
+
+    // ttl过期后重新查询
+    sleep(3);
+    lookup("www.example.test");
+    CPPSERVER_LOG_INFO(g_logger) << "server queries=" << s_queries;
+}
+
+int main(int argc, char** argv) {
+    CppServer::Config::Lookup<std::vector<std::string> >("dns.servers")
+        ->setValue(std::vector<std::string>{"127.0.0.1:5353"});
+    CppServer::IOManager iom(2);
+    iom.schedule(test_dns);
+    return 0;
+}
@@ -1,12 +1,19 @@
 #include "CppServer/hook.h"
 #include "CppServer/log.h"
 #include "CppServer/iomanager.h"
+#include "CppServer/util.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 
 CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
 
@@ -62,10 +69,260 @@ void test_sock() {
     CPPSERVER_LOG_INFO(g_logger) << buff;
 }
 
+void test_sendfile() {
+    char path[] = "/tmp/test_sendfile_XXXXXX";
+    int file = mkstemp(path);
+    unlink(path);
+    std::string data(1024 * 1024, 'a');
+    if (write(file, &data[0], data.size()) != (ssize_t) data.size()) {
+        return;
+    }
+
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    // 对端慢慢读, 发送端会在缓冲区满时让出协程
+    size_t size = data.size();
+    CppServer::IOManager::GetThis()->schedule([fds, size]() {
+        std::string buff(64 * 1024, 0);
+        size_t total = 0;
+        while (total < size) {
+            int rt = recv(fds[1], &buff[0], buff.size(), 0);
+            if (rt <= 0) {
+                break;
+            }
+            total += rt;
+        }
+        CPPSERVER_LOG_INFO(g_logger) << "recv total=" << total;
+        close(fds[1]);
+    });
+
+    off_t offset = 0;
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t rt = sendfile(fds[0], file, &offset, left);
+        if (rt <= 0) {
+            break;
+        }
+        left -= rt;
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "sendfile offset=" << offset
+                                 << " errno=" << errno;
+    close(fds[0]);
+    close(file);
+}
+
+void test_poll() {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    // 另一个协程100ms后写数据, poll期间线程不会被阻塞
+    CppServer::IOManager::GetThis()->schedule([fds]() {
+        usleep(100 * 1000);
+        CPPSERVER_LOG_INFO(g_logger) << "write rt=" << write(fds[1], "x", 1);
+    });
+
+    struct pollfd pfd;
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    uint64_t start = CppServer::GetCurrentMS();
+    int rt = poll(&pfd, 1, 1000);
+    CPPSERVER_LOG_INFO(g_logger) << "poll rt=" << rt << " revents=" << pfd.revents
+                                 << " used=" << CppServer::GetCurrentMS() - start << "ms";
+
+    fd_set rset;
+    FD_ZERO(&rset);
+    FD_SET(fds[1], &rset);
+    timeval tv = {0, 200 * 1000};
+    start = CppServer::GetCurrentMS();
+    rt = select(fds[1] + 1, &rset, nullptr, nullptr, &tv);
+    CPPSERVER_LOG_INFO(g_logger) << "select rt=" << rt
+                                 << " used=" << CppServer::GetCurrentMS() - start << "ms";
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// 两个协程poll同一个fd, 后来的挂在先来的后面, 数据到达时一起被唤醒
+// 普通文件不能交给epoll, poll直接返回就绪
+void test_poll_shared() {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    for (int i = 0; i < 2; ++i) {
+        CppServer::IOManager::GetThis()->schedule([fds, i]() {
+            struct pollfd pfd;
+            pfd.fd = fds[0];
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            uint64_t start = CppServer::GetCurrentUS();
+            int rt = poll(&pfd, 1, 1000);
+            CPPSERVER_LOG_INFO(g_logger) << "shared poll " << i << " rt=" << rt
+                                         << " revents=" << pfd.revents
+                                         << " used=" << (CppServer::GetCurrentUS() - start) / 1000 << "ms";
+        });
+    }
+    usleep(50 * 1000);
+    write(fds[1], "x", 1);
+    usleep(50 * 1000);
+
+    int file = open("/proc/self/exe", O_RDONLY);
+    struct pollfd pfds[2];
+    pfds[0].fd = fds[1];
+    pfds[0].events = POLLIN;
+    pfds[1].fd = file;
+    pfds[1].events = POLLIN;
+    int rt = poll(pfds, 2, 1000);
+    CPPSERVER_LOG_INFO(g_logger) << "file poll rt=" << rt << " revents=" << pfds[1].revents;
+    close(file);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_pipe() {
+    int fds[2];
+    pipe2(fds, O_CLOEXEC);
+    int efd = eventfd(0, 0);
+    // dup出来的读端一样会让出协程
+    int rfd = dup(fds[0]);
+    CppServer::IOManager::GetThis()->schedule([fds, efd]() {
+        usleep(100 * 1000);
+        write(fds[1], "hello", 5);
+        uint64_t v = 1;
+        write(efd, &v, sizeof(v));
+    });
+
+    char buff[16] = {0};
+    int rt = read(rfd, buff, sizeof(buff));
+    CPPSERVER_LOG_INFO(g_logger) << "pipe read rt=" << rt << " data=" << buff;
+    uint64_t v = 0;
+    rt = read(efd, &v, sizeof(v));
+    CPPSERVER_LOG_INFO(g_logger) << "eventfd read rt=" << rt << " value=" << v;
+    close(rfd);
+    close(fds[0]);
+    close(fds[1]);
+    close(efd);
+}
+
+// dup2覆盖一个有协程在等待的fd: 等待者被唤醒后在新文件上继续等待; dup2失败时fd的记录不变
+void test_dup2() {
+    int a[2];
+    int b[2];
+    pipe(a);
+    pipe(b);
+    int target = a[0];
+    CppServer::IOManager::GetThis()->schedule([target]() {
+        char c = 0;
+        int rt = read(target, &c, 1);
+        CPPSERVER_LOG_INFO(g_logger) << "dup2 waiter read rt=" << rt << " data=" << c;
+    });
+    usleep(50 * 1000);
+    int rt = dup2(10000, target);
+    CPPSERVER_LOG_INFO(g_logger) << "dup2 bad oldfd rt=" << rt << " errno=" << errno;
+    usleep(50 * 1000);
+    rt = dup2(b[0], target);
+    CPPSERVER_LOG_INFO(g_logger) << "dup2 rt=" << rt;
+    write(b[1], "y", 1);
+    usleep(50 * 1000);
+    close(target);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+}
+
+// 等待中的fd被关闭, 同号的fd马上被新的pipe复用, 等待者不能读到新pipe的数据
+void test_close_reuse() {
+    int a[2];
+    pipe(a);
+    int fd = a[0];
+    CppServer::IOManager::GetThis()->schedule([fd]() {
+        char c = 0;
+        int rt = read(fd, &c, 1);
+        CPPSERVER_LOG_INFO(g_logger) << "close waiter read rt=" << rt << " errno=" << errno
+                                     << " data=" << c;
+    });
+    usleep(50 * 1000);
+    close(a[0]);
+    int b[2];
+    pipe(b);
+    int reused = fcntl(b[0], F_DUPFD, fd);
+    write(b[1], "z", 1);
+    CPPSERVER_LOG_INFO(g_logger) << "closed fd=" << fd << " reused=" << reused;
+    usleep(50 * 1000);
+    close(reused);
+    close(a[1]);
+    close(b[0]);
+    close(b[1]);
+}
+
+// SO_RCVTIMEO: 比扫描间隔短的超时走单独的定时器, 长的由扫描取消, 精度为一个扫描间隔
+void test_recv_timeout() {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    uint64_t timeouts[] = {20, 300};
+    for (uint64_t ms : timeouts) {
+        timeval tv = {0, (suseconds_t) (ms * 1000)};
+        setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char c = 0;
+        uint64_t start = CppServer::GetCoarseMS();
+        int rt = recv(fds[0], &c, 1, 0);
+        CPPSERVER_LOG_INFO(g_logger) << "recv timeout=" << ms << "ms rt=" << rt
+                                     << " errno=" << errno
+                                     << " used=" << CppServer::GetCoarseMS() - start << "ms";
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// socket可读但pipe满了: splice要在pipe的写端等待, 不能在已经可读的socket上空转
+void test_splice_pipe_full() {
+    int s[2];
+    int p[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, s);
+    pipe(p);
+    int flags = fcntl(p[1], F_GETFL);
+    fcntl(p[1], F_SETFL, flags | O_NONBLOCK);
+    char buf[4096] = {0};
+    size_t filled = 0;
+    ssize_t n;
+    while ((n = write(p[1], buf, sizeof(buf))) > 0) {
+        filled += n;
+    }
+    fcntl(p[1], F_SETFL, flags);
+    write(s[1], "abc", 3);
+
+    CppServer::IOManager::GetThis()->schedule([p, filled]() {
+        usleep(100 * 1000);
+        char drain[4096];
+        size_t left = filled;
+        while (left > 0) {
+            ssize_t rt = read(p[0], drain, std::min(left, sizeof(drain)));
+            if (rt <= 0) {
+                break;
+            }
+            left -= rt;
+        }
+    });
+    uint64_t start = CppServer::GetCurrentMS();
+    ssize_t rt = splice(s[0], nullptr, p[1], nullptr, 3, 0);
+    CPPSERVER_LOG_INFO(g_logger) << "splice pipe full rt=" << rt << " errno=" << errno
+                                 << " used=" << CppServer::GetCurrentMS() - start << "ms";
+    usleep(50 * 1000);
+    close(s[0]);
+    close(s[1]);
+    close(p[0]);
+    close(p[1]);
+}
+
 int main(int argc, char** argv) {
     // test_sleep();
     // test_sock();
     CppServer::IOManager iom;
     iom.schedule(test_sock);
+    iom.schedule(test_sendfile);
+    iom.schedule(test_poll);
+    iom.schedule(test_poll_shared);
+    iom.schedule(test_pipe);
+    iom.schedule(test_dup2);
+    iom.schedule(test_close_reuse);
+    iom.schedule(test_recv_timeout);
+    iom.schedule(test_splice_pipe_full);
     return 0;
 }
@@ -0,0 +1,140 @@
+#include "CppServer/hot_restart.h"
+#include "CppServer/tcp_server.h"
+#include "CppServer/socket_stream.h"
+#include "CppServer/iomanager.h"
+#include "CppServer/log.h"
+#include "CppServer/util.h"
+
+#include <set>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <linux/securebits.h>
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+static const char* s_path = "/tmp/test_hot_restart/handoff.sock";
+
+// 每行请求回复本进程的pid
+class PidServer : public CppServer::TcpServer {
+protected:
+    virtual void handleClient(CppServer::Socket::ptr client) override {
+        CppServer::SocketStream stream(client, false);
+        std::string line;
+        std::string reply = std::to_string(getpid()) + "\n";
+        while (stream.readLine(line) > 0) {
+            if (stream.writeFixSize(reply.c_str(), reply.size()) <= 0 || stream.flush() < 0) {
+                break;
+            }
+        }
+        client->close();
+    }
+};
+
+CppServer::TcpServer::ptr start_server() {
+    CppServer::TcpServer::ptr server(new PidServer);
+    CppServer::Address::ptr addr = CppServer::Address::LookupAny("127.0.0.1:8040");
+    while (!server->bind(addr)) {
+        sleep(1);
+    }
+    server->start();
+    return server;
+}
+
+void old_process() {
+    CppServer::TcpServer::ptr server = start_server();
+    CPPSERVER_LOG_INFO(g_logger) << "old " << getpid() << " serving";
+    bool rt = CppServer::HotRestartMgr::GetInstance()->serve(s_path, {server}, 2000);
+    CPPSERVER_LOG_INFO(g_logger) << "old " << getpid() << " exit drained=" << rt;
+}
+
+void new_process() {
+    bool rt = CppServer::HotRestartMgr::GetInstance()->takeover(s_path);
+    CPPSERVER_LOG_INFO(g_logger) << "new " << getpid() << " takeover=" << rt;
+    CppServer::TcpServer::ptr server = start_server();
+    CPPSERVER_LOG_INFO(g_logger) << "new " << getpid() << " unclaimed="
+        << CppServer::HotRestartMgr::GetInstance()->closeUnclaimed();
+    sleep(2);
+    server->drain(1000);
+}
+
+// 别的用户来接管: 保留root的能力穿过0700的目录和0600的socket, 但有效uid换成nobody, 由SO_PEERCRED拒绝
+// 什么都拿不到, 旧进程继续等真正的新进程
+void intruder_process() {
+    usleep(500 * 1000);
+    if (prctl(PR_SET_SECUREBITS, SECBIT_NO_SETUID_FIXUP) || seteuid(65534)) {
+        CPPSERVER_LOG_INFO(g_logger) << "intruder skipped errno=" << errno;
+        return;
+    }
+    bool rt = CppServer::HotRestartMgr::GetInstance()->takeover(s_path, 1000);
+    CPPSERVER_LOG_INFO(g_logger) << "intruder takeover=" << rt << " inherited="
+        << CppServer::HotRestartMgr::GetInstance()->getInheritedCount();
+}
+
+// 不用IOManager的普通阻塞客户端, 重启期间一直发请求
+void client_process() {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(8040);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    usleep(200 * 1000);
+
+    int requests = 0;
+    int failures = 0;
+    std::set<std::string> pids;
+    uint64_t end = CppServer::GetCurrentMS() + 2500;
+    while (CppServer::GetCurrentMS() < end) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        char buf[32];
+        int n = -1;
+        if (!connect(fd, (sockaddr*) &addr, sizeof(addr)) && send(fd, "ping\n", 5, 0) == 5) {
+            n = recv(fd, buf, sizeof(buf) - 1, 0);
+        }
+        close(fd);
+        ++requests;
+        if (n <= 0) {
+            ++failures;
+        } else {
+            pids.insert(std::string(buf, n - 1));
+        }
+        usleep(10 * 1000);
+    }
+    std::string all;
+    for (auto& pid : pids) {
+        all += pid + " ";
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "client requests=" << requests
+        << " failures=" << failures << " pids=" << all;
+}
+
+int main(int argc, char** argv) {
+    pid_t client = fork();
+    if (client == 0) {
+        client_process();
+        return 0;
+    }
+    pid_t intruder = fork();
+    if (intruder == 0) {
+        intruder_process();
+        return 0;
+    }
+    pid_t next = fork();
+    if (next == 0) {
+        usleep(1000 * 1000);
+        CppServer::IOManager iom(1);
+        iom.schedule(new_process);
+        return 0;
+    }
+    {
+        CppServer::IOManager iom(1);
+        iom.schedule(old_process);
+    }
+    waitpid(intruder, nullptr, 0);
+    waitpid(next, nullptr, 0);
+    waitpid(client, nullptr, 0);
+    return 0;
+}
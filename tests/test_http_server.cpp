@@ -0,0 +1,121 @@
+#include "CppServer/http/http_server.h"
+#include "CppServer/log.h"
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+static CppServer::Address::ptr s_addr = CppServer::Address::LookupAny("127.0.0.1:8050");
+
+// 发出req, 读到对端关闭为止; 只看状态行和body时把\r\n换成|
+std::string request(const std::string& req) {
+    CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(s_addr);
+    if (!sock->connect(s_addr)) {
+        return "connect error";
+    }
+    sock->setRecvTimeout(2000);
+    sock->send(req.c_str(), req.size());
+    std::string rsp;
+    char buf[4096];
+    int n = 0;
+    while ((n = sock->recv(buf, sizeof(buf))) > 0) {
+        rsp.append(buf, n);
+    }
+    size_t pos = 0;
+    while ((pos = rsp.find("\r\n", pos)) != std::string::npos) {
+        rsp.replace(pos, 2, "|");
+    }
+    return rsp;
+}
+
+void run() {
+    CppServer::http::HttpServer::ptr server(new CppServer::http::HttpServer);
+    CppServer::http::ServletDispatch::ptr sd = server->getServletDispatch();
+    sd->addServlet("/hello", [](CppServer::http::HttpRequest& req, CppServer::http::HttpResponse& rsp) {
+        rsp.setBody("hello");
+        return 0;
+    });
+    sd->addServlet("/echo", [](CppServer::http::HttpRequest& req, CppServer::http::HttpResponse& rsp) {
+        rsp.appendBody(req.getBody().data, req.getBody().size);
+        return 0;
+    });
+    sd->addPrefixServlet("/static/", [](CppServer::http::HttpRequest& req, CppServer::http::HttpResponse& rsp) {
+        rsp.setBody("static:" + req.getPath().toString());
+        return 0;
+    });
+    sd->addPrefixServlet("/static/img/", [](CppServer::http::HttpRequest& req, CppServer::http::HttpResponse& rsp) {
+        rsp.setBody("img:" + req.getPath().toString());
+        return 0;
+    });
+    sd->addGlobServlet("/user/*/profile", [](CppServer::http::HttpRequest& req, CppServer::http::HttpResponse& rsp) {
+        rsp.setBody(std::string("profile?") + req.getQuery().data);
+        return 0;
+    });
+    sd->addServlet("/stream", [](CppServer::http::HttpRequest& req, CppServer::http::HttpResponse& rsp) {
+        rsp.setHeader("Content-Type", "text/plain");
+        rsp.writeChunk("one,", 4);
+        rsp.writeChunk("two,", 4);
+        rsp.appendBody("three", 5);
+        return 0;
+    });
+    while (!server->bind(s_addr)) {
+        sleep(2);
+    }
+    server->start();
+
+    // 一次发出多个请求(流水线), 最后一个要求关闭连接
+    CPPSERVER_LOG_INFO(g_logger) << "pipeline: " << request(
+        "GET /hello HTTP/1.1\r\nHost: a\r\n\r\n"
+        "GET /static/a.css HTTP/1.1\r\nHost: a\r\n\r\n"
+        "GET /static/img/b.png HTTP/1.1\r\nHost: a\r\n\r\n"
+        "GET /user/42/profile?tab=1 HTTP/1.1\r\nHost: a\r\n\r\n"
+        "GET /nope HTTP/1.1\r\nHost: a\r\n\r\n"
+        "POST /echo HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nabcde"
+        "POST /echo HTTP/1.1\r\nHost: a\r\nTransfer-Encoding: chunked\r\n\r\n"
+            "4\r\nWiki\r\n5;ext=1\r\npedia\r\n0\r\nX-Trailer: 1\r\n\r\n"
+        "HEAD /hello HTTP/1.1\r\nHost: a\r\n\r\n"
+        "GET /stream HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+
+    CPPSERVER_LOG_INFO(g_logger) << "http/1.0: " << request("GET /hello HTTP/1.0\r\n\r\n");
+    CPPSERVER_LOG_INFO(g_logger) << "http/1.0 stream: " << request("GET /stream HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+    CPPSERVER_LOG_INFO(g_logger) << "bad request: " << request("GET /hello\r\n\r\n");
+    CPPSERVER_LOG_INFO(g_logger) << "bad version: " << request("GET /hello HTTP/2.0\r\n\r\n");
+    CPPSERVER_LOG_INFO(g_logger) << "bad encoding: " << request(
+        "POST /echo HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n");
+    CPPSERVER_LOG_INFO(g_logger) << "too large: " << request(
+        "POST /echo HTTP/1.1\r\nContent-Length: 999999999999\r\n\r\n");
+
+    // 请求分几次到达, body比初始缓冲区大
+    CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(s_addr);
+    if (sock->connect(s_addr)) {
+        sock->setRecvTimeout(2000);
+        std::string body(20000, 'x');
+        std::string head = "POST /echo HTTP/1.1\r\nHost: a\r\nExpect: 100-continue\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+        sock->send(head.c_str(), 10);
+        usleep(50 * 1000);
+        sock->send(head.c_str() + 10, head.size() - 10);
+        char buf[64] = {0};
+        int n = sock->recv(buf, sizeof(buf) - 1);
+        CPPSERVER_LOG_INFO(g_logger) << "expect: " << std::string(buf, n > 0 ? n - 4 : 0);
+        sock->send(body.c_str(), body.size());
+        std::string rsp;
+        char rbuf[4096];
+        size_t pos = std::string::npos;
+        while (pos == std::string::npos || rsp.size() - pos - 4 < body.size()) {
+            if ((n = sock->recv(rbuf, sizeof(rbuf))) <= 0) {
+                break;
+            }
+            rsp.append(rbuf, n);
+            pos = rsp.find("\r\n\r\n");
+        }
+        CPPSERVER_LOG_INFO(g_logger) << "large body: " << rsp.substr(0, rsp.find("\r\n"))
+            << " echoed=" << (pos == std::string::npos ? 0 : rsp.size() - pos - 4);
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "requests=" << server->getRequests();
+    server->stop();
+}
+
+int main(int argc, char** argv) {
+    CppServer::IOManager iom(2);
+    iom.schedule(run);
+    return 0;
+}
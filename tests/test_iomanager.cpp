@@ -5,6 +5,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <iostream>
 
 CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
@@ -95,8 +96,103 @@ void test_timer() {
 // }
 // 
 
+void test_idle_spin() {
+    CppServer::IOManager iom(2, false, "spin");
+    iom.setIdleSpin(200);
+    for (int i = 0; i < 10; ++i) {
+        iom.schedule([i]() {
+            CPPSERVER_LOG_INFO(g_logger) << "burst task " << i;
+        });
+        usleep(50);
+    }
+    usleep(100 * 1000);
+    CPPSERVER_LOG_INFO(g_logger) << "spin hits=" << iom.getSpinHits()
+                                 << " misses=" << iom.getSpinMisses();
+}
+
+static int s_urg_count = 0;
+static void on_urg(int) {
+    ++s_urg_count;
+}
+
+// 指派给某个线程的任务要马上叫醒那个线程, 不能等别的线程空转或者epoll_wait超时
+// 唤醒不能借用信号: 应用自己的SIGURG处理函数不能被换掉, 也不能收到唤醒
+void test_pinned_wakeup() {
+    signal(SIGURG, on_urg);
+    CppServer::IOManager iom(2, false, "pin");
+    iom.setIdleSpin(200);
+    usleep(50 * 1000);
+    std::vector<int> ids = iom.getThreadIds();
+    for (auto id : ids) {
+        uint64_t begin = CppServer::GetCurrentUS();
+        iom.schedule([id, begin]() {
+            CPPSERVER_LOG_INFO(g_logger) << "pinned to " << id << " run on " << CppServer::GetThreadId()
+                                         << " latency=" << CppServer::GetCurrentUS() - begin << "us";
+        }, id);
+        usleep(50 * 1000);
+    }
+    // 线程忙的时候指派给它的任务, 别的线程不该因为它一次次退出自旋空转
+    uint64_t hits = iom.getSpinHits();
+    iom.schedule([]() {
+        uint64_t end = CppServer::GetCurrentUS() + 100 * 1000;
+        while (CppServer::GetCurrentUS() < end);
+    }, ids[1]);
+    usleep(10 * 1000);
+    iom.schedule([]() {
+        CPPSERVER_LOG_INFO(g_logger) << "pinned behind busy task done";
+    }, ids[1]);
+    usleep(150 * 1000);
+    CPPSERVER_LOG_INFO(g_logger) << "spin hits while busy=" << iom.getSpinHits() - hits;
+    uint64_t begin = CppServer::GetCurrentUS();
+    iom.stop();
+    CPPSERVER_LOG_INFO(g_logger) << "stop used=" << (CppServer::GetCurrentUS() - begin) / 1000 << "ms";
+    struct sigaction sa;
+    sigaction(SIGURG, nullptr, &sa);
+    CPPSERVER_LOG_INFO(g_logger) << "SIGURG handler kept=" << (sa.sa_handler == on_urg)
+                                 << " received=" << s_urg_count;
+    signal(SIGURG, SIG_DFL);
+}
+
+void test_offload() {
+    CppServer::Config::Lookup<bool>("offload.file_io")->setValue(true);
+    CppServer::IOManager iom(1, false, "worker");
+    // 心跳协程, offload期间worker线程不应该被卡住
+    iom.schedule([]() {
+        for (int i = 0; i < 5; ++i) {
+            CPPSERVER_LOG_INFO(g_logger) << "tick " << i;
+            usleep(20 * 1000);
+        }
+    });
+    iom.schedule([]() {
+        int v = 0;
+        CppServer::IOManager::GetThis()->offload([&v]() {
+            usleep(60 * 1000);  // 模拟慢磁盘
+            v = 42;
+        });
+        CPPSERVER_LOG_INFO(g_logger) << "offload done v=" << v;
+
+        // 普通文件的open/write/fsync/pread自动走offload线程池
+        int fd = open("/tmp/test_offload.txt", O_CREAT | O_TRUNC | O_RDWR, 0644);
+        int rt = write(fd, "hello offload", 13);
+        fsync(fd);
+        char buf[32] = {0};
+        pread(fd, buf, sizeof(buf), 0);
+        CPPSERVER_LOG_INFO(g_logger) << "file fd=" << fd << " write=" << rt << " read=" << buf;
+        close(fd);
+        unlink("/tmp/test_offload.txt");
+
+        // 只带O_DIRECTORY的open没有mode参数
+        int dfd = open("/tmp", O_RDONLY | O_DIRECTORY);
+        CPPSERVER_LOG_INFO(g_logger) << "open dir fd=" << dfd;
+        close(dfd);
+    });
+}
+
 int main(int argc, char** argv) {
     // test1();
+    test_idle_spin();
+    test_pinned_wakeup();
+    test_offload();
     test_timer();
     return 0;
 }
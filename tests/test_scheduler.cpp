@@ -2,6 +2,9 @@
 
 static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
 
+static CppServer::ConfigVar<uint32_t>::ptr g_test_threads =
+    CppServer::Config::Lookup("test.scheduler.threads", (uint32_t) 2, "test scheduler threads");
+
 void test_fiber() {
     static int s_count = 5;
     CPPSERVER_LOG_INFO(g_logger) << "test in fiber, s_count="
@@ -13,6 +16,23 @@ void test_fiber() {
     }
 }
 
+void test_resize() {
+    CppServer::Scheduler sc(2, false, "resize");
+    sc.bindThreadCount(g_test_threads);
+    sc.start();
+    for (int i = 0; i < 10; ++i) {
+        sc.schedule([i]() {
+            CPPSERVER_LOG_INFO(g_logger) << "task " << i;
+        });
+    }
+    sc.setThreadCount(4);
+    CPPSERVER_LOG_INFO(g_logger) << "thread count=" << sc.getThreadCount();
+    g_test_threads->setValue(1);
+    CPPSERVER_LOG_INFO(g_logger) << "thread count=" << sc.getThreadCount();
+    sleep(1);
+    sc.stop();
+}
+
 int main(int argc, char** argv) {
     // 这样会被parse成一个函数
     // CppServer::Scheduler sc();
@@ -26,10 +46,7 @@ int main(int argc, char** argv) {
         sc.stop();
         CPPSERVER_LOG_INFO(g_logger) << "over";
     }
+    test_resize();
     CPPSERVER_LOG_INFO(g_logger) << "return";
     return 0;
 }
-
-
-
-
@@ -9,6 +9,7 @@ void test_socket() {
         CPPSERVER_LOG_INFO(g_logger) << "get address: " << addr->toString();
     } else {
         CPPSERVER_LOG_ERROR(g_logger) << "get address fail";
+        return;
     }
 
     CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
@@ -41,8 +42,224 @@ void test_socket() {
 
 }
 
+// recvmmsg/sendmmsg批量收发
+void test_udp_batch() {
+    auto addr = CppServer::Address::LookupAnyIPAddress("127.0.0.1:0");
+    CppServer::Socket::ptr server = CppServer::Socket::CreateUDP(addr);
+    server->bind(addr);
+    server->setRecvTimeout(1000);
+    CppServer::Address::ptr server_addr = server->getLocalAddress();
+
+    const size_t total = 10000;
+    CppServer::IOManager::GetThis()->schedule([server_addr, total]() {
+        CppServer::Socket::ptr client = CppServer::Socket::CreateUDP(server_addr);
+        std::vector<std::string> datas;
+        std::vector<iovec> iovs(100);
+        std::vector<CppServer::Address::ptr> tos(100, server_addr);
+        int calls = 0;
+        for (size_t n = 0; n < total; n += iovs.size()) {
+            datas.clear();
+            for (size_t i = 0; i < iovs.size(); ++i) {
+                datas.push_back("packet " + std::to_string(n + i));
+            }
+            for (size_t i = 0; i < iovs.size(); ++i) {
+                iovs[i].iov_base = &datas[i][0];
+                iovs[i].iov_len = datas[i].size();
+            }
+            client->sendToBatch(&iovs[0], &tos[0], iovs.size());
+            ++calls;
+            // UDP没有流控, 让接收方跟上, 避免接收缓冲区溢出丢包
+            usleep(1000);
+        }
+        CPPSERVER_LOG_INFO(g_logger) << "sent " << total << " packets in " << calls << " calls";
+    });
+
+    const size_t batch = 32;
+    std::vector<std::string> bufs(batch, std::string(1500, '\0'));
+    std::vector<iovec> iovs(batch);
+    std::vector<CppServer::Address::ptr> froms;
+    for (size_t i = 0; i < batch; ++i) {
+        iovs[i].iov_base = &bufs[i][0];
+        iovs[i].iov_len = bufs[i].size();
+        froms.push_back(CppServer::Address::ptr(new CppServer::IPv4Address));
+    }
+    size_t lengths[batch];
+    size_t received = 0;
+    int calls = 0;
+    while (received < total) {
+        int rt = server->recvFromBatch(&iovs[0], &froms[0], lengths, batch);
+        if (rt <= 0) {
+            CPPSERVER_LOG_INFO(g_logger) << "recvFromBatch rt=" << rt << " errno=" << errno;
+            break;
+        }
+        if (received == 0) {
+            CPPSERVER_LOG_INFO(g_logger) << "first: " << std::string(&bufs[0][0], lengths[0])
+                << " from " << froms[0]->toString();
+        }
+        received += rt;
+        ++calls;
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "received " << received << " packets in " << calls << " calls";
+}
+
+// GSO发送一大块, GRO一次收回来再切成数据报
+void test_udp_gso() {
+    auto addr = CppServer::Address::LookupAnyIPAddress("127.0.0.1:0");
+    CppServer::Socket::ptr server = CppServer::Socket::CreateUDP(addr);
+    server->bind(addr);
+    server->setRecvTimeout(1000);
+    if (!server->setUdpGro(true)) {
+        CPPSERVER_LOG_INFO(g_logger) << "UDP_GRO not supported";
+    }
+
+    CppServer::Socket::ptr client = CppServer::Socket::CreateUDP(addr);
+    std::string data;
+    for (int i = 0; i < 10; ++i) {
+        data.append(i < 9 ? 1000 : 500, 'a' + i);
+    }
+    int rt = client->sendToSegmented(&data[0], data.size(), 1000, server->getLocalAddress());
+    CPPSERVER_LOG_INFO(g_logger) << "sendToSegmented rt=" << rt;
+
+    std::string buf(65536, '\0');
+    size_t received = 0;
+    while (received < data.size()) {
+        uint16_t segment_size = 0;
+        CppServer::Address::ptr from(new CppServer::IPv4Address);
+        rt = server->recvFromGro(&buf[0], buf.size(), from, segment_size);
+        if (rt <= 0) {
+            CPPSERVER_LOG_INFO(g_logger) << "recvFromGro rt=" << rt << " errno=" << errno;
+            break;
+        }
+        std::vector<iovec> segments;
+        CppServer::Socket::SplitSegments(&buf[0], rt, segment_size, segments);
+        CPPSERVER_LOG_INFO(g_logger) << "recvFromGro rt=" << rt << " segment_size=" << segment_size
+            << " segments=" << segments.size() << " last=" << segments.back().iov_len
+            << " from " << from->toString();
+        received += rt;
+    }
+}
+
+// MSG_ZEROCOPY发送大块数据; loopback上内核会退化为拷贝, 但完成通知照样到达
+void test_zerocopy() {
+    auto addr = CppServer::Address::LookupAnyIPAddress("127.0.0.1:0");
+    CppServer::Socket::ptr listener = CppServer::Socket::CreateTCP(addr);
+    listener->bind(addr);
+    listener->listen();
+
+    const size_t total = 64 * 1024 * 1024;
+    CppServer::IOManager::GetThis()->schedule([listener, total]() {
+        CppServer::Socket::ptr client = listener->accept();
+        std::string buf(256 * 1024, '\0');
+        size_t received = 0;
+        while (received < total) {
+            int rt = client->recv(&buf[0], buf.size());
+            if (rt <= 0) {
+                break;
+            }
+            received += rt;
+        }
+        CPPSERVER_LOG_INFO(g_logger) << "zerocopy received " << received;
+    });
+
+    CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+    sock->connect(listener->getLocalAddress());
+    if (!sock->setZeroCopy(true)) {
+        CPPSERVER_LOG_INFO(g_logger) << "SO_ZEROCOPY not supported";
+    }
+    std::string data(4 * 1024 * 1024, 'z');
+    uint64_t start = CppServer::GetCurrentUS();
+    size_t sent = 0;
+    for (int i = 0; i < 8; ++i) {
+        ssize_t rt = sock->sendZeroCopy(&data[0], data.size());
+        if (rt <= 0) {
+            break;
+        }
+        sent += rt;
+    }
+    // 回调版: 完成之前data不能修改
+    for (int i = 0; i < 8; ++i) {
+        sock->sendZeroCopyAsync(&data[0], data.size(), [](bool ok) {
+            if (!ok) {
+                CPPSERVER_LOG_INFO(g_logger) << "zerocopy completion failed";
+            }
+        });
+        sent += data.size();
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "zerocopy sent " << sent
+        << " used=" << CppServer::GetCurrentUS() - start << "us"
+        << " completed=" << sock->getZeroCopyCompleted()
+        << " copied=" << sock->getZeroCopyCopied();
+    sleep(1);
+    CPPSERVER_LOG_INFO(g_logger) << "zerocopy completed=" << sock->getZeroCopyCompleted()
+        << " copied=" << sock->getZeroCopyCopied();
+}
+
+// 完成通知到达之前close: fd留到通知到齐再关闭, 回调报告成功, 对端照样收到全部数据和EOF
+void test_zerocopy_close() {
+    auto addr = CppServer::Address::LookupAnyIPAddress("127.0.0.1:0");
+    CppServer::Socket::ptr listener = CppServer::Socket::CreateTCP(addr);
+    listener->bind(addr);
+    listener->listen();
+
+    CppServer::IOManager::GetThis()->schedule([listener]() {
+        CppServer::Socket::ptr client = listener->accept();
+        usleep(100 * 1000);
+        std::string buf(64 * 1024, '\0');
+        size_t received = 0;
+        int rt;
+        while ((rt = client->recv(&buf[0], buf.size())) > 0) {
+            received += rt;
+        }
+        CPPSERVER_LOG_INFO(g_logger) << "zerocopy close received " << received << " rt=" << rt;
+    });
+
+    CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+    sock->connect(listener->getLocalAddress());
+    if (!sock->setZeroCopy(true)) {
+        return;
+    }
+    std::shared_ptr<std::string> data(new std::string(256 * 1024, 'z'));
+    uint64_t start = CppServer::GetCurrentMS();
+    sock->sendZeroCopyAsync(&(*data)[0], data->size(), [data, start](bool ok) {
+        CPPSERVER_LOG_INFO(g_logger) << "zerocopy close completion ok=" << ok
+            << " after " << CppServer::GetCurrentMS() - start << "ms";
+    });
+    sock->close();
+    CPPSERVER_LOG_INFO(g_logger) << "zerocopy socket closed";
+}
+
+// 不在IOManager里(没开hook)时accept出来的连接也要能用
+void test_accept_no_hook() {
+    auto addr = CppServer::Address::LookupAnyIPAddress("127.0.0.1:0");
+    CppServer::Socket::ptr server = CppServer::Socket::CreateTCP(addr);
+    if (!server->bind(addr) || !server->listen()) {
+        return;
+    }
+    CppServer::Address::ptr server_addr = server->getLocalAddress();
+    CppServer::Socket::ptr client = CppServer::Socket::CreateTCP(server_addr);
+    client->connect(server_addr);
+    CppServer::Socket::ptr conn = server->accept();
+    if (!conn) {
+        CPPSERVER_LOG_ERROR(g_logger) << "accept without hook fail";
+    } else {
+        CPPSERVER_LOG_INFO(g_logger) << "accept without hook: " << *conn;
+        client->send("ping", 4);
+        char buf[8] = {0};
+        int rt = conn->recv(buf, sizeof(buf));
+        CPPSERVER_LOG_INFO(g_logger) << "recv without hook rt=" << rt << " data=" << buf;
+        conn->close();
+    }
+    client->close();
+    server->close();
+}
+
 int main(int argc, char** argv) {
+    test_accept_no_hook();
     CppServer::IOManager iom;
     iom.schedule(&test_socket);
+    iom.schedule(&test_udp_batch);
+    iom.schedule(&test_udp_gso);
+    iom.schedule(&test_zerocopy);
+    iom.schedule(&test_zerocopy_close);
     return 0;
 }
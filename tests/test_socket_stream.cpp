@@ -0,0 +1,108 @@
+#include "CppServer/socket_stream.h"
+#include "CppServer/iomanager.h"
+#include "CppServer/log.h"
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+static CppServer::Address::ptr s_addr = CppServer::Address::LookupAny("127.0.0.1:8060");
+static CppServer::Socket::ptr s_listen;
+
+// 建一条本机连接, server为accept出来的一端
+void connect_pair(CppServer::Socket::ptr& client, CppServer::Socket::ptr& server) {
+    client = CppServer::Socket::CreateTCP(s_addr);
+    client->connect(s_addr);
+    server = s_listen->accept();
+}
+
+// 一行分两次到达, 换行符可以是多字节的; 最后一段没有换行符
+void test_read_line() {
+    CppServer::Socket::ptr client, server;
+    connect_pair(client, server);
+    CppServer::IOManager::GetThis()->schedule([client]() {
+        client->send("hello\nwor", 9);
+        usleep(50 * 1000);
+        client->send("ld\r\nlast", 8);
+        client->close();
+    });
+
+    CppServer::SocketStream stream(server);
+    std::string line;
+    int rt = stream.readLine(line);
+    CPPSERVER_LOG_INFO(g_logger) << "readLine rt=" << rt << " line=" << line;
+    rt = stream.readLine(line, "\r\n");
+    CPPSERVER_LOG_INFO(g_logger) << "readLine(\\r\\n) rt=" << rt << " line=" << line;
+    rt = stream.readLine(line);
+    char buf[16] = {0};
+    int n = stream.read(buf, sizeof(buf));
+    CPPSERVER_LOG_INFO(g_logger) << "readLine at eof rt=" << rt << " rest=" << std::string(buf, n > 0 ? n : 0)
+        << " recv_calls=" << stream.getRecvCalls();
+}
+
+// 数据分几次到达, readFixSize读满为止
+void test_read_fix_size() {
+    CppServer::Socket::ptr client, server;
+    connect_pair(client, server);
+    CppServer::IOManager::GetThis()->schedule([client]() {
+        std::string data(10000, 'x');
+        for (size_t i = 0; i < data.size(); i += 3000) {
+            client->send(&data[i], std::min((size_t) 3000, data.size() - i));
+            usleep(20 * 1000);
+        }
+        client->close();
+    });
+
+    CppServer::SocketStream stream(server);
+    std::string buf(10000, 0);
+    int rt = stream.readFixSize(&buf[0], buf.size());
+    CPPSERVER_LOG_INFO(g_logger) << "readFixSize rt=" << rt << " recv_calls=" << stream.getRecvCalls();
+}
+
+// 小的write攒在写缓冲区, 大块数据来时和缓冲区一起用一次writev发出
+void test_writev() {
+    CppServer::Socket::ptr client, server;
+    connect_pair(client, server);
+
+    CppServer::SocketStream stream(server);
+    for (int i = 0; i < 100; ++i) {
+        stream.write("0123456789", 10);
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "small writes buffered=" << stream.getWriteBuffered()
+        << " send_calls=" << stream.getSendCalls();
+    std::string big(8000, 'y');
+    int rt = stream.writeFixSize(big.c_str(), big.size());
+    stream.write("tail", 4);
+    CPPSERVER_LOG_INFO(g_logger) << "big write rt=" << rt << " buffered=" << stream.getWriteBuffered()
+        << " send_calls=" << stream.getSendCalls();
+    stream.flush();
+
+    std::string rsp;
+    char buf[4096];
+    while (rsp.size() < 9004) {
+        int n = client->recv(buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        rsp.append(buf, n);
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "after flush send_calls=" << stream.getSendCalls()
+        << " received=" << rsp.size() << " head=" << rsp.substr(0, 10)
+        << " tail=" << rsp.substr(rsp.size() - 4);
+    client->close();
+}
+
+void run() {
+    s_listen = CppServer::Socket::CreateTCP(s_addr);
+    if (!s_listen->bind(s_addr) || !s_listen->listen()) {
+        return;
+    }
+    test_read_line();
+    test_read_fix_size();
+    test_writev();
+    s_listen->close();
+}
+
+int main(int argc, char** argv) {
+    CppServer::IOManager iom;
+    iom.schedule(run);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "CppServer/supervisor.h"
+#include "CppServer/socket_stream.h"
+#include "CppServer/log.h"
+#include "CppServer/util.h"
+
+#include <set>
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+
+static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
+
+// 每行请求回复本进程的pid
+class PidServer : public CppServer::TcpServer {
+protected:
+    virtual void handleClient(CppServer::Socket::ptr client) override {
+        CppServer::SocketStream stream(client, false);
+        std::string line;
+        std::string reply = std::to_string(getpid()) + "\n";
+        while (stream.readLine(line) > 0) {
+            if (stream.writeFixSize(reply.c_str(), reply.size()) <= 0 || stream.flush() < 0) {
+                break;
+            }
+        }
+        client->close();
+    }
+};
+
+static CppServer::Address::ptr s_addr = CppServer::Address::LookupAny("127.0.0.1:8041");
+
+// 发count个请求, 返回应答的pid集合
+std::set<std::string> request(int count, int& failures) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(8041);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::set<std::string> pids;
+    for (int i = 0; i < count; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        char buf[32];
+        int n = -1;
+        if (!connect(fd, (sockaddr*) &addr, sizeof(addr)) && send(fd, "ping\n", 5, 0) == 5) {
+            n = recv(fd, buf, sizeof(buf) - 1, 0);
+        }
+        close(fd);
+        if (n <= 0) {
+            ++failures;
+        } else {
+            pids.insert(std::string(buf, n - 1));
+        }
+    }
+    return pids;
+}
+
+std::string join(const std::set<std::string>& pids) {
+    std::string all;
+    for (auto& pid : pids) {
+        all += pid + " ";
+    }
+    return all;
+}
+
+// 驱动进程: 发请求, 杀掉一个worker看它被拉起, 再让master退出
+void driver(pid_t master) {
+    usleep(500 * 1000);
+    int failures = 0;
+    std::set<std::string> pids = request(100, failures);
+    CPPSERVER_LOG_INFO(g_logger) << "before kill pids=" << join(pids) << " failures=" << failures;
+
+    // 刚启动就崩溃的worker延迟supervisor.restart_delay再拉起
+    kill(atoi(pids.begin()->c_str()), SIGKILL);
+    usleep(1500 * 1000);
+    failures = 0;
+    pids = request(100, failures);
+    CPPSERVER_LOG_INFO(g_logger) << "after kill pids=" << join(pids) << " failures=" << failures;
+
+    kill(master, SIGHUP);
+    usleep(200 * 1000);
+    kill(master, SIGTERM);
+}
+
+int main(int argc, char** argv) {
+    pid_t master = getpid();
+    pid_t child = fork();
+    if (child == 0) {
+        driver(master);
+        return 0;
+    }
+
+    CppServer::Supervisor supervisor(2);
+    if (!supervisor.bind(s_addr)) {
+        return 1;
+    }
+    supervisor.setWorkerCb([](std::vector<CppServer::TcpServer::ptr>& servers) {
+        CppServer::TcpServer::ptr server(new PidServer);
+        server->bind(s_addr);
+        server->start();
+        servers.push_back(server);
+    });
+    supervisor.setReloadCb([]() {
+        CPPSERVER_LOG_INFO(g_logger) << "reload worker=" << CppServer::Supervisor::GetWorkerId()
+            << " pid=" << getpid();
+    });
+    supervisor.run();
+    CPPSERVER_LOG_INFO(g_logger) << "master exit restarts=" << supervisor.getRestarts();
+    waitpid(child, nullptr, 0);
+    return 0;
+}
@@ -1,5 +1,10 @@
 #include "CppServer/tcp_server.h"
 #include "CppServer/log.h"
+#include "CppServer/util.h"
+
+#include <map>
+#include <set>
+#include <sstream>
 
 static CppServer::Logger::ptr g_logger = CPPSERVER_LOG_ROOT();
 
@@ -20,10 +25,258 @@ void run() {
     tcp_server->start();
 }
 
+// 连接一直保持到对端关闭
+class HoldServer : public CppServer::TcpServer {
+protected:
+    virtual void handleClient(CppServer::Socket::ptr client) override {
+        char buf[64];
+        while (client->recv(buf, sizeof(buf)) > 0);
+        client->close();
+    }
+};
+
+void test_admission() {
+    HoldServer* server = new HoldServer;
+    CppServer::TcpServer::ptr holder(server);
+    server->setMaxConnections(8);
+    server->setMaxConnectionsPerIp(5);
+    server->setAcceptBatch(16);
+    CppServer::Address::ptr addr = CppServer::Address::LookupAny("127.0.0.1:8034");
+    while (!server->bind(addr)) {
+        sleep(2);
+    }
+    server->start();
+
+    // 同一个IP发起20个连接, 只有5个留下, 其余被RST
+    std::vector<CppServer::Socket::ptr> socks;
+    for (int i = 0; i < 20; ++i) {
+        CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+        if (sock->connect(addr)) {
+            socks.push_back(sock);
+        }
+    }
+    sleep(1);
+    int alive = 0;
+    for (auto& sock : socks) {
+        char c;
+        sock->setRecvTimeout(100);
+        if (sock->recv(&c, 1) < 0 && errno == ETIMEDOUT) {
+            ++alive;
+        }
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "connected=" << socks.size() << " alive=" << alive
+        << " connections=" << server->getConnections()
+        << " accepted=" << server->getAccepted()
+        << " rejected=" << server->getRejected();
+
+    socks.clear();
+    sleep(1);
+    CPPSERVER_LOG_INFO(g_logger) << "after close connections=" << server->getConnections();
+    server->stop();
+}
+
 
 
+void test_idle_reap() {
+    HoldServer* server = new HoldServer;
+    CppServer::TcpServer::ptr holder(server);
+    server->setIdleTimeout(500);
+    CppServer::Address::ptr addr = CppServer::Address::LookupAny("127.0.0.1:8035");
+    while (!server->bind(addr)) {
+        sleep(2);
+    }
+    server->start();
+
+    // 3个连接, 只有第一个一直在发数据
+    std::vector<CppServer::Socket::ptr> socks;
+    for (int i = 0; i < 3; ++i) {
+        CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+        if (sock->connect(addr)) {
+            socks.push_back(sock);
+        }
+    }
+    for (int i = 0; i < 15; ++i) {
+        socks[0]->send("x", 1);
+        usleep(200 * 1000);
+    }
+    int closed = 0;
+    for (auto& sock : socks) {
+        char c;
+        sock->setRecvTimeout(100);
+        if (sock->recv(&c, 1) == 0) {
+            ++closed;
+        }
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "idle closed=" << closed
+        << " reaped=" << server->getReaped()
+        << " connections=" << server->getConnections();
+    socks.clear();
+    server->stop();
+}
+
+// 回复处理这次请求的线程id
+class ThreadEchoServer : public CppServer::TcpServer {
+public:
+    ThreadEchoServer(CppServer::IOManager* worker)
+        : TcpServer(worker, worker) {
+    }
+protected:
+    virtual void handleClient(CppServer::Socket::ptr client) override {
+        char buf[64];
+        while (client->recv(buf, sizeof(buf)) > 0) {
+            int id = CppServer::GetThreadId();
+            client->send(&id, sizeof(id));
+        }
+        client->close();
+    }
+};
+
+// 每个连接请求rounds次, 返回最后一次应答的线程; 途中换过线程的连接计入moved
+std::map<CppServer::Socket::ptr, int> ping(const std::vector<CppServer::Socket::ptr>& socks,
+                                            int rounds, int& moved) {
+    std::map<CppServer::Socket::ptr, int> threads;
+    for (auto& sock : socks) {
+        int last = -1;
+        bool changed = false;
+        for (int i = 0; i < rounds; ++i) {
+            int id = -1;
+            sock->send("x", 1);
+            sock->recv(&id, sizeof(id));
+            changed = changed || (last != -1 && last != id);
+            last = id;
+            usleep(1000);
+        }
+        moved += changed;
+        threads[sock] = last;
+    }
+    return threads;
+}
+
+std::string dump_load(const std::map<CppServer::Socket::ptr, int>& threads) {
+    std::map<int, int> load;
+    for (auto& i : threads) {
+        ++load[i.second];
+    }
+    std::stringstream ss;
+    for (auto& i : load) {
+        ss << i.first << ":" << i.second << " ";
+    }
+    return ss.str();
+}
+
+void test_affinity() {
+    static CppServer::IOManager* worker = new CppServer::IOManager(3, false, "worker");
+    ThreadEchoServer* server = new ThreadEchoServer(worker);
+    CppServer::TcpServer::ptr holder(server);
+    server->setAffinity(CppServer::TcpServer::AFFINITY_LEAST_LOAD);
+    CppServer::Address::ptr addr = CppServer::Address::LookupAny("127.0.0.1:8036");
+    while (!server->bind(addr)) {
+        sleep(2);
+    }
+    server->start();
+
+    std::vector<CppServer::Socket::ptr> socks;
+    for (int i = 0; i < 12; ++i) {
+        CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+        if (sock->connect(addr)) {
+            socks.push_back(sock);
+        }
+    }
+    int moved = 0;
+    std::map<CppServer::Socket::ptr, int> threads = ping(socks, 20, moved);
+    CPPSERVER_LOG_INFO(g_logger) << "affinity load=" << dump_load(threads) << " moved=" << moved;
+
+    // 关掉两个线程上的全部连接, 剩下的一个线程负载超过阈值, 下次扫描时迁移
+    std::set<int> ids;
+    for (auto& i : threads) {
+        ids.insert(i.second);
+    }
+    ids.erase(ids.begin());
+    std::vector<CppServer::Socket::ptr> left;
+    for (auto& i : threads) {
+        if (ids.count(i.second)) {
+            i.first->close();
+        } else {
+            left.push_back(i.first);
+        }
+    }
+    sleep(2);
+    moved = 0;
+    threads = ping(left, 5, moved);
+    CPPSERVER_LOG_INFO(g_logger) << "after rebalance load=" << dump_load(threads)
+        << " migrations=" << server->getMigrations();
+    left.clear();
+    server->stop();
+}
+
+// 过载时回"busy"再关闭, 否则回"ok"
+class ShedServer : public CppServer::TcpServer {
+public:
+    ShedServer(CppServer::IOManager* worker)
+        : TcpServer(worker, CppServer::IOManager::GetThis()) {
+    }
+protected:
+    virtual void handleClient(CppServer::Socket::ptr client) override {
+        client->send("ok", 2);
+        client->close();
+    }
+    virtual void handleOverload(CppServer::Socket::ptr client) override {
+        client->send("busy", 4);
+        client->close();
+    }
+};
+
+std::string ask(CppServer::Address::ptr addr) {
+    CppServer::Socket::ptr sock = CppServer::Socket::CreateTCP(addr);
+    char buf[8];
+    int n = 0;
+    sock->setRecvTimeout(3000);
+    if (sock->connect(addr)) {
+        n = sock->recv(buf, sizeof(buf));
+    }
+    return n > 0 ? std::string(buf, n) : "error";
+}
+
+void test_overload() {
+    static CppServer::IOManager* worker = new CppServer::IOManager(1, false, "busy");
+    ShedServer* server = new ShedServer(worker);
+    CppServer::TcpServer::ptr holder(server);
+    server->setOverloadShed(true);
+    CppServer::Address::ptr addr = CppServer::Address::LookupAny("127.0.0.1:8037");
+    while (!server->bind(addr)) {
+        sleep(2);
+    }
+    server->start();
+    CPPSERVER_LOG_INFO(g_logger) << "idle: " << ask(addr);
+
+    // 压满worker: 150个各占2ms CPU的任务
+    for (int i = 0; i < 150; ++i) {
+        worker->schedule([]() {
+            uint64_t end = CppServer::GetMonotonicUS() + 2000;
+            while (CppServer::GetMonotonicUS() < end);
+        });
+    }
+    usleep(200 * 1000);
+    CPPSERVER_LOG_INFO(g_logger) << "overloaded=" << worker->isOverloaded()
+        << " queue_delay=" << worker->getQueueDelay() << "us";
+    std::string replies;
+    for (int i = 0; i < 5; ++i) {
+        replies += ask(addr) + " ";
+    }
+    CPPSERVER_LOG_INFO(g_logger) << "under overload: " << replies << "shed=" << server->getShed();
+
+    sleep(2);
+    CPPSERVER_LOG_INFO(g_logger) << "drained overloaded=" << worker->isOverloaded()
+        << " reply: " << ask(addr) << " accepted=" << server->getAccepted();
+    server->stop();
+}
+
 int main(int argc, char** argv) {
     CppServer::IOManager iom(2);
     iom.schedule(run);
+    iom.schedule(test_admission);
+    iom.schedule(test_idle_reap);
+    iom.schedule(test_affinity);
+    iom.schedule(test_overload);
     return 0;
 }